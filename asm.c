@@ -0,0 +1,989 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "asm.h"
+#include "names.h"
+#include "runtime.h"
+#include "fi.h"
+#include "slots.h"
+#include "util.h"
+
+/*
+ * An x86-64 backend that writes GNU assembler source. The output defines
+ * the same symbols as the C that print() writes, so it links against the
+ * runtime and against C callers in the same way.
+ *
+ * Each local slot and parameter of a function gets one location: the most
+ * used ones live in callee-saved registers and the rest in the frame, so
+ * nothing needs saving around calls. Tag tests, field loads and the
+ * allocation of tuples are inline; allocation bumps the thread's buffer,
+ * runtime_tlab, as storeAlloc does. rax, r10 and r11 are scratch registers
+ * for the inline sequences.
+ */
+
+static const char *argRegs[] = {
+    "%rdi", "%rsi", "%rdx", "%rcx", "%r8", "%r9",
+};
+
+/*
+ * Functions rewritten by unboxTuples return their values in these.
+ */
+static const char *returnRegs[] = {
+    "%rax", "%rdx", "%rcx", "%rsi", "%rdi", "%r8", "%r9",
+};
+
+static const char *savedRegs[] = {
+    "%rbx", "%r12", "%r13", "%r14", "%r15",
+};
+
+#define LOCATION_SIZE 64
+
+/*
+ * The function being assembled.
+ */
+struct function {
+    long name;
+    long blocks;
+    long next;
+    struct slots slots;
+    struct names params;
+    char (*locations)[LOCATION_SIZE];
+    int nrSaved;
+    int frameSize;
+};
+
+static FILE *out;
+
+static struct names funcs;
+static int *returnArities;
+
+static struct names conses;
+static int *consArities;
+
+static int nrStrings;
+static int nrLabels;
+
+static void emit(const char *format, ...)
+{
+    va_list ap;
+
+    va_start(ap, format);
+    vfprintf(out, format, ap);
+    va_end(ap);
+}
+
+static int returnArity(long name)
+{
+    int i;
+
+    i = names_find(&funcs, name);
+    return i < 0 || returnArities[i] == 0 ? 1 : returnArities[i];
+}
+
+/*
+ * Looks up the class number and arity of a constructor. Returns 0 if id
+ * does not name one.
+ */
+static int findClass(long id, unsigned short *class, int *arity)
+{
+    int i;
+
+    i = names_find(&conses, id);
+    if (i >= 0) {
+        *class = USER_CLASS_MIN + i;
+        *arity = consArities[i];
+        return 1;
+    }
+    i = fi_builtinClass(id);
+    if (i >= 0) {
+        *class = i;
+        *arity = runtime_classArities[*class];
+        return 1;
+    }
+    return 0;
+}
+
+static unsigned short classOf(long id)
+{
+    unsigned short class;
+    int arity;
+
+    if (!findClass(id, &class, &arity)) {
+        fprintf(stderr, "Constructor: %s\n", idString(id));
+        die("Unknown constructor.");
+    }
+    return class;
+}
+
+/*
+ * Returns the operand for a variable: its register or frame slot, the
+ * global of that name, or for a function its address as $name.
+ */
+static const char *location(struct function *fn, long id)
+{
+    static char globals[2][LOCATION_SIZE + 8];
+    static int next;
+    char *global;
+    int i;
+
+    i = slots_lookup(&fn->slots, id);
+    if (i >= 0)
+        return fn->locations[i];
+    i = names_find(&fn->params, id);
+    if (i >= 0)
+        return fn->locations[fn->slots.nrSlots + i];
+
+    global = globals[next];
+    next = !next;
+    if (names_find(&funcs, id) >= 0)
+        snprintf(global, sizeof(globals[0]), "$%s", idString(id));
+    else
+        snprintf(global, sizeof(globals[0]), "%s(%%rip)", idString(id));
+    return global;
+}
+
+static int isRegister(const char *operand)
+{
+    return operand[0] == '%';
+}
+
+/*
+ * Loads an operand into a register. Function addresses are taken relative
+ * to rip, so the code also links into position-independent executables.
+ */
+static void load(const char *reg, const char *from)
+{
+    if (from[0] == '$')
+        emit("\tleaq %s(%%rip), %s\n", from + 1, reg);
+    else
+        emit("\tmovq %s, %s\n", from, reg);
+}
+
+static void move(const char *to, const char *from)
+{
+    if (!strcmp(to, from))
+        return;
+    if (from[0] == '$' && isRegister(to)) {
+        load(to, from);
+    } else if (from[0] == '$') {
+        load("%rax", from);
+        emit("\tmovq %%rax, %s\n", to);
+    } else if (isRegister(to) || isRegister(from)) {
+        emit("\tmovq %s, %s\n", from, to);
+    } else {
+        emit("\tmovq %s, %%rax\n", from);
+        emit("\tmovq %%rax, %s\n", to);
+    }
+}
+
+static const char *stackParam(int i)
+{
+    static char operand[LOCATION_SIZE];
+
+    snprintf(operand, sizeof(operand), "%d(%%rbp)",
+        16 + 8 * (i - (int)ARRAY_SIZE(argRegs)));
+    return operand;
+}
+
+/*
+ * Location allocation.
+ */
+static void countUse(struct function *fn, int *uses, long id)
+{
+    int i;
+
+    i = slots_lookup(&fn->slots, id);
+    if (i < 0) {
+        i = names_find(&fn->params, id);
+        if (i < 0)
+            return;
+        i += fn->slots.nrSlots;
+    }
+    uses[i]++;
+}
+
+static void countUses(struct function *fn, int *uses, long ids)
+{
+    long id;
+
+    forEach(ids, id)
+        countUse(fn, uses, id);
+}
+
+static void countBlockUses(struct function *fn, int *uses, long block)
+{
+    long id, args, stmts, transfer, stmt, x, expr, f, ret, clauses;
+
+    match(block, CLASS_FiBlock, &id, &args, &stmts, &transfer);
+    countUses(fn, uses, args);
+    forEach(stmts, stmt) {
+        match(stmt, CLASS_FiStmt, &x, &expr);
+        countUse(fn, uses, x);
+        if (match(expr, CLASS_FiPrimApp, &f, &args)
+                || match(expr, CLASS_FiConsApp, &f, &args))
+            countUses(fn, uses, args);
+        else if (match(expr, CLASS_Id, &id))
+            countUse(fn, uses, expr);
+    }
+    if (match(transfer, CLASS_FiCall, &ret, &f, &args)
+            || match(transfer, CLASS_FiGoto, &f, &args)
+            || match(transfer, CLASS_FiReturnValues, &args))
+        countUses(fn, uses, args);
+    else if (match(transfer, CLASS_FiReturn, &x)
+            || match(transfer, CLASS_FiMatch, &x, &clauses))
+        countUse(fn, uses, x);
+}
+
+/*
+ * Gives the most used slots and parameters the callee-saved registers and
+ * the others a frame slot. Parameters the caller passed on the stack stay
+ * there unless they get a register.
+ */
+static void allocateLocations(struct function *fn)
+{
+    long block;
+    int *uses, *order;
+    int i, j, k, n, param, nrFrame = 0;
+
+    n = fn->slots.nrSlots + fn->params.nr;
+    fn->locations = calloc(n + 1, sizeof(*fn->locations));
+    uses = calloc(n + 1, sizeof(int));
+    order = calloc(n + 1, sizeof(int));
+    if (fn->locations == NULL || uses == NULL || order == NULL)
+        die("Failed to allocate memory.");
+
+    forEach(fn->blocks, block)
+        countBlockUses(fn, uses, block);
+
+    for (i = 0; i < n; i++) {
+        for (j = i; j > 0 && uses[order[j - 1]] < uses[i]; j--)
+            order[j] = order[j - 1];
+        order[j] = i;
+    }
+
+    fn->nrSaved = 0;
+    for (i = 0; i < n; i++) {
+        k = order[i];
+        param = k - fn->slots.nrSlots;
+        if (fn->nrSaved < ARRAY_SIZE(savedRegs) && uses[k] > 0) {
+            strcpy(fn->locations[k], savedRegs[fn->nrSaved++]);
+        } else if (param >= (int)ARRAY_SIZE(argRegs)) {
+            strcpy(fn->locations[k], stackParam(param));
+        } else {
+            nrFrame++;
+            snprintf(fn->locations[k], LOCATION_SIZE, "%d(%%rbp)",
+                -8 * (int)(ARRAY_SIZE(savedRegs) + nrFrame));
+        }
+    }
+
+    /*
+     * Frame slots sit below room for all the saved registers, so their
+     * offsets do not depend on how many get used. The stack stays 16-byte
+     * aligned at calls.
+     */
+    fn->frameSize = 0;
+    if (nrFrame > 0)
+        fn->frameSize = 8 * (ARRAY_SIZE(savedRegs) - fn->nrSaved + nrFrame);
+    if ((fn->nrSaved * 8 + fn->frameSize) % 16 != 0)
+        fn->frameSize += 8;
+
+    free(order);
+    free(uses);
+}
+
+/*
+ * Code sequences.
+ */
+static void epilogue(struct function *fn)
+{
+    int i;
+
+    if (fn->frameSize > 0)
+        emit("\tleaq %d(%%rbp), %%rsp\n", -8 * fn->nrSaved);
+    for (i = fn->nrSaved - 1; i >= 0; i--)
+        emit("\tpopq %s\n", savedRegs[i]);
+    emit("\tpopq %%rbp\n");
+}
+
+static void loadNumber(const char *to, long n)
+{
+    emit("\tmovabsq $%ld, %%rax\n", runtime_makeNumber(n));
+    move(to, "%rax");
+}
+
+static void emitString(long s)
+{
+    const unsigned char *c;
+
+    emit("\t.string \"");
+    for (c = (const unsigned char *)runtime_stringValue(s); *c; c++) {
+        if (*c == '"' || *c == '\\')
+            emit("\\%c", *c);
+        else if (*c < ' ' || *c > '~')
+            emit("\\%03o", *c);
+        else
+            emit("%c", *c);
+    }
+    emit("\"\n");
+}
+
+static void loadString(const char *to, long s)
+{
+    emit("\t.pushsection .rodata\n");
+    emit(".Lstring%d:\n", nrStrings);
+    emitString(s);
+    emit("\t.popsection\n");
+    emit("\tleaq .Lstring%d(%%rip), %%rdi\n", nrStrings++);
+    emit("\tcall runtime_makeString\n");
+    move(to, "%rax");
+}
+
+/*
+ * Allocates a tuple with the given fields from the thread's allocation
+ * buffer, refilling it out of line. Leaves the value in r11. Fields must
+ * not be in caller-saved registers, which the refill may clobber.
+ */
+static void allocate(unsigned short class, const char **fields, int n)
+{
+    int i, label;
+
+    if (n == 0) {
+        emit("\tmovq $%d, %%r11\n", (int)class);
+        return;
+    }
+
+    label = nrLabels++;
+    emit("\tmovq runtime_tlab@gottpoff(%%rip), %%r10\n");
+    emit("\tmovq %%fs:(%%r10), %%r11\n");
+    emit("\tleaq %d(%%r11), %%rax\n", 8 * n);
+    emit("\tcmpq %%fs:8(%%r10), %%rax\n");
+    emit("\tja .Lrefill%d\n", label);
+    emit("\tmovq %%rax, %%fs:(%%r10)\n");
+    emit(".Lallocated%d:\n", label);
+    emit("\tmovq runtime_store+16(%%rip), %%r10\n");
+    emit("\taddq %%r11, %%r10\n");
+    for (i = 0; i < n; i++) {
+        if (isRegister(fields[i])) {
+            emit("\tmovq %s, %d(%%r10)\n", fields[i], 8 * i);
+        } else {
+            load("%rax", fields[i]);
+            emit("\tmovq %%rax, %d(%%r10)\n", 8 * i);
+        }
+    }
+    emit("\tshlq $16, %%r11\n");
+    emit("\torq $%d, %%r11\n", (int)class);
+
+    emit("\t.pushsection .text.unlikely\n");
+    emit(".Lrefill%d:\n", label);
+    emit("\tmovl $%d, %%edi\n", 8 * n);
+    emit("\tcall runtime_tlabRefill\n");
+    emit("\tmovq %%rax, %%r11\n");
+    emit("\tjmp .Lallocated%d\n", label);
+    emit("\t.popsection\n");
+}
+
+static void allocateArgs(struct function *fn, unsigned short class,
+        long args)
+{
+    char (*operands)[LOCATION_SIZE + 8];
+    const char **fields;
+    long arg;
+    int i = 0, n;
+
+    n = length(args);
+    operands = calloc(n + 1, sizeof(*operands));
+    fields = calloc(n + 1, sizeof(*fields));
+    if (operands == NULL || fields == NULL)
+        die("Failed to allocate memory.");
+    forEach(args, arg) {
+        strcpy(operands[i], location(fn, arg));
+        fields[i] = operands[i];
+        i++;
+    }
+    allocate(class, fields, n);
+    free(fields);
+    free(operands);
+}
+
+/*
+ * fetch with the range check of prim_fetch inline. Out of range indexes,
+ * and Cons values inside a run of list elements, go to prim_fetch.
+ */
+static void fetch(struct function *fn, const char *to, long m, long k)
+{
+    int label = nrLabels++;
+
+    emit("\tmovq %s, %%rax\n", location(fn, m));
+    emit("\tmovq %s, %%rdx\n", location(fn, k));
+    emit("\tmovq %%rax, %%rcx\n");
+    emit("\tshrq $48, %%rcx\n");
+    emit("\tjnz .Lslow%d\n", label);
+    emit("\tmovzwl %%ax, %%ecx\n");
+    emit("\tleaq runtime_classArities(%%rip), %%rsi\n");
+    emit("\tmovzbl (%%rsi,%%rcx), %%ecx\n");
+    emit("\tsarq $16, %%rdx\n");
+    emit("\tcmpq %%rcx, %%rdx\n");
+    emit("\tjb .Lfetch%d\n", label);
+    emit(".Lslow%d:\n", label);
+    emit("\tmovq %%rax, %%rdi\n");
+    emit("\tmovq %s, %%rsi\n", location(fn, k));
+    emit("\tcall prim_fetch\n");
+    emit("\tjmp .Lfetched%d\n", label);
+    emit(".Lfetch%d:\n", label);
+    emit("\tshrq $16, %%rax\n");
+    emit("\taddq runtime_store+16(%%rip), %%rax\n");
+    emit("\tmovq (%%rax,%%rdx,8), %%rax\n");
+    emit(".Lfetched%d:\n", label);
+    move(to, "%rax");
+}
+
+/*
+ * Loads the tail of the Cons value in rdx, whose cell rax points to, into
+ * rcx. Inside a run the tail is the same value moved one element on, with
+ * one less element left; otherwise it is the second word of the cell.
+ */
+static void consTail(void)
+{
+    emit("\tmovq 8(%%rax), %%rcx\n");
+    emit("\tmovabsq $%ld, %%r10\n", (long)(8L << 16) - (1L << 48));
+    emit("\taddq %%rdx, %%r10\n");
+    emit("\tmovq %%rdx, %%r11\n");
+    emit("\tshrq $48, %%r11\n");
+    emit("\tcmovnzq %%r10, %%rcx\n");
+}
+
+/*
+ * Puts the arguments of a call in place. Arguments beyond the sixth are
+ * pushed; returns the number of bytes to pop after the call.
+ */
+static int passArgs(struct function *fn, long args)
+{
+    long arg, *stack;
+    int i = 0, n, bytes = 0;
+
+    n = length(args);
+    if (n > ARRAY_SIZE(argRegs)) {
+        stack = calloc(n, sizeof(long));
+        if (stack == NULL)
+            die("Failed to allocate memory.");
+        forEach(args, arg)
+            stack[i++] = arg;
+        bytes = 8 * (n - ARRAY_SIZE(argRegs));
+        if (bytes % 16 != 0) {
+            emit("\tsubq $8, %%rsp\n");
+            bytes += 8;
+        }
+        for (i = n - 1; i >= ARRAY_SIZE(argRegs); i--)
+            if (location(fn, stack[i])[0] == '$') {
+                load("%rax", location(fn, stack[i]));
+                emit("\tpushq %%rax\n");
+            } else {
+                emit("\tpushq %s\n", location(fn, stack[i]));
+            }
+        free(stack);
+    }
+
+    i = 0;
+    forEach(args, arg) {
+        if (i < ARRAY_SIZE(argRegs))
+            move(argRegs[i], location(fn, arg));
+        i++;
+    }
+    return bytes;
+}
+
+static const char *symbol(long f)
+{
+    static char s[LOCATION_SIZE + 8];
+
+    if (runtime_isPrim(idString(f)))
+        snprintf(s, sizeof(s), "prim_%s", idString(f));
+    else
+        snprintf(s, sizeof(s), "%s", idString(f));
+    return s;
+}
+
+static long findArgs(long label, long blocks)
+{
+    long id, args, stmts, transfer, block;
+
+    forEach(blocks, block) {
+        if (match(block, CLASS_FiBlock, &id, &args, &stmts, &transfer))
+            if (idEq(id, label))
+                return args;
+    }
+
+    die("Failed to find arguments for block.");
+    return nil;
+}
+
+static void jumpAlways(struct function *fn, long label)
+{
+    emit("\tjmp .L%s.%s\n", idString(fn->name), idString(label));
+}
+
+/*
+ * Jumps to a block at the end of another, unless it is laid out next.
+ */
+static void jump(struct function *fn, long label)
+{
+    if (fn->next == nil || !idEq(label, fn->next))
+        jumpAlways(fn, label);
+}
+
+static void asmStmt(struct function *fn, long stmt)
+{
+    char to[LOCATION_SIZE + 8];
+    long x, expr, f, args, m, k, rest, name;
+    unsigned short class;
+    int arity, bytes;
+
+    match(stmt, CLASS_FiStmt, &x, &expr);
+    strcpy(to, location(fn, x));
+
+    if (match(expr, CLASS_FiPrimApp, &f, &args)) {
+        if (!strcmp(idString(f), "fetch")
+                && match(args, CLASS_Cons, &m, &rest)
+                && match(rest, CLASS_Cons, &k, &rest) && rest == nil) {
+            fetch(fn, to, m, k);
+        } else if (!strcmp(idString(f), "cons") && length(args) == 2) {
+            allocateArgs(fn, CLASS_Cons, args);
+            move(to, "%r11");
+        } else {
+            bytes = passArgs(fn, args);
+            emit("\tcall prim_%s\n", idString(f));
+            if (bytes > 0)
+                emit("\taddq $%d, %%rsp\n", bytes);
+            move(to, "%rax");
+        }
+    } else if (match(expr, CLASS_FiConsApp, &f, &args)) {
+        if (!findClass(f, &class, &arity) || arity != length(args))
+            die("Wrong constructor application.");
+        allocateArgs(fn, class, args);
+        move(to, "%r11");
+    } else if (match(expr, CLASS_Fixnum)) {
+        loadNumber(to, runtime_fixnumValue(expr));
+    } else if (match(expr, CLASS_String)) {
+        loadString(to, expr);
+    } else if (match(expr, CLASS_Id, &name)) {
+        move(to, location(fn, expr));
+    } else {
+        fprintf(stderr, "Expression class: %d.\n", (int)runtime_class(expr));
+        die("Unknown expression class.");
+    }
+}
+
+static void asmCall(struct function *fn, long ret, long f, long args)
+{
+    long vars, var;
+    unsigned short class;
+    int arity, bytes, n, i = 0;
+
+    if (findClass(f, &class, &arity)) {
+        /*
+         * Calls to constructors allocate inline.
+         */
+        if (arity != length(args))
+            die("Wrong constructor application.");
+        allocateArgs(fn, class, args);
+        emit("\tmovq %%r11, %%rax\n");
+        n = 1;
+    } else if (match(ret, CLASS_Nil) && length(args) <= ARRAY_SIZE(argRegs)) {
+        passArgs(fn, args);
+        epilogue(fn);
+        emit("\tjmp %s\n", symbol(f));
+        return;
+    } else {
+        bytes = passArgs(fn, args);
+        emit("\tcall %s\n", symbol(f));
+        if (bytes > 0)
+            emit("\taddq $%d, %%rsp\n", bytes);
+        n = returnArity(f);
+    }
+
+    if (match(ret, CLASS_Nil)) {
+        epilogue(fn);
+        emit("\tret\n");
+        return;
+    }
+
+    vars = findArgs(ret, fn->blocks);
+    if (n > ARRAY_SIZE(returnRegs) || length(vars) != n)
+        die("Wrong number of values returned.");
+    forEach(vars, var)
+        move(location(fn, var), returnRegs[i++]);
+    jump(fn, ret);
+}
+
+static void asmMatch(struct function *fn, long x, long clauses)
+{
+    long clause, cons, label, arg, args;
+    const char *to;
+    int first, last, i, j, hasElse = 0;
+
+    emit("\tmovq %s, %%rax\n", location(fn, x));
+    emit("\tmovzwl %%ax, %%ecx\n");
+
+    first = nrLabels;
+    last = -1;
+    i = 0;
+    forEach(clauses, clause) {
+        if (match(clause, CLASS_FiCase, &cons, &label)) {
+            emit("\tcmpl $%d, %%ecx\n", (int)classOf(cons));
+            emit("\tje .Lcase%d\n", first + i);
+            last = i;
+        }
+        i++;
+    }
+    nrLabels += i + 1;
+
+    forEach(clauses, clause) {
+        if (match(clause, CLASS_FiElse, &label) && !hasElse) {
+            if (last < 0)
+                jump(fn, label);
+            else
+                jumpAlways(fn, label);
+            hasElse = 1;
+        }
+    }
+    if (!hasElse) {
+        /*
+         * Match failures are kept out of the way of the hot code.
+         */
+        emit("\tjmp .Lcase%d\n", first + i);
+        emit("\t.pushsection .text.unlikely\n");
+        emit(".Lcase%d:\n", first + i);
+        emit("\tmovq %%rax, %%rdi\n");
+        emit("\tcall runtime_class\n");
+        emit("\txorl %%edi, %%edi\n");
+        emit("\tcall runtime_matchFailure\n");
+        emit("\t.popsection\n");
+    }
+
+    /*
+     * Cases load the fields into the arguments of their block.
+     */
+    i = 0;
+    forEach(clauses, clause) {
+        if (match(clause, CLASS_FiCase, &cons, &label)) {
+            emit(".Lcase%d:\n", first + i);
+            args = findArgs(label, fn->blocks);
+            if (args != nil) {
+                emit("\tmovq %%rax, %%rdx\n");
+                emit("\tshrq $16, %%rax\n");
+                emit("\tmovl %%eax, %%eax\n");
+                emit("\taddq runtime_store+16(%%rip), %%rax\n");
+            }
+            j = 0;
+            forEach(args, arg) {
+                to = location(fn, arg);
+                if (j == 1 && classOf(cons) == CLASS_Cons) {
+                    consTail();
+                    emit("\tmovq %%rcx, %s\n", to);
+                    j++;
+                } else if (isRegister(to)) {
+                    emit("\tmovq %d(%%rax), %s\n", 8 * j++, to);
+                } else {
+                    emit("\tmovq %d(%%rax), %%rcx\n", 8 * j++);
+                    emit("\tmovq %%rcx, %s\n", to);
+                }
+            }
+            if (i == last)
+                jump(fn, label);
+            else
+                jumpAlways(fn, label);
+        }
+        i++;
+    }
+}
+
+static void asmTransfer(struct function *fn, long transfer)
+{
+    long ret, f, args, formal, arg, x, clauses;
+    int i = 0;
+
+    if (match(transfer, CLASS_FiCall, &ret, &f, &args)) {
+        asmCall(fn, ret, f, args);
+    } else if (match(transfer, CLASS_FiGoto, &f, &args)) {
+        /*
+         * slots.c never shares the slot of a formal with an actual that is
+         * copied after it, so the copies can be done in order.
+         */
+        forEach(findArgs(f, fn->blocks), formal) {
+            if (!match(args, CLASS_Cons, &arg, &args))
+                die("Wrong number of arguments in goto.");
+            move(location(fn, formal), location(fn, arg));
+        }
+        jump(fn, f);
+    } else if (match(transfer, CLASS_FiReturn, &x)) {
+        move("%rax", location(fn, x));
+        epilogue(fn);
+        emit("\tret\n");
+    } else if (match(transfer, CLASS_FiReturnValues, &args)) {
+        if (length(args) > ARRAY_SIZE(returnRegs))
+            die("Too many values returned.");
+        forEach(args, arg)
+            move(returnRegs[i++], location(fn, arg));
+        epilogue(fn);
+        emit("\tret\n");
+    } else if (match(transfer, CLASS_FiMatch, &x, &clauses)) {
+        asmMatch(fn, x, clauses);
+    }
+}
+
+/*
+ * Functions are global unless local is set, as for the bodies of memoized
+ * functions, which C declares static.
+ */
+static void beginFunction(const char *name, int local)
+{
+    emit("\n");
+    emit("\t%s %s\n", local ? ".local" : ".globl", name);
+    emit("\t.type %s, @function\n", name);
+    emit("%s:\n", name);
+    emit("\tpushq %%rbp\n");
+    emit("\tmovq %%rsp, %%rbp\n");
+}
+
+static void endFunction(const char *name)
+{
+    emit("\t.size %s, .-%s\n", name, name);
+}
+
+static long blockLabel(long blocks)
+{
+    long block, id, args, stmts, transfer;
+
+    if (!match(blocks, CLASS_Cons, &block, &blocks))
+        return nil;
+    match(block, CLASS_FiBlock, &id, &args, &stmts, &transfer);
+    return id;
+}
+
+/*
+ * Blocks are emitted in the order of fi_layoutBlocks, without jumps to the
+ * block that comes next. Cold blocks go to .text.unlikely.
+ */
+static void asmFunction(long id, long params, long blocks)
+{
+    struct function fn;
+    long param, layout, rest, block, label, args, stmts, transfer, stmt;
+    char *name;
+    int i, nrHot;
+
+    name = malloc(strlen(idString(id)) + 6);
+    if (name == NULL)
+        die("Failed to allocate memory.");
+    strcpy(name, idString(id));
+    if (fi_isMemoized(id))
+        strcat(name, "_body");
+
+    fn.name = id;
+    fn.blocks = blocks;
+    slots_init(&fn.slots, blocks);
+    names_init(&fn.params);
+    forEach(params, param)
+        names_add(&fn.params, param);
+    allocateLocations(&fn);
+
+    beginFunction(name, fi_isMemoized(id));
+    for (i = 0; i < fn.nrSaved; i++)
+        emit("\tpushq %s\n", savedRegs[i]);
+    if (fn.frameSize > 0)
+        emit("\tsubq $%d, %%rsp\n", fn.frameSize);
+    i = 0;
+    forEach(params, param) {
+        if (i < ARRAY_SIZE(argRegs))
+            move(location(&fn, param), argRegs[i]);
+        else
+            move(location(&fn, param), stackParam(i));
+        i++;
+    }
+
+    layout = fi_layoutBlocks(blocks, &nrHot);
+    i = 0;
+    for (rest = layout; match(rest, CLASS_Cons, &block, &rest); i++) {
+        match(block, CLASS_FiBlock, &label, &args, &stmts, &transfer);
+        fn.next = i + 1 == nrHot ? nil : blockLabel(rest);
+        if (i == nrHot)
+            emit("\t.section .text.unlikely\n");
+        emit(".L%s.%s:\n", idString(id), idString(label));
+        forEach(stmts, stmt)
+            asmStmt(&fn, stmt);
+        asmTransfer(&fn, transfer);
+    }
+    if (i > nrHot)
+        emit("\t.text\n");
+    endFunction(name);
+
+    free(name);
+    free(fn.locations);
+    names_release(&fn.params);
+    slots_release(&fn.slots);
+}
+
+/*
+ * A memoized function is a wrapper that passes its arguments, in an array
+ * on the stack, and its body to runtime_memoCall, along with the word that
+ * holds its memo table.
+ */
+static void asmMemoWrapper(long id, long params)
+{
+    const char *name = idString(id);
+    int i, n;
+
+    n = length(params);
+    if (n > RUNTIME_MEMO_MAX_ARGS || returnArity(id) > 1) {
+        fprintf(stderr, "Function: %s\n", name);
+        die("Memoized functions take at most four arguments and return "
+            "one value.");
+    }
+
+    emit("\t.pushsection .rodata\n");
+    emit(".Lstring%d:\n", nrStrings);
+    emit("\t.string \"%s\"\n", name);
+    emit("\t.popsection\n");
+    emit("\t.local %s_table\n", name);
+    emit("\t.comm %s_table, 8, 8\n", name);
+
+    beginFunction(name, 0);
+    emit("\tsubq $%d, %%rsp\n", 8 * RUNTIME_MEMO_MAX_ARGS);
+    for (i = 0; i < n; i++)
+        emit("\tmovq %s, %d(%%rsp)\n", argRegs[i], 8 * i);
+    emit("\tmovq %%rsp, %%r8\n");
+    emit("\tmovl $%d, %%ecx\n", n);
+    emit("\tleaq %s_body(%%rip), %%rdx\n", name);
+    emit("\tleaq .Lstring%d(%%rip), %%rsi\n", nrStrings++);
+    emit("\tleaq %s_table(%%rip), %%rdi\n", name);
+    emit("\tcall runtime_memoCall\n");
+    emit("\tmovq %%rbp, %%rsp\n");
+    emit("\tpopq %%rbp\n");
+    emit("\tret\n");
+    endFunction(name);
+}
+
+/*
+ * Constructor functions, for callers written in C. They pass their fields
+ * to runtime_makeTuple in an array on the stack.
+ */
+static void asmCons(long id, long args)
+{
+    int i, n;
+
+    n = length(args);
+    beginFunction(idString(id), 0);
+    if (n == 0) {
+        emit("\tmovq $%d, %%rax\n", (int)classOf(id));
+    } else {
+        if (n % 2 != 0)
+            emit("\tsubq $8, %%rsp\n");
+        for (i = n - 1; i >= 0; i--) {
+            if (i < ARRAY_SIZE(argRegs))
+                emit("\tpushq %s\n", argRegs[i]);
+            else
+                emit("\tpushq %s\n", stackParam(i));
+        }
+        emit("\tmovq %%rsp, %%rdx\n");
+        emit("\tmovl $%d, %%esi\n", n);
+        emit("\tmovl $%d, %%edi\n", (int)classOf(id));
+        emit("\tcall runtime_makeTuple\n");
+        emit("\tmovq %%rbp, %%rsp\n");
+    }
+    emit("\tpopq %%rbp\n");
+    emit("\tret\n");
+    endFunction(idString(id));
+}
+
+/*
+ * compiler_init() (For setting globals)
+ */
+static void asmInit(long fi)
+{
+    long def, id, value;
+    int i;
+
+    beginFunction("compiler_init", 0);
+    for (i = 0; i < conses.nr; i++) {
+        emit("\tmovb $%d, runtime_classArities+%d(%%rip)\n",
+            consArities[i], USER_CLASS_MIN + i);
+    }
+    forEach(fi, def) {
+        if (match(def, CLASS_FiDefineVar, &id, &value)) {
+            if (match(value, CLASS_Fixnum))
+                loadNumber("%rax", runtime_fixnumValue(value));
+            else if (match(value, CLASS_String))
+                loadString("%rax", value);
+            else
+                die("Unknown constant type.");
+            emit("\tmovq %%rax, %s(%%rip)\n", idString(id));
+        }
+    }
+    emit("\tpopq %%rbp\n");
+    emit("\tret\n");
+    endFunction("compiler_init");
+}
+
+void assemble(long fi, FILE *stream)
+{
+    long def, id, args, value, blocks;
+    int n;
+
+    out = stream;
+    nrStrings = 0;
+    nrLabels = 0;
+
+    returnArities = fi_returnArities(fi, &funcs);
+
+    names_init(&conses);
+    consArities = calloc(length(fi) + 1, sizeof(int));
+    if (consArities == NULL)
+        die("Failed to allocate memory.");
+    forEach(fi, def) {
+        if (match(def, CLASS_FiDefineCons, &id, &args)) {
+            n = length(args);
+            if (n > 255)
+                die("Constructor has too many fields.");
+            consArities[names_add(&conses, id)] = n;
+        }
+    }
+
+    /*
+     * Globals.
+     */
+    emit("\t.bss\n");
+    forEach(fi, def) {
+        if (match(def, CLASS_FiDefineVar, &id, &value)) {
+            emit("\t.globl %s\n", idString(id));
+            emit("\t.align 8\n");
+            emit("%s:\n", idString(id));
+            emit("\t.zero 8\n");
+        }
+    }
+
+    /*
+     * Definitions.
+     */
+    emit("\n");
+    emit("\t.text\n");
+    forEach(fi, def) {
+        if (match(def, CLASS_FiDefineFunc, &id, &args, &blocks)) {
+            asmFunction(id, args, blocks);
+            if (fi_isMemoized(id))
+                asmMemoWrapper(id, args);
+        } else if (match(def, CLASS_FiDefineCons, &id, &args)) {
+            asmCons(id, args);
+        }
+    }
+
+    asmInit(fi);
+
+    emit("\n");
+    emit("\t.section .note.GNU-stack,\"\",@progbits\n");
+
+    free(consArities);
+    names_release(&conses);
+    names_release(&funcs);
+    free(returnArities);
+}
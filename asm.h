@@ -0,0 +1 @@
+void assemble(long fi, FILE *out);
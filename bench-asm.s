@@ -0,0 +1,596 @@
+	.bss
+
+	.text
+
+	.globl Pair
+	.type Pair, @function
+Pair:
+	pushq %rbp
+	movq %rsp, %rbp
+	pushq %rsi
+	pushq %rdi
+	movq %rsp, %rdx
+	movl $2, %esi
+	movl $35, %edi
+	call runtime_makeTuple
+	movq %rbp, %rsp
+	popq %rbp
+	ret
+	.size Pair, .-Pair
+
+	.globl Leaf
+	.type Leaf, @function
+Leaf:
+	pushq %rbp
+	movq %rsp, %rbp
+	movq $36, %rax
+	popq %rbp
+	ret
+	.size Leaf, .-Leaf
+
+	.globl Node
+	.type Node, @function
+Node:
+	pushq %rbp
+	movq %rsp, %rbp
+	subq $8, %rsp
+	pushq %rdx
+	pushq %rsi
+	pushq %rdi
+	movq %rsp, %rdx
+	movl $3, %esi
+	movl $37, %edi
+	call runtime_makeTuple
+	movq %rbp, %rsp
+	popq %rbp
+	ret
+	.size Node, .-Node
+
+	.globl rev
+	.type rev, @function
+rev:
+	pushq %rbp
+	movq %rsp, %rbp
+	pushq %rbx
+	pushq %r12
+	pushq %r13
+	pushq %r14
+	pushq %r15
+	subq $8, %rsp
+	movq %rdi, %r15
+.Lrev.L1:
+	movq %r15, %r12
+	movq nil(%rip), %rbx
+.Lrev.L2:
+	movq %r12, %rax
+	movzwl %ax, %ecx
+	cmpl $3, %ecx
+	je .Lcase0
+	jmp .Lrev.L4
+.Lcase0:
+	movq %rax, %rdx
+	shrq $16, %rax
+	movl %eax, %eax
+	addq runtime_store+16(%rip), %rax
+	movq 0(%rax), %r13
+	movq 8(%rax), %rcx
+	movabsq $-281474976186368, %r10
+	addq %rdx, %r10
+	movq %rdx, %r11
+	shrq $48, %r11
+	cmovnzq %r10, %rcx
+	movq %rcx, %r14
+.Lrev.L3:
+	movq runtime_tlab@gottpoff(%rip), %r10
+	movq %fs:(%r10), %r11
+	leaq 16(%r11), %rax
+	cmpq %fs:8(%r10), %rax
+	ja .Lrefill3
+	movq %rax, %fs:(%r10)
+.Lallocated3:
+	movq runtime_store+16(%rip), %r10
+	addq %r11, %r10
+	movq %r13, 0(%r10)
+	movq %rbx, 8(%r10)
+	shlq $16, %r11
+	orq $3, %r11
+	.pushsection .text.unlikely
+.Lrefill3:
+	movl $16, %edi
+	call runtime_tlabRefill
+	movq %rax, %r11
+	jmp .Lallocated3
+	.popsection
+	movq %r11, %rbx
+	movq %r14, %r12
+	jmp .Lrev.L2
+.Lrev.L4:
+	movq %rbx, %rax
+	leaq -40(%rbp), %rsp
+	popq %r15
+	popq %r14
+	popq %r13
+	popq %r12
+	popq %rbx
+	popq %rbp
+	ret
+	.size rev, .-rev
+
+	.globl append
+	.type append, @function
+append:
+	pushq %rbp
+	movq %rsp, %rbp
+	pushq %rbx
+	pushq %r12
+	pushq %r13
+	pushq %r14
+	movq %rdi, %r14
+	movq %rsi, %r13
+.Lappend.L1:
+	movq %r14, %rax
+	movzwl %ax, %ecx
+	cmpl $3, %ecx
+	je .Lcase4
+	jmp .Lappend.L3
+.Lcase4:
+	movq %rax, %rdx
+	shrq $16, %rax
+	movl %eax, %eax
+	addq runtime_store+16(%rip), %rax
+	movq 0(%rax), %rbx
+	movq 8(%rax), %rcx
+	movabsq $-281474976186368, %r10
+	addq %rdx, %r10
+	movq %rdx, %r11
+	shrq $48, %r11
+	cmovnzq %r10, %rcx
+	movq %rcx, %r12
+.Lappend.L2:
+	movq %r12, %rdi
+	movq %r13, %rsi
+	call append
+	movq %rax, %r12
+.Lappend.L4:
+	movq runtime_tlab@gottpoff(%rip), %r10
+	movq %fs:(%r10), %r11
+	leaq 16(%r11), %rax
+	cmpq %fs:8(%r10), %rax
+	ja .Lrefill7
+	movq %rax, %fs:(%r10)
+.Lallocated7:
+	movq runtime_store+16(%rip), %r10
+	addq %r11, %r10
+	movq %rbx, 0(%r10)
+	movq %r12, 8(%r10)
+	shlq $16, %r11
+	orq $3, %r11
+	.pushsection .text.unlikely
+.Lrefill7:
+	movl $16, %edi
+	call runtime_tlabRefill
+	movq %rax, %r11
+	jmp .Lallocated7
+	.popsection
+	movq %r11, %rbx
+	movq %rbx, %rax
+	popq %r14
+	popq %r13
+	popq %r12
+	popq %rbx
+	popq %rbp
+	ret
+.Lappend.L3:
+	movq %r13, %rax
+	popq %r14
+	popq %r13
+	popq %r12
+	popq %rbx
+	popq %rbp
+	ret
+	.size append, .-append
+
+	.globl split
+	.type split, @function
+split:
+	pushq %rbp
+	movq %rsp, %rbp
+	pushq %rbx
+	pushq %r12
+	pushq %r13
+	pushq %r14
+	pushq %r15
+	subq $8, %rsp
+	movq %rdi, %r15
+.Lsplit.L1:
+	movq %r15, %rax
+	movzwl %ax, %ecx
+	cmpl $3, %ecx
+	je .Lcase8
+	jmp .Lsplit.L3
+.Lcase8:
+	movq %rax, %rdx
+	shrq $16, %rax
+	movl %eax, %eax
+	addq runtime_store+16(%rip), %rax
+	movq 0(%rax), %rbx
+	movq 8(%rax), %rcx
+	movabsq $-281474976186368, %r10
+	addq %rdx, %r10
+	movq %rdx, %r11
+	shrq $48, %r11
+	cmovnzq %r10, %rcx
+	movq %rcx, %r12
+.Lsplit.L2:
+	movq %r12, %rax
+	movzwl %ax, %ecx
+	cmpl $3, %ecx
+	je .Lcase11
+	jmp .Lsplit.L5
+.Lcase11:
+	movq %rax, %rdx
+	shrq $16, %rax
+	movl %eax, %eax
+	addq runtime_store+16(%rip), %rax
+	movq 0(%rax), %r14
+	movq 8(%rax), %rcx
+	movabsq $-281474976186368, %r10
+	addq %rdx, %r10
+	movq %rdx, %r11
+	shrq $48, %r11
+	cmovnzq %r10, %rcx
+	movq %rcx, %r13
+.Lsplit.L4:
+	movq %r13, %rdi
+	call split
+	movq %rax, %r12
+	movq %rdx, %r13
+.Lsplit.L7:
+	movq runtime_tlab@gottpoff(%rip), %r10
+	movq %fs:(%r10), %r11
+	leaq 16(%r11), %rax
+	cmpq %fs:8(%r10), %rax
+	ja .Lrefill14
+	movq %rax, %fs:(%r10)
+.Lallocated14:
+	movq runtime_store+16(%rip), %r10
+	addq %r11, %r10
+	movq %rbx, 0(%r10)
+	movq %r12, 8(%r10)
+	shlq $16, %r11
+	orq $3, %r11
+	.pushsection .text.unlikely
+.Lrefill14:
+	movl $16, %edi
+	call runtime_tlabRefill
+	movq %rax, %r11
+	jmp .Lallocated14
+	.popsection
+	movq %r11, %rbx
+	movq runtime_tlab@gottpoff(%rip), %r10
+	movq %fs:(%r10), %r11
+	leaq 16(%r11), %rax
+	cmpq %fs:8(%r10), %rax
+	ja .Lrefill15
+	movq %rax, %fs:(%r10)
+.Lallocated15:
+	movq runtime_store+16(%rip), %r10
+	addq %r11, %r10
+	movq %r14, 0(%r10)
+	movq %r13, 8(%r10)
+	shlq $16, %r11
+	orq $3, %r11
+	.pushsection .text.unlikely
+.Lrefill15:
+	movl $16, %edi
+	call runtime_tlabRefill
+	movq %rax, %r11
+	jmp .Lallocated15
+	.popsection
+	movq %r11, %r12
+	movq %rbx, %rax
+	movq %r12, %rdx
+	leaq -40(%rbp), %rsp
+	popq %r15
+	popq %r14
+	popq %r13
+	popq %r12
+	popq %rbx
+	popq %rbp
+	ret
+.Lsplit.L5:
+	movq runtime_tlab@gottpoff(%rip), %r10
+	movq %fs:(%r10), %r11
+	leaq 16(%r11), %rax
+	cmpq %fs:8(%r10), %rax
+	ja .Lrefill16
+	movq %rax, %fs:(%r10)
+.Lallocated16:
+	movq runtime_store+16(%rip), %r10
+	addq %r11, %r10
+	movq %rbx, 0(%r10)
+	movq nil(%rip), %rax
+	movq %rax, 8(%r10)
+	shlq $16, %r11
+	orq $3, %r11
+	.pushsection .text.unlikely
+.Lrefill16:
+	movl $16, %edi
+	call runtime_tlabRefill
+	movq %rax, %r11
+	jmp .Lallocated16
+	.popsection
+	movq %r11, %rbx
+	movq %rbx, %rax
+	movq nil(%rip), %rdx
+	leaq -40(%rbp), %rsp
+	popq %r15
+	popq %r14
+	popq %r13
+	popq %r12
+	popq %rbx
+	popq %rbp
+	ret
+.Lsplit.L3:
+	movq nil(%rip), %rax
+	movq nil(%rip), %rdx
+	leaq -40(%rbp), %rsp
+	popq %r15
+	popq %r14
+	popq %r13
+	popq %r12
+	popq %rbx
+	popq %rbp
+	ret
+	.size split, .-split
+
+	.globl tree
+	.type tree, @function
+tree:
+	pushq %rbp
+	movq %rsp, %rbp
+	pushq %rbx
+	pushq %r12
+	pushq %r13
+	pushq %r14
+	movq %rdi, %r14
+.Ltree.L1:
+	movq %r14, %rax
+	movzwl %ax, %ecx
+	cmpl $3, %ecx
+	je .Lcase17
+	jmp .Ltree.L3
+.Lcase17:
+	movq %rax, %rdx
+	shrq $16, %rax
+	movl %eax, %eax
+	addq runtime_store+16(%rip), %rax
+	movq 0(%rax), %rbx
+	movq 8(%rax), %rcx
+	movabsq $-281474976186368, %r10
+	addq %rdx, %r10
+	movq %rdx, %r11
+	shrq $48, %r11
+	cmovnzq %r10, %rcx
+	movq %rcx, %r12
+.Ltree.L2:
+	movq %r12, %rdi
+	call split
+	movq %rax, %r12
+	movq %rdx, %r13
+.Ltree.L5:
+	movq %r12, %rdi
+	call tree
+	movq %rax, %r12
+.Ltree.L6:
+	movq %r13, %rdi
+	call tree
+	movq %rax, %r13
+.Ltree.L7:
+	movq runtime_tlab@gottpoff(%rip), %r10
+	movq %fs:(%r10), %r11
+	leaq 24(%r11), %rax
+	cmpq %fs:8(%r10), %rax
+	ja .Lrefill20
+	movq %rax, %fs:(%r10)
+.Lallocated20:
+	movq runtime_store+16(%rip), %r10
+	addq %r11, %r10
+	movq %r12, 0(%r10)
+	movq %rbx, 8(%r10)
+	movq %r13, 16(%r10)
+	shlq $16, %r11
+	orq $37, %r11
+	.pushsection .text.unlikely
+.Lrefill20:
+	movl $24, %edi
+	call runtime_tlabRefill
+	movq %rax, %r11
+	jmp .Lallocated20
+	.popsection
+	movq %r11, %rbx
+	movq %rbx, %rax
+	popq %r14
+	popq %r13
+	popq %r12
+	popq %rbx
+	popq %rbp
+	ret
+.Ltree.L3:
+	movq $36, %r11
+	movq %r11, %rbx
+	movq %rbx, %rax
+	popq %r14
+	popq %r13
+	popq %r12
+	popq %rbx
+	popq %rbp
+	ret
+	.size tree, .-tree
+
+	.globl flatten
+	.type flatten, @function
+flatten:
+	pushq %rbp
+	movq %rsp, %rbp
+	pushq %rbx
+	pushq %r12
+	pushq %r13
+	pushq %r14
+	movq %rdi, %r14
+.Lflatten.L1:
+	movq %r14, %rax
+	movzwl %ax, %ecx
+	cmpl $37, %ecx
+	je .Lcase21
+	cmpl $36, %ecx
+	je .Lcase22
+	jmp .Lcase23
+	.pushsection .text.unlikely
+.Lcase23:
+	movq %rax, %rdi
+	call runtime_class
+	xorl %edi, %edi
+	call runtime_matchFailure
+	.popsection
+.Lcase21:
+	movq %rax, %rdx
+	shrq $16, %rax
+	movl %eax, %eax
+	addq runtime_store+16(%rip), %rax
+	movq 0(%rax), %rbx
+	movq 8(%rax), %r12
+	movq 16(%rax), %r13
+	jmp .Lflatten.L2
+.Lcase22:
+	jmp .Lflatten.L3
+.Lflatten.L2:
+	movq %rbx, %rdi
+	call flatten
+	movq %rax, %rbx
+.Lflatten.L4:
+	movq %r13, %rdi
+	call flatten
+	movq %rax, %r13
+.Lflatten.L5:
+	movq runtime_tlab@gottpoff(%rip), %r10
+	movq %fs:(%r10), %r11
+	leaq 16(%r11), %rax
+	cmpq %fs:8(%r10), %rax
+	ja .Lrefill24
+	movq %rax, %fs:(%r10)
+.Lallocated24:
+	movq runtime_store+16(%rip), %r10
+	addq %r11, %r10
+	movq %r12, 0(%r10)
+	movq %r13, 8(%r10)
+	shlq $16, %r11
+	orq $3, %r11
+	.pushsection .text.unlikely
+.Lrefill24:
+	movl $16, %edi
+	call runtime_tlabRefill
+	movq %rax, %r11
+	jmp .Lallocated24
+	.popsection
+	movq %r11, %r12
+	movq %rbx, %rdi
+	movq %r12, %rsi
+	popq %r14
+	popq %r13
+	popq %r12
+	popq %rbx
+	popq %rbp
+	jmp append
+.Lflatten.L3:
+	movq nil(%rip), %rax
+	popq %r14
+	popq %r13
+	popq %r12
+	popq %rbx
+	popq %rbp
+	ret
+	.size flatten, .-flatten
+
+	.globl stats
+	.type stats, @function
+stats:
+	pushq %rbp
+	movq %rsp, %rbp
+	pushq %rbx
+	pushq %r12
+	pushq %r13
+	subq $8, %rsp
+	movq %rdi, %r13
+.Lstats.L1:
+	movq %r13, %rdi
+	call split
+	movq %rax, %rbx
+	movq %rdx, %r12
+.Lstats.L3:
+.Lstats.L4:
+	movq %rbx, %rdi
+	call rev
+	movq %rax, %rbx
+.Lstats.L5:
+	movq %rbx, %rax
+	movq %r12, %rdx
+	leaq -24(%rbp), %rsp
+	popq %r13
+	popq %r12
+	popq %rbx
+	popq %rbp
+	ret
+	.size stats, .-stats
+
+	.globl bench
+	.type bench, @function
+bench:
+	pushq %rbp
+	movq %rsp, %rbp
+	pushq %rbx
+	pushq %r12
+	pushq %r13
+	subq $8, %rsp
+	movq %rdi, %r13
+.Lbench.L1:
+	movq %r13, %rdi
+	call tree
+	movq %rax, %rbx
+.Lbench.L2:
+	movq %rbx, %rdi
+	call flatten
+	movq %rax, %rbx
+.Lbench.L3:
+	movq %rbx, %rdi
+	call stats
+	movq %rax, %rbx
+	movq %rdx, %r12
+.Lbench.L5:
+	movq %rbx, %rdi
+	call rev
+	movq %rax, %rbx
+.Lbench.L6:
+	movq %rbx, %rdi
+	movq %r12, %rsi
+	leaq -24(%rbp), %rsp
+	popq %r13
+	popq %r12
+	popq %rbx
+	popq %rbp
+	jmp append
+	.size bench, .-bench
+
+	.globl compiler_init
+	.type compiler_init, @function
+compiler_init:
+	pushq %rbp
+	movq %rsp, %rbp
+	movb $2, runtime_classArities+35(%rip)
+	movb $0, runtime_classArities+36(%rip)
+	movb $3, runtime_classArities+37(%rip)
+	popq %rbp
+	ret
+	.size compiler_init, .-compiler_init
+
+	.section .note.GNU-stack,"",@progbits
@@ -0,0 +1,209 @@
+#include "runtime.h"
+
+enum {
+    CLASS_Pair = USER_CLASS_MIN,
+    CLASS_Leaf,
+    CLASS_Node,
+};
+
+struct values2 {
+    long v[2];
+};
+
+long Pair(long a, long b);
+
+long Leaf(void);
+
+long Node(long l, long x, long r);
+
+long rev(long xs);
+
+long append(long xs, long ys);
+
+struct values2 split(long xs);
+
+long tree(long xs);
+
+long flatten(long t);
+
+struct values2 stats(long xs);
+
+long bench(long xs);
+
+long Pair(long a, long b)
+{
+    return runtime_makeTuple2(CLASS_Pair, a, b);
+}
+
+long Leaf(void)
+{
+    return runtime_makeTuple0(CLASS_Leaf);
+}
+
+long Node(long l, long x, long r)
+{
+    return runtime_makeTuple3(CLASS_Node, l, x, r);
+}
+
+long rev(long xs)
+{
+    long ys, acc, y, rest;
+        ys = xs;
+        acc = nil;
+L2:
+    switch (runtime_class(ys)) {
+    case CLASS_Cons:
+        y = prim_fetch(ys, runtime_makeNumber(0));
+        rest = prim_fetch(ys, runtime_makeNumber(1));
+        goto L3;
+    default:
+        goto L4;
+    }
+L3:
+    acc = prim_cons(y, acc);
+        ys = rest;
+    goto L2;
+L4:
+    return acc;
+}
+
+long append(long xs, long ys)
+{
+    long u, us;
+    switch (runtime_class(xs)) {
+    case CLASS_Cons:
+        u = prim_fetch(xs, runtime_makeNumber(0));
+        us = prim_fetch(xs, runtime_makeNumber(1));
+        goto L2;
+    default:
+        goto L3;
+    }
+L2:
+    us = append(us, ys);
+    u = prim_cons(u, us);
+    return u;
+L3:
+    return ys;
+}
+
+struct values2 split(long xs)
+{
+    long a, more, b, rest;
+    switch (runtime_class(xs)) {
+    case CLASS_Cons:
+        a = prim_fetch(xs, runtime_makeNumber(0));
+        more = prim_fetch(xs, runtime_makeNumber(1));
+        goto L2;
+    default:
+        goto L3;
+    }
+L2:
+    switch (runtime_class(more)) {
+    case CLASS_Cons:
+        b = prim_fetch(more, runtime_makeNumber(0));
+        rest = prim_fetch(more, runtime_makeNumber(1));
+        goto L4;
+    default:
+        goto L5;
+    }
+L4:
+    {
+        struct values2 values_ = split(rest);
+
+        more = values_.v[0];
+        rest = values_.v[1];
+    }
+    a = prim_cons(a, more);
+    more = prim_cons(b, rest);
+    return (struct values2){ { a, more } };
+L5:
+    a = prim_cons(a, nil);
+    return (struct values2){ { a, nil } };
+L3:
+    return (struct values2){ { nil, nil } };
+}
+
+long tree(long xs)
+{
+    long h, t, r;
+    switch (runtime_class(xs)) {
+    case CLASS_Cons:
+        h = prim_fetch(xs, runtime_makeNumber(0));
+        t = prim_fetch(xs, runtime_makeNumber(1));
+        goto L2;
+    default:
+        goto L3;
+    }
+L2:
+    {
+        struct values2 values_ = split(t);
+
+        t = values_.v[0];
+        r = values_.v[1];
+    }
+    t = tree(t);
+    r = tree(r);
+    h = Node(t, h, r);
+    return h;
+L3:
+    h = Leaf();
+    return h;
+}
+
+long flatten(long t)
+{
+    long l, x, r;
+    switch (runtime_class(t)) {
+    case CLASS_Node:
+        l = prim_fetch(t, runtime_makeNumber(0));
+        x = prim_fetch(t, runtime_makeNumber(1));
+        r = prim_fetch(t, runtime_makeNumber(2));
+        goto L2;
+    case CLASS_Leaf:
+        goto L3;
+    default:
+        runtime_matchFailure(__LINE__);
+    }
+L2:
+    l = flatten(l);
+    r = flatten(r);
+    x = prim_cons(x, r);
+    return append(l, x);
+L3:
+    return nil;
+}
+
+struct values2 stats(long xs)
+{
+    long evens, odds;
+    {
+        struct values2 values_ = split(xs);
+
+        evens = values_.v[0];
+        odds = values_.v[1];
+    }
+    evens = rev(evens);
+    return (struct values2){ { evens, odds } };
+}
+
+long bench(long xs)
+{
+    long t, b;
+    t = tree(xs);
+    t = flatten(t);
+    {
+        struct values2 values_ = stats(t);
+
+        t = values_.v[0];
+        b = values_.v[1];
+    }
+    t = rev(t);
+    return append(t, b);
+}
+
+void compiler_init(void)
+{
+    runtime_classArities[35] = 2;
+    runtime_classArities[36] = 0;
+    runtime_classArities[37] = 3;
+}
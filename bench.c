@@ -0,0 +1,49 @@
+#include <stdio.h>
+#include <time.h>
+
+#include "runtime.h"
+
+/*
+ * Driver for bench.fi. The same driver is linked with the output of both
+ * backends; it prints a checksum, which must agree, and the run time.
+ */
+
+void compiler_init(void);
+long bench(long xs);
+
+#define ROUNDS 200
+#define LENGTH 20000
+
+static double now(void)
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+int main(void)
+{
+    long xs, i, sum = 0;
+    double start;
+    int round;
+
+    runtime_init();
+    compiler_init();
+
+    start = now();
+    for (round = 0; round < ROUNDS; round++) {
+        runtime_reset();
+        xs = nil;
+        for (i = 0; i < LENGTH; i++)
+            xs = prim_cons(runtime_makeNumber((i * 7919 + round) % 1000), xs);
+        xs = bench(xs);
+        for (i = 0; runtime_class(xs) == CLASS_Cons; i++) {
+            sum = sum * 31 + runtime_fixnumValue(prim_fetch(xs, runtime_0)) + i;
+            xs = prim_fetch(xs, runtime_1);
+        }
+    }
+    printf("checksum %ld, %.3f s\n", sum, now() - start);
+
+    return 0;
+}
@@ -0,0 +1,570 @@
+#include "runtime.h"
+
+enum {
+    CLASS_Pair = USER_CLASS_MIN,
+    CLASS_Triple,
+    CLASS_P1TailCont,
+    CLASS_P1BlockCont,
+    CLASS_P1TrivialCont,
+};
+
+struct values3 {
+    long v[3];
+};
+
+struct values2 {
+    long v[2];
+};
+
+long Pair(long a, long b);
+
+long Triple(long a, long b, long c);
+
+long append(long xs, long ys);
+
+long P1TailCont(void);
+
+long P1BlockCont(long label);
+
+long P1TrivialCont(long x, long forms, long formsCont);
+
+long pass1(long hi1);
+
+long pass1Toplevel(long def);
+
+struct values3 pass1Begin(long forms, long cont);
+
+struct values3 pass1SimpleExpr(long expr, long cont);
+
+struct values3 pass1CallExpr(long f, long args, long cont);
+
+struct values3 pass1MatchExpr(long test, long clauses, long cont);
+
+long pass1TransformedClauses(long labeledClauses);
+
+long pass1LabeledClauses(long clauses);
+
+struct values3 pass1TrivialExpr(long expr, long cont);
+
+long pass1ClauseBlocks(long labeledClauses, long cont);
+
+long pass1OneClauseBlocks(long labeledClause, long cont);
+
+struct values2 pass1ExplicitCont(long cont);
+
+long compile(long hi1);
+
+long Pair(long a, long b)
+{
+    return runtime_makeTuple2(CLASS_Pair, a, b);
+}
+
+long Triple(long a, long b, long c)
+{
+    return runtime_makeTuple3(CLASS_Triple, a, b, c);
+}
+
+long append(long xs, long ys)
+{
+    long u, us;
+    switch (runtime_class(xs)) {
+    case CLASS_Cons:
+        u = prim_fetch(xs, runtime_makeNumber(0));
+        us = prim_fetch(xs, runtime_makeNumber(1));
+        goto L2;
+    default:
+        goto L3;
+    }
+L2:
+    us = append(us, ys);
+    u = prim_cons(u, us);
+    return u;
+L3:
+    return ys;
+}
+
+long P1TailCont(void)
+{
+    return runtime_makeTuple0(CLASS_P1TailCont);
+}
+
+long P1BlockCont(long label)
+{
+    return runtime_makeTuple1(CLASS_P1BlockCont, label);
+}
+
+long P1TrivialCont(long x, long forms, long formsCont)
+{
+    return runtime_makeTuple3(CLASS_P1TrivialCont, x, forms, formsCont);
+}
+
+long pass1(long hi1)
+{
+    long def, defs;
+    switch (runtime_class(hi1)) {
+    case CLASS_Cons:
+        def = prim_fetch(hi1, runtime_makeNumber(0));
+        defs = prim_fetch(hi1, runtime_makeNumber(1));
+        goto L2;
+    default:
+        goto L3;
+    }
+L2:
+    def = pass1Toplevel(def);
+    defs = pass1(defs);
+    def = prim_cons(def, defs);
+    return def;
+L3:
+    return nil;
+}
+
+long pass1Toplevel(long def)
+{
+    long x, constant, blk, expr, defines, x5;
+    switch (runtime_class(def)) {
+    case CLASS_HiDefineVar:
+        x = prim_fetch(def, runtime_makeNumber(0));
+        constant = prim_fetch(def, runtime_makeNumber(1));
+        goto L2;
+    case CLASS_HiDefineCons:
+        x = prim_fetch(def, runtime_makeNumber(0));
+        constant = prim_fetch(def, runtime_makeNumber(1));
+        goto L3;
+    case CLASS_HiDefineFunc:
+        x = prim_fetch(def, runtime_makeNumber(0));
+        constant = prim_fetch(def, runtime_makeNumber(1));
+        blk = prim_fetch(def, runtime_makeNumber(2));
+        goto L4;
+    default:
+        runtime_matchFailure(__LINE__);
+    }
+L2:
+    x = FiDefineVar(x, constant);
+    return x;
+L3:
+    x = FiDefineCons(x, constant);
+    return x;
+L4:
+    switch (runtime_class(blk)) {
+    case CLASS_HiBlock:
+        expr = prim_fetch(blk, runtime_makeNumber(0));
+        defines = prim_fetch(blk, runtime_makeNumber(1));
+        goto L5;
+    default:
+        runtime_matchFailure(__LINE__);
+    }
+L5:
+    switch (runtime_class(expr)) {
+    case CLASS_HiBegin:
+        blk = prim_fetch(expr, runtime_makeNumber(0));
+        goto L6;
+    default:
+        runtime_matchFailure(__LINE__);
+    }
+L6:
+    expr = P1TailCont();
+    {
+        struct values3 values_ = pass1Begin(blk, expr);
+
+        blk = values_.v[0];
+        expr = values_.v[1];
+        defines = values_.v[2];
+    }
+    x5 = prim_genLabel();
+    blk = FiBlock(x5, nil, blk, expr);
+    blk = prim_cons(blk, defines);
+    x = FiDefineFunc(x, constant, blk);
+    return x;
+}
+
+struct values3 pass1Begin(long forms, long cont)
+{
+    long form, moreForms, c, args, blk, defines;
+    switch (runtime_class(forms)) {
+    case CLASS_Cons:
+        form = prim_fetch(forms, runtime_makeNumber(0));
+        moreForms = prim_fetch(forms, runtime_makeNumber(1));
+        goto L2;
+    default:
+        runtime_matchFailure(__LINE__);
+    }
+L2:
+    switch (runtime_class(form)) {
+    case CLASS_HiDefineByMatch:
+        c = prim_fetch(form, runtime_makeNumber(0));
+        args = prim_fetch(form, runtime_makeNumber(1));
+        blk = prim_fetch(form, runtime_makeNumber(2));
+        goto L3;
+    case CLASS_HiDefineVar:
+        c = prim_fetch(form, runtime_makeNumber(0));
+        args = prim_fetch(form, runtime_makeNumber(1));
+        goto L4;
+    default:
+        goto L5;
+    }
+L3:
+    switch (runtime_class(blk)) {
+    case CLASS_HiBlock:
+        form = prim_fetch(blk, runtime_makeNumber(0));
+        defines = prim_fetch(blk, runtime_makeNumber(1));
+        goto L6;
+    default:
+        runtime_matchFailure(__LINE__);
+    }
+L6:
+    moreForms = HiBegin(moreForms);
+    moreForms = HiBlock(moreForms, nil);
+    moreForms = HiCase(c, args, moreForms);
+    moreForms = prim_cons(moreForms, nil);
+    form = HiMatch(form, moreForms);
+    return pass1SimpleExpr(form, cont);
+L4:
+    switch (runtime_class(args)) {
+    case CLASS_HiBlock:
+        form = prim_fetch(args, runtime_makeNumber(0));
+        blk = prim_fetch(args, runtime_makeNumber(1));
+        goto L7;
+    default:
+        runtime_matchFailure(__LINE__);
+    }
+L7:
+    moreForms = P1TrivialCont(c, moreForms, cont);
+    return pass1SimpleExpr(form, moreForms);
+L5:
+    return pass1SimpleExpr(form, cont);
+}
+
+struct values3 pass1SimpleExpr(long expr, long cont)
+{
+    long name, cpArgs;
+    switch (runtime_class(expr)) {
+    case CLASS_Fixnum:
+        goto L2;
+    case CLASS_String:
+        goto L2;
+    case CLASS_Id:
+        name = prim_fetch(expr, runtime_makeNumber(0));
+        goto L3;
+    case CLASS_HiConsApp:
+        name = prim_fetch(expr, runtime_makeNumber(0));
+        cpArgs = prim_fetch(expr, runtime_makeNumber(1));
+        goto L4;
+    case CLASS_HiPrimApp:
+        name = prim_fetch(expr, runtime_makeNumber(0));
+        cpArgs = prim_fetch(expr, runtime_makeNumber(1));
+        goto L4;
+    case CLASS_HiCall:
+        name = prim_fetch(expr, runtime_makeNumber(0));
+        cpArgs = prim_fetch(expr, runtime_makeNumber(1));
+        goto L5;
+    case CLASS_HiMatch:
+        name = prim_fetch(expr, runtime_makeNumber(0));
+        cpArgs = prim_fetch(expr, runtime_makeNumber(1));
+        goto L6;
+    default:
+        runtime_matchFailure(__LINE__);
+    }
+L2:
+    return pass1TrivialExpr(expr, cont);
+L3:
+    return pass1TrivialExpr(expr, cont);
+L4:
+    return pass1TrivialExpr(expr, cont);
+L5:
+    return pass1CallExpr(name, cpArgs, cont);
+L6:
+    return pass1MatchExpr(name, cpArgs, cont);
+}
+
+struct values3 pass1CallExpr(long f, long args, long cont)
+{
+    long explicitCont, contBlocks, label;
+    {
+        struct values2 values_ = pass1ExplicitCont(cont);
+
+        explicitCont = values_.v[0];
+        contBlocks = values_.v[1];
+    }
+    switch (runtime_class(explicitCont)) {
+    case CLASS_P1TailCont:
+        goto L4;
+    case CLASS_P1BlockCont:
+        label = prim_fetch(explicitCont, runtime_makeNumber(0));
+        goto L5;
+    default:
+        runtime_matchFailure(__LINE__);
+    }
+L4:
+    explicitCont = FiCall(nil, f, args);
+    return (struct values3){ { nil, explicitCont, nil } };
+L5:
+    explicitCont = FiCall(label, f, args);
+    return (struct values3){ { nil, explicitCont, contBlocks } };
+}
+
+struct values3 pass1MatchExpr(long test, long clauses, long cont)
+{
+    long labeledClauses, explicitCont, contBlocks;
+    labeledClauses = pass1LabeledClauses(clauses);
+    {
+        struct values2 values_ = pass1ExplicitCont(cont);
+
+        explicitCont = values_.v[0];
+        contBlocks = values_.v[1];
+    }
+    explicitCont = pass1ClauseBlocks(labeledClauses, explicitCont);
+    labeledClauses = pass1TransformedClauses(labeledClauses);
+    labeledClauses = FiMatch(test, labeledClauses);
+    explicitCont = append(contBlocks, explicitCont);
+    return (struct values3){ { nil, labeledClauses, explicitCont } };
+}
+
+long pass1TransformedClauses(long labeledClauses)
+{
+    long labeledClause, moreLabeledClauses, label, clause, caseArgs, caseBlk;
+    switch (runtime_class(labeledClauses)) {
+    case CLASS_Cons:
+        labeledClause = prim_fetch(labeledClauses, runtime_makeNumber(0));
+        moreLabeledClauses = prim_fetch(labeledClauses, runtime_makeNumber(1));
+        goto L2;
+    default:
+        goto L3;
+    }
+L2:
+    switch (runtime_class(labeledClause)) {
+    case CLASS_Pair:
+        label = prim_fetch(labeledClause, runtime_makeNumber(0));
+        clause = prim_fetch(labeledClause, runtime_makeNumber(1));
+        goto L4;
+    default:
+        runtime_matchFailure(__LINE__);
+    }
+L4:
+    switch (runtime_class(clause)) {
+    case CLASS_HiCase:
+        labeledClause = prim_fetch(clause, runtime_makeNumber(0));
+        caseArgs = prim_fetch(clause, runtime_makeNumber(1));
+        caseBlk = prim_fetch(clause, runtime_makeNumber(2));
+        goto L5;
+    case CLASS_HiElse:
+        labeledClause = prim_fetch(clause, runtime_makeNumber(0));
+        goto L6;
+    default:
+        runtime_matchFailure(__LINE__);
+    }
+L5:
+    labeledClause = FiCase(labeledClause, label);
+L7:
+    moreLabeledClauses = pass1TransformedClauses(moreLabeledClauses);
+    labeledClause = prim_cons(labeledClause, moreLabeledClauses);
+    return labeledClause;
+L6:
+    labeledClause = FiElse(label);
+    goto L7;
+L3:
+    return nil;
+}
+
+long pass1LabeledClauses(long clauses)
+{
+    long clause, moreClauses;
+    switch (runtime_class(clauses)) {
+    case CLASS_Cons:
+        clause = prim_fetch(clauses, runtime_makeNumber(0));
+        moreClauses = prim_fetch(clauses, runtime_makeNumber(1));
+        goto L2;
+    default:
+        goto L3;
+    }
+L2:
+    moreClauses = prim_genLabel();
+    clause = Pair(moreClauses, clause);
+    return clause;
+L3:
+    return nil;
+}
+
+struct values3 pass1TrivialExpr(long expr, long cont)
+{
+    long c, consArgs, y, formsCont, blks;
+    switch (runtime_class(expr)) {
+    case CLASS_HiConsApp:
+        c = prim_fetch(expr, runtime_makeNumber(0));
+        consArgs = prim_fetch(expr, runtime_makeNumber(1));
+        goto L2;
+    case CLASS_HiPrimApp:
+        c = prim_fetch(expr, runtime_makeNumber(0));
+        consArgs = prim_fetch(expr, runtime_makeNumber(1));
+        goto L3;
+    default:
+        goto L4;
+    }
+L2:
+    c = FiConsApp(c, consArgs);
+L5:
+    switch (runtime_class(cont)) {
+    case CLASS_P1TailCont:
+        goto L6;
+    case CLASS_P1BlockCont:
+        consArgs = prim_fetch(cont, runtime_makeNumber(0));
+        goto L7;
+    case CLASS_P1TrivialCont:
+        consArgs = prim_fetch(cont, runtime_makeNumber(0));
+        y = prim_fetch(cont, runtime_makeNumber(1));
+        formsCont = prim_fetch(cont, runtime_makeNumber(2));
+        goto L8;
+    default:
+        runtime_matchFailure(__LINE__);
+    }
+L3:
+    c = FiPrimApp(c, consArgs);
+    goto L5;
+L4:
+        c = expr;
+    goto L5;
+L6:
+    consArgs = prim_genTmp();
+    c = FiStmt(consArgs, c);
+    c = prim_cons(c, nil);
+    consArgs = FiReturn(consArgs);
+    return (struct values3){ { c, consArgs, nil } };
+L7:
+    y = prim_genTmp();
+    c = FiStmt(y, c);
+    c = prim_cons(c, nil);
+    y = prim_cons(y, nil);
+    consArgs = FiGoto(consArgs, y);
+    return (struct values3){ { c, consArgs, nil } };
+L8:
+    {
+        struct values3 values_ = pass1Begin(y, formsCont);
+
+        y = values_.v[0];
+        formsCont = values_.v[1];
+        blks = values_.v[2];
+    }
+    c = FiStmt(consArgs, c);
+    c = prim_cons(c, y);
+    return (struct values3){ { c, formsCont, blks } };
+}
+
+long pass1ClauseBlocks(long labeledClauses, long cont)
+{
+    long labeledClause, moreLabeledClauses;
+    switch (runtime_class(labeledClauses)) {
+    case CLASS_Cons:
+        labeledClause = prim_fetch(labeledClauses, runtime_makeNumber(0));
+        moreLabeledClauses = prim_fetch(labeledClauses, runtime_makeNumber(1));
+        goto L2;
+    default:
+        goto L3;
+    }
+L2:
+    labeledClause = pass1OneClauseBlocks(labeledClause, cont);
+    moreLabeledClauses = pass1ClauseBlocks(moreLabeledClauses, cont);
+    return append(labeledClause, moreLabeledClauses);
+L3:
+    return nil;
+}
+
+long pass1OneClauseBlocks(long labeledClause, long cont)
+{
+    long label, clause, c, caseArgs, caseBlk;
+    switch (runtime_class(labeledClause)) {
+    case CLASS_Pair:
+        label = prim_fetch(labeledClause, runtime_makeNumber(0));
+        clause = prim_fetch(labeledClause, runtime_makeNumber(1));
+        goto L2;
+    default:
+        runtime_matchFailure(__LINE__);
+    }
+L2:
+    switch (runtime_class(clause)) {
+    case CLASS_HiCase:
+        c = prim_fetch(clause, runtime_makeNumber(0));
+        caseArgs = prim_fetch(clause, runtime_makeNumber(1));
+        caseBlk = prim_fetch(clause, runtime_makeNumber(2));
+        goto L3;
+    case CLASS_HiElse:
+        c = prim_fetch(clause, runtime_makeNumber(0));
+        goto L4;
+    default:
+        runtime_matchFailure(__LINE__);
+    }
+L3:
+        c = caseBlk;
+L5:
+    switch (runtime_class(c)) {
+    case CLASS_HiBlock:
+        clause = prim_fetch(c, runtime_makeNumber(0));
+        caseBlk = prim_fetch(c, runtime_makeNumber(1));
+        goto L6;
+    default:
+        runtime_matchFailure(__LINE__);
+    }
+L4:
+        caseArgs = nil;
+    goto L5;
+L6:
+    switch (runtime_class(clause)) {
+    case CLASS_HiBegin:
+        c = prim_fetch(clause, runtime_makeNumber(0));
+        goto L7;
+    default:
+        runtime_matchFailure(__LINE__);
+    }
+L7:
+    {
+        struct values3 values_ = pass1Begin(c, cont);
+
+        clause = values_.v[0];
+        c = values_.v[1];
+        caseBlk = values_.v[2];
+    }
+    label = FiBlock(label, caseArgs, clause, c);
+    return prim_cons(label, caseBlk);
+}
+
+struct values2 pass1ExplicitCont(long cont)
+{
+    long x, forms, formsCont, label, blks;
+    switch (runtime_class(cont)) {
+    case CLASS_P1TrivialCont:
+        x = prim_fetch(cont, runtime_makeNumber(0));
+        forms = prim_fetch(cont, runtime_makeNumber(1));
+        formsCont = prim_fetch(cont, runtime_makeNumber(2));
+        goto L2;
+    default:
+        goto L3;
+    }
+L2:
+    label = prim_genLabel();
+    {
+        struct values3 values_ = pass1Begin(forms, formsCont);
+
+        forms = values_.v[0];
+        formsCont = values_.v[1];
+        blks = values_.v[2];
+    }
+    x = prim_cons(x, nil);
+    x = FiBlock(label, x, forms, formsCont);
+    x = prim_cons(x, blks);
+    forms = P1BlockCont(label);
+    return (struct values2){ { forms, x } };
+L3:
+    return (struct values2){ { cont, nil } };
+}
+
+long compile(long hi1)
+{
+    return pass1(hi1);
+}
+
+void compiler_init(void)
+{
+    runtime_classArities[35] = 2;
+    runtime_classArities[36] = 3;
+    runtime_classArities[37] = 0;
+    runtime_classArities[38] = 1;
+    runtime_classArities[39] = 3;
+}
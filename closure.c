@@ -0,0 +1,928 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "closure.h"
+#include "names.h"
+#include "runtime.h"
+#include "fi.h"
+#include "util.h"
+
+/*
+ * Closure conversion for HI programs.
+ *
+ * The output of this pass is first order: it contains no func forms and no
+ * calls through variables.
+ *
+ *   - Func forms and local functions are lifted to toplevel functions that
+ *     take the variables they capture as leading arguments. Calls to known
+ *     functions, whether toplevel or local, become direct calls.
+ *
+ *   - A function used as a value becomes a constructor application holding
+ *     the captured variables, so each closure is one flat tuple. A call
+ *     through a variable becomes a call to a generated apply function that
+ *     matches on the constructor and calls the lifted function directly.
+ *
+ *   - When a closure constructor is passed to a function that only calls
+ *     that argument, or passes it on unchanged to itself, the call is
+ *     redirected to a copy of the function specialized on the closure. This
+ *     turns map and fold over a func form into direct loops.
+ *
+ * A local variable that shadows another binding is renamed, so a captured
+ * variable means the same thing wherever its function is called.
+ */
+
+enum {
+    VAR,
+    KNOWN,
+};
+
+struct binding {
+    long name;
+    int kind;
+    int local;
+    long newName;   /* VAR: the name of the variable in the output */
+    long target;    /* KNOWN: the toplevel function to call */
+    long captured;  /* KNOWN: the variables passed ahead of the arguments */
+    int arity;
+};
+
+struct closure {
+    long target;
+    long name;
+    int nrCaptured;
+    int arity;
+};
+
+struct specialization {
+    long func;
+    int index;
+    int closure;
+    long name;
+};
+
+/*
+ * What specializing a function on a closure argument needs to know.
+ */
+struct context {
+    long func;
+    int index;
+    int arity;
+    long param;
+    long name;
+    long target;
+    int closureArity;
+    long fields;
+};
+
+static int counter;
+
+static struct binding *env;
+static int envSize;
+static int envCapacity;
+
+static struct closure *closures;
+static struct names closureTargets;
+static struct names closureNames;
+static int closuresCapacity;
+
+static struct names applies;
+static int *applyArities;
+static int appliesCapacity;
+
+static struct specialization *specs;
+static int nrSpecs;
+static int specsCapacity;
+
+static long *defs;
+static int nrDefs;
+static int defsCapacity;
+static struct names funcNames;
+static int *funcDefs;
+static int funcDefsCapacity;
+
+static long lifted;
+
+static void *grow(void *p, int *capacity, int needed, size_t size)
+{
+    if (needed <= *capacity)
+        return p;
+    *capacity = *capacity ? 2 * *capacity : 16;
+    if (*capacity < needed)
+        *capacity = needed;
+    p = realloc(p, *capacity * size);
+    if (p == NULL)
+        die("Failed to allocate memory.");
+    return p;
+}
+
+static long fresh(const char *prefix)
+{
+    char *name;
+    long id;
+
+    /* Program identifiers cannot contain an underscore. */
+    name = malloc(strlen(prefix) + 32);
+    if (name == NULL)
+        die("Failed to allocate memory.");
+    sprintf(name, "%s_%d", prefix, counter++);
+    id = Id(runtime_makeString(name));
+    free(name);
+    return id;
+}
+
+static long makeId(const char *name)
+{
+    return Id(runtime_makeString(name));
+}
+
+static long list1(long a)
+{
+    return prim_cons(a, nil);
+}
+
+static long concat(long xs, long ys)
+{
+    long x;
+
+    forEach(reverse(xs), x)
+        ys = prim_cons(x, ys);
+    return ys;
+}
+
+static long without(long xs, int index)
+{
+    long x, ys = nil;
+    int i = 0;
+
+    forEach(xs, x)
+        if (i++ != index)
+            ys = prim_cons(x, ys);
+    return reverse(ys);
+}
+
+static long nth(long xs, int index)
+{
+    long x;
+
+    forEach(xs, x)
+        if (index-- == 0)
+            return x;
+    return nil;
+}
+
+static long numberedIds(const char *prefix, int n)
+{
+    char name[32];
+    long ids = nil;
+
+    /* The trailing underscore keeps these apart from fresh names. */
+    while (n > 0) {
+        snprintf(name, sizeof(name), "%s%d_", prefix, n--);
+        ids = prim_cons(makeId(name), ids);
+    }
+    return ids;
+}
+
+static int isHi(long x)
+{
+    unsigned short class = runtime_class(x);
+
+    return class >= CLASS_HiDefineVar && class <= CLASS_HiElse;
+}
+
+static long field(long x, int i)
+{
+    return prim_fetch(x, runtime_makeNumber(i));
+}
+
+static long makeTuple(unsigned short class, long *fields)
+{
+    switch (runtime_classArities[class]) {
+    case 1:
+        return runtime_makeTuple1(class, fields[0]);
+    case 2:
+        return runtime_makeTuple2(class, fields[0], fields[1]);
+    case 3:
+        return runtime_makeTuple3(class, fields[0], fields[1], fields[2]);
+    }
+    die("Unexpected arity of syntax tree node.");
+    return nil;
+}
+
+static void collectIds(long x, struct names *ids)
+{
+    long y;
+    int i;
+
+    if (runtime_class(x) == CLASS_Id) {
+        names_add(ids, x);
+    } else if (runtime_class(x) == CLASS_Cons) {
+        forEach(x, y)
+            collectIds(y, ids);
+    } else if (isHi(x)) {
+        for (i = 0; i < runtime_classArities[runtime_class(x)]; i++)
+            collectIds(field(x, i), ids);
+    }
+}
+
+/*
+ * Scopes.
+ */
+static int lookup(long name)
+{
+    int i;
+
+    for (i = envSize - 1; i >= 0; i--)
+        if (idEq(env[i].name, name))
+            return i;
+    return -1;
+}
+
+static int push(long name, int kind)
+{
+    struct binding *b;
+
+    env = grow(env, &envCapacity, envSize + 1, sizeof(*env));
+    b = &env[envSize];
+    b->name = name;
+    b->kind = kind;
+    b->local = 1;
+    b->newName = name;
+    b->target = name;
+    b->captured = nil;
+    b->arity = 0;
+    return envSize++;
+}
+
+static long bindVar(long name)
+{
+    long newName;
+    int i;
+
+    newName = lookup(name) >= 0 ? fresh(idString(name)) : name;
+    i = push(name, VAR);
+    env[i].newName = newName;
+    return newName;
+}
+
+static long bindVars(long names)
+{
+    long name, newNames = nil;
+
+    forEach(names, name)
+        newNames = prim_cons(bindVar(name), newNames);
+    return reverse(newNames);
+}
+
+static int bindKnown(long name, long target, int arity)
+{
+    int i;
+
+    i = push(name, KNOWN);
+    env[i].target = target;
+    env[i].arity = arity;
+    return i;
+}
+
+/*
+ * Adds the local variables that block refers to, directly or through the
+ * known functions it calls, to captured. Bindings from group on are the
+ * functions being defined together with block.
+ */
+static void addCaptures(long args, long block, int group,
+        struct names *captured)
+{
+    struct names ids, params;
+    long c;
+    int i, j;
+
+    names_init(&ids);
+    names_init(&params);
+    collectIds(block, &ids);
+    collectIds(args, &params);
+    for (i = 0; i < ids.nr; i++) {
+        if (names_find(&params, ids.ids[i]) >= 0)
+            continue;
+        j = lookup(ids.ids[i]);
+        if (j < 0 || j >= group || !env[j].local)
+            continue;
+        if (env[j].kind == VAR)
+            names_add(captured, env[j].newName);
+        else
+            forEach(env[j].captured, c)
+                names_add(captured, c);
+    }
+    names_release(&params);
+    names_release(&ids);
+}
+
+static long capturedList(struct names *captured)
+{
+    long ids = nil;
+    int i;
+
+    for (i = captured->nr - 1; i >= 0; i--)
+        ids = prim_cons(captured->ids[i], ids);
+    return ids;
+}
+
+/*
+ * Closures and apply functions.
+ */
+static long closureValue(int i)
+{
+    struct closure *c;
+    char *name;
+    int k;
+
+    k = names_find(&closureTargets, env[i].target);
+    if (k < 0) {
+        k = names_add(&closureTargets, env[i].target);
+        closures = grow(closures, &closuresCapacity, k + 1,
+            sizeof(*closures));
+        c = &closures[k];
+        name = malloc(strlen(idString(env[i].target)) + 16);
+        if (name == NULL)
+            die("Failed to allocate memory.");
+        sprintf(name, "Closure_%s", idString(env[i].target));
+        c->target = env[i].target;
+        c->name = makeId(name);
+        c->nrCaptured = length(env[i].captured);
+        c->arity = env[i].arity;
+        names_add(&closureNames, c->name);
+        free(name);
+    }
+    return HiCall(closures[k].name, env[i].captured);
+}
+
+static long applyName(int arity)
+{
+    int i;
+
+    for (i = 0; i < applies.nr; i++)
+        if (applyArities[i] == arity)
+            return applies.ids[i];
+    i = names_add(&applies, fresh("apply"));
+    applyArities = grow(applyArities, &appliesCapacity, i + 1,
+        sizeof(*applyArities));
+    applyArities[i] = arity;
+    return applies.ids[i];
+}
+
+static int isApply(long f, int arity)
+{
+    int i;
+
+    i = names_find(&applies, f);
+    return i >= 0 && applyArities[i] == arity;
+}
+
+/*
+ * Conversion.
+ */
+static long convertExpr(long x);
+static long convertBlock(long block);
+
+static long convertExprs(long xs)
+{
+    long x, ys = nil;
+
+    forEach(xs, x)
+        ys = prim_cons(convertExpr(x), ys);
+    return reverse(ys);
+}
+
+static long convertFunc(long target, long captured, long args, long block)
+{
+    int mark = envSize;
+
+    args = bindVars(args);
+    block = convertBlock(block);
+    envSize = mark;
+    return HiDefineFunc(target, concat(captured, args), block);
+}
+
+/*
+ * Lifts a func form and binds name to it. The func form cannot refer to
+ * itself, so it is converted before name is bound.
+ */
+static int liftLambda(long name, const char *prefix, long func)
+{
+    struct names captured;
+    long args, block, target, ids;
+    int i;
+
+    match(func, CLASS_HiFunc, &args, &block);
+    names_init(&captured);
+    addCaptures(args, block, envSize, &captured);
+    ids = capturedList(&captured);
+    names_release(&captured);
+
+    target = fresh(prefix);
+    lifted = prim_cons(convertFunc(target, ids, args, block), lifted);
+    i = bindKnown(name, target, length(args));
+    env[i].captured = ids;
+    return i;
+}
+
+/*
+ * Lifts a group of mutually recursive local functions. They share the
+ * union of their captured variables.
+ */
+static void liftFuncs(long funcs)
+{
+    struct names captured;
+    long define, id, args, block, ids;
+    int group = envSize, i;
+
+    forEach(funcs, define) {
+        match(define, CLASS_HiDefineFunc, &id, &args, &block);
+        bindKnown(id, fresh(idString(id)), length(args));
+    }
+
+    names_init(&captured);
+    forEach(funcs, define) {
+        match(define, CLASS_HiDefineFunc, &id, &args, &block);
+        addCaptures(args, block, group, &captured);
+    }
+    ids = capturedList(&captured);
+    names_release(&captured);
+    for (i = group; i < envSize; i++)
+        env[i].captured = ids;
+
+    i = group;
+    forEach(funcs, define) {
+        match(define, CLASS_HiDefineFunc, &id, &args, &block);
+        lifted = prim_cons(convertFunc(env[i++].target, ids, args, block),
+            lifted);
+    }
+}
+
+static long convertBegin(long forms)
+{
+    long form, id, c, args, block, expr, defines, out = nil;
+    int mark = envSize;
+
+    forEach(forms, form) {
+        switch (runtime_class(form)) {
+        case CLASS_HiDefineVar:
+            match(form, CLASS_HiDefineVar, &id, &block);
+            if (match(block, CLASS_HiBlock, &expr, &defines)
+                    && defines == nil
+                    && runtime_class(expr) == CLASS_HiFunc) {
+                liftLambda(id, idString(id), expr);
+                continue;
+            }
+            block = convertBlock(block);
+            out = prim_cons(HiDefineVar(bindVar(id), block), out);
+            break;
+        case CLASS_HiDefineFunc:
+            liftFuncs(list1(form));
+            break;
+        case CLASS_HiDefineByMatch:
+            match(form, CLASS_HiDefineByMatch, &c, &args, &block);
+            block = convertBlock(block);
+            out = prim_cons(HiDefineByMatch(c, bindVars(args), block), out);
+            break;
+        default:
+            out = prim_cons(convertExpr(form), out);
+            break;
+        }
+    }
+    envSize = mark;
+    return HiBegin(reverse(out));
+}
+
+/*
+ * The defines of a block are mutually recursive. Its functions are lifted
+ * and its variables are defined ahead of the expression.
+ */
+static long convertBlock(long block)
+{
+    long expr, defines, define, id, x, forms, funcs = nil, vars = nil;
+    long stmts = nil, kept = nil;
+    int mark = envSize;
+
+    match(block, CLASS_HiBlock, &expr, &defines);
+    forEach(defines, define) {
+        if (runtime_class(define) == CLASS_HiDefineFunc)
+            funcs = prim_cons(define, funcs);
+        else if (runtime_class(define) == CLASS_HiDefineVar)
+            vars = prim_cons(define, vars);
+        else
+            kept = prim_cons(define, kept);
+    }
+    vars = reverse(vars);
+
+    forEach(vars, define) {
+        match(define, CLASS_HiDefineVar, &id, &x);
+        bindVar(id);
+    }
+    liftFuncs(reverse(funcs));
+    forEach(vars, define) {
+        match(define, CLASS_HiDefineVar, &id, &x);
+        x = HiBlock(convertExpr(x), nil);
+        stmts = prim_cons(HiDefineVar(env[lookup(id)].newName, x), stmts);
+    }
+
+    expr = convertExpr(expr);
+    envSize = mark;
+
+    if (stmts != nil) {
+        if (!match(expr, CLASS_HiBegin, &forms))
+            forms = list1(expr);
+        expr = HiBegin(concat(reverse(stmts), forms));
+    }
+    return HiBlock(expr, reverse(kept));
+}
+
+static long convertMatch(long x)
+{
+    long test, clauses, clause, c, args, block, out = nil;
+    int mark;
+
+    match(x, CLASS_HiMatch, &test, &clauses);
+    test = convertExpr(test);
+    forEach(clauses, clause) {
+        if (match(clause, CLASS_HiCase, &c, &args, &block)) {
+            mark = envSize;
+            args = bindVars(args);
+            block = convertBlock(block);
+            envSize = mark;
+            out = prim_cons(HiCase(c, args, block), out);
+        } else {
+            match(clause, CLASS_HiElse, &block);
+            out = prim_cons(HiElse(convertBlock(block)), out);
+        }
+    }
+    return HiMatch(test, reverse(out));
+}
+
+static long convertCall(long x)
+{
+    long f, args;
+    int i;
+
+    match(x, CLASS_HiCall, &f, &args);
+    args = convertExprs(args);
+    i = lookup(f);
+    if (i < 0)
+        return HiCall(f, args);
+    if (env[i].kind == VAR)
+        return HiCall(applyName(length(args)),
+            prim_cons(env[i].newName, args));
+    return HiCall(env[i].target, concat(env[i].captured, args));
+}
+
+static long convertExpr(long x)
+{
+    long fields[3];
+    int i, mark;
+
+    switch (runtime_class(x)) {
+    case CLASS_Id:
+        i = lookup(x);
+        if (i < 0)
+            return x;
+        if (env[i].kind == VAR)
+            return env[i].newName;
+        return closureValue(i);
+    case CLASS_HiFunc:
+        mark = envSize;
+        i = liftLambda(makeId("lambda"), "lambda", x);
+        x = closureValue(i);
+        envSize = mark;
+        return x;
+    case CLASS_HiBegin:
+        match(x, CLASS_HiBegin, &fields[0]);
+        return convertBegin(fields[0]);
+    case CLASS_HiBlock:
+        return convertBlock(x);
+    case CLASS_HiCall:
+        return convertCall(x);
+    case CLASS_HiMatch:
+        return convertMatch(x);
+    case CLASS_HiConsApp:
+    case CLASS_HiPrimApp:
+        fields[0] = field(x, 0);
+        fields[1] = convertExprs(field(x, 1));
+        return makeTuple(runtime_class(x), fields);
+    }
+    return x;
+}
+
+/*
+ * Specialization.
+ */
+static void addDef(long define)
+{
+    long id, args, block;
+    int i;
+
+    defs = grow(defs, &defsCapacity, nrDefs + 1, sizeof(*defs));
+    defs[nrDefs] = define;
+    if (match(define, CLASS_HiDefineFunc, &id, &args, &block)) {
+        i = names_add(&funcNames, id);
+        funcDefs = grow(funcDefs, &funcDefsCapacity, i + 1,
+            sizeof(*funcDefs));
+        funcDefs[i] = nrDefs;
+    }
+    nrDefs++;
+}
+
+static int isParam(long x, const struct context *ctx)
+{
+    return runtime_class(x) == CLASS_Id && idEq(x, ctx->param);
+}
+
+/*
+ * Returns 1 if the parameter is only called or passed on unchanged in its
+ * own position of a recursive call.
+ */
+static int onlyCalled(long x, const struct context *ctx)
+{
+    long f, args, y;
+    int i;
+
+    if (runtime_class(x) == CLASS_Id)
+        return !idEq(x, ctx->param);
+    if (runtime_class(x) == CLASS_Cons) {
+        forEach(x, y)
+            if (!onlyCalled(y, ctx))
+                return 0;
+        return 1;
+    }
+    if (!isHi(x))
+        return 1;
+
+    if (match(x, CLASS_HiCall, &f, &args)) {
+        int recursive = idEq(f, ctx->func) && length(args) == ctx->arity;
+
+        if (idEq(f, ctx->param))
+            return 0;
+        i = 0;
+        forEach(args, y) {
+            if (isParam(y, ctx) && i == 0 && isApply(f, ctx->closureArity))
+                ;
+            else if (isParam(y, ctx) && recursive && i == ctx->index)
+                ;
+            else if (!onlyCalled(y, ctx))
+                return 0;
+            i++;
+        }
+        return 1;
+    }
+
+    for (i = 0; i < runtime_classArities[runtime_class(x)]; i++)
+        if (!onlyCalled(field(x, i), ctx))
+            return 0;
+    return 1;
+}
+
+static long redirect(long x, const struct context *ctx)
+{
+    long fields[3], f, args, arg, y, ys = nil;
+    unsigned short class;
+    int i;
+
+    class = runtime_class(x);
+    if (class == CLASS_Cons) {
+        forEach(x, y)
+            ys = prim_cons(redirect(y, ctx), ys);
+        return reverse(ys);
+    }
+    if (!isHi(x))
+        return x;
+
+    for (i = 0; i < runtime_classArities[class]; i++)
+        fields[i] = redirect(field(x, i), ctx);
+    x = makeTuple(class, fields);
+
+    if (match(x, CLASS_HiCall, &f, &args)) {
+        if (isApply(f, ctx->closureArity) && isParam(nth(args, 0), ctx))
+            return HiCall(ctx->target,
+                concat(ctx->fields, without(args, 0)));
+        arg = nth(args, ctx->index);
+        if (idEq(f, ctx->func) && length(args) == ctx->arity
+                && isParam(arg, ctx))
+            return HiCall(ctx->name,
+                concat(without(args, ctx->index), ctx->fields));
+    }
+    return x;
+}
+
+/*
+ * Returns the name of the copy of the function defined by defs[def]
+ * specialized on its argument index being the given closure, or nil if the
+ * function uses that argument in other ways.
+ */
+static long specialize(int def, int index, int closure)
+{
+    struct context ctx;
+    struct specialization *s;
+    long params, block;
+    int i;
+
+    match(defs[def], CLASS_HiDefineFunc, &ctx.func, &params, &block);
+    for (i = 0; i < nrSpecs; i++)
+        if (idEq(specs[i].func, ctx.func) && specs[i].index == index
+                && specs[i].closure == closure)
+            return specs[i].name;
+
+    ctx.index = index;
+    ctx.arity = length(params);
+    ctx.param = nth(params, index);
+    ctx.target = closures[closure].target;
+    ctx.closureArity = closures[closure].arity;
+    ctx.name = onlyCalled(block, &ctx) ? fresh(idString(ctx.func)) : nil;
+
+    specs = grow(specs, &specsCapacity, nrSpecs + 1, sizeof(*specs));
+    s = &specs[nrSpecs++];
+    s->func = ctx.func;
+    s->index = index;
+    s->closure = closure;
+    s->name = ctx.name;
+    if (ctx.name == nil)
+        return nil;
+
+    ctx.fields = nil;
+    for (i = 0; i < closures[closure].nrCaptured; i++)
+        ctx.fields = prim_cons(fresh("env"), ctx.fields);
+    addDef(HiDefineFunc(ctx.name,
+        concat(without(params, index), ctx.fields),
+        redirect(block, &ctx)));
+    return ctx.name;
+}
+
+static long specializeCall(long f, long args)
+{
+    long params, block, arg, c, fields, name;
+    int k, i, closure;
+
+again:
+    k = names_find(&funcNames, f);
+    if (k < 0)
+        return HiCall(f, args);
+    match(defs[funcDefs[k]], CLASS_HiDefineFunc, &f, &params, &block);
+    if (length(params) != length(args))
+        return HiCall(f, args);
+
+    i = 0;
+    forEach(args, arg) {
+        if (match(arg, CLASS_HiCall, &c, &fields)
+                && (closure = names_find(&closureNames, c)) >= 0
+                && (name = specialize(funcDefs[k], i, closure)) != nil) {
+            f = name;
+            args = concat(without(args, i), fields);
+            goto again;
+        }
+        i++;
+    }
+    return HiCall(f, args);
+}
+
+static long specializeCalls(long x)
+{
+    long fields[3], f, args, y, ys = nil;
+    unsigned short class;
+    int i;
+
+    class = runtime_class(x);
+    if (class == CLASS_Cons) {
+        forEach(x, y)
+            ys = prim_cons(specializeCalls(y), ys);
+        return reverse(ys);
+    }
+    if (!isHi(x))
+        return x;
+
+    for (i = 0; i < runtime_classArities[class]; i++)
+        fields[i] = specializeCalls(field(x, i));
+    x = makeTuple(class, fields);
+    if (match(x, CLASS_HiCall, &f, &args))
+        x = specializeCall(f, args);
+    return x;
+}
+
+/*
+ * Output.
+ */
+static void collectCallees(long x, struct names *callees)
+{
+    long f, args, y;
+    int i;
+
+    if (runtime_class(x) == CLASS_Cons) {
+        forEach(x, y)
+            collectCallees(y, callees);
+        return;
+    }
+    if (!isHi(x))
+        return;
+    if (match(x, CLASS_HiCall, &f, &args))
+        names_add(callees, f);
+    for (i = 0; i < runtime_classArities[runtime_class(x)]; i++)
+        collectCallees(field(x, i), callees);
+}
+
+static long applyFunc(int a, struct names *callees)
+{
+    struct closure *c;
+    long self, args, fields, body, clauses = nil;
+    int i;
+
+    self = makeId("f_");
+    args = numberedIds("x", applyArities[a]);
+    for (i = closureTargets.nr - 1; i >= 0; i--) {
+        c = &closures[i];
+        if (c->arity != applyArities[a]
+                || names_find(callees, c->name) < 0)
+            continue;
+        fields = numberedIds("e", c->nrCaptured);
+        body = HiCall(c->target, concat(fields, args));
+        clauses = prim_cons(HiCase(c->name, fields,
+            HiBlock(HiBegin(list1(body)), nil)), clauses);
+    }
+    body = HiBegin(list1(HiMatch(self, clauses)));
+    return HiDefineFunc(applies.ids[a], prim_cons(self, args),
+        HiBlock(body, nil));
+}
+
+long convertClosures(long hi)
+{
+    struct names callees;
+    long define, id, args, block, out = nil;
+    int i;
+
+    envSize = 0;
+    nrDefs = 0;
+    nrSpecs = 0;
+    lifted = nil;
+    names_init(&closureTargets);
+    names_init(&closureNames);
+    names_init(&applies);
+    names_init(&funcNames);
+
+    /*
+     * A toplevel variable bound to a func form is a known function, lifted
+     * like a local one. It captures nothing, since toplevel bindings are
+     * not local.
+     */
+    forEach(hi, define) {
+        if (match(define, CLASS_HiDefineFunc, &id, &args, &block))
+            i = bindKnown(id, id, length(args));
+        else if (match(define, CLASS_HiDefineVar, &id, &block)
+                && match(block, CLASS_HiFunc, &args, &block))
+            i = bindKnown(id, fresh(idString(id)), length(args));
+        else if (match(define, CLASS_HiDefineVar, &id, &block))
+            i = push(id, VAR);
+        else
+            continue;
+        env[i].local = 0;
+    }
+
+    forEach(hi, define) {
+        if (match(define, CLASS_HiDefineFunc, &id, &args, &block)) {
+            define = convertFunc(id, nil, args, block);
+        } else if (match(define, CLASS_HiDefineVar, &id, &block)) {
+            if (match(block, CLASS_HiFunc, &args, &block))
+                define = convertFunc(env[lookup(id)].target, nil, args,
+                    block);
+            else
+                define = HiDefineVar(id, convertExpr(block));
+        }
+        out = prim_cons(define, out);
+    }
+    forEach(concat(reverse(out), reverse(lifted)), define)
+        addDef(define);
+
+    /* Specializing appends to defs, so this also visits the copies. */
+    for (i = 0; i < nrDefs; i++) {
+        define = specializeCalls(defs[i]);
+        defs[i] = define;
+    }
+
+    names_init(&callees);
+    for (i = 0; i < nrDefs; i++)
+        collectCallees(defs[i], &callees);
+    out = nil;
+    for (i = 0; i < closureTargets.nr; i++)
+        if (names_find(&callees, closures[i].name) >= 0)
+            out = prim_cons(HiDefineCons(closures[i].name,
+                numberedIds("e", closures[i].nrCaptured)), out);
+    for (i = 0; i < nrDefs; i++)
+        out = prim_cons(defs[i], out);
+    for (i = 0; i < applies.nr; i++)
+        if (names_find(&callees, applies.ids[i]) >= 0)
+            out = prim_cons(applyFunc(i, &callees), out);
+    out = reverse(out);
+
+    names_release(&callees);
+    names_release(&funcNames);
+    names_release(&applies);
+    names_release(&closureNames);
+    names_release(&closureTargets);
+    return out;
+}
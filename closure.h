@@ -0,0 +1 @@
+long convertClosures(long hi);
@@ -1,3 +1,7 @@
+%define api.pure full
+%parse-param {struct lexer *lexer} {long *program}
+%lex-param {struct lexer *lexer}
+
 %{
 
 #include <ctype.h>
@@ -10,18 +14,45 @@
 #include "runtime.h"
 #include "util.h"
 
-int yylex(void);
-int yyerror(const char *e);
+/*
+ * Lists are built left-recursively so that the parser stack does not grow
+ * with the length of a list. The elements are collected while the list is
+ * still private to the parser, and listValue stores them as one run.
+ */
+static struct runtime_list emptyList(void)
+{
+    struct runtime_list xs;
+
+    runtime_listInit(&xs);
+    return xs;
+}
+
+static struct runtime_list listAppend(struct runtime_list xs, long x)
+{
+    runtime_listAppend(&xs, x);
+    return xs;
+}
 
-static long fiProgram;
+static long listValue(struct runtime_list xs)
+{
+    return runtime_listFinish(&xs, nil);
+}
 
 %}
 
 %union {
     char text[64];
     long syntax;
+    struct runtime_list list;
 }
 
+%{
+
+int yylex(YYSTYPE *lval, struct lexer *lexer);
+int yyerror(struct lexer *lexer, long *program, const char *e);
+
+%}
+
 %token <syntax> ID
 %token <syntax> NUMBER
 %token <syntax> STRING
@@ -41,19 +72,19 @@ static long fiProgram;
 %type <syntax> defineVar
 %type <syntax> defineFunc
 %type <syntax> defineCons
-%type <syntax> ids
+%type <list> ids
 %type <syntax> const
 %type <syntax> expr
 %type <syntax> define
-%type <syntax> defines
+%type <list> defines
 %type <syntax> block
-%type <syntax> blocks
+%type <list> blocks
 %type <syntax> stmt
-%type <syntax> stmts
+%type <list> stmts
 %type <syntax> transfer
 %type <syntax> call
 %type <syntax> match
-%type <syntax> clauses
+%type <list> clauses
 %type <syntax> goto
 %type <syntax> return
 %type <syntax> app
@@ -62,79 +93,90 @@ static long fiProgram;
 
 %%
 
-program     : defines { fiProgram = $1; }
-defines     : { $$ = nil; }
-            | define defines { $$ = prim_cons($1, $2); }
+program     : defines { *program = listValue($1); }
+defines     : { $$ = emptyList(); }
+            | defines define { $$ = listAppend($1, $2); }
 define      : defineVar | defineFunc | defineCons
 defineVar   : '(' DEFINE ID const ')' {
                 $$ = runtime_makeTuple2(CLASS_FiDefineVar, $3, $4);
             }
 defineFunc  : '(' DEFINE '(' ID ids ')' blocks ')' {
-                $$ = runtime_makeTuple3(CLASS_FiDefineFunc, $4, $5, $7);
+                $$ = runtime_makeTuple3(CLASS_FiDefineFunc, $4, listValue($5),
+                    listValue($7));
             }
 defineCons  : '(' DEFINE '(' ID ids ')' ')' {
-                $$ = runtime_makeTuple2(CLASS_FiDefineCons, $4, $5);
+                $$ = runtime_makeTuple2(CLASS_FiDefineCons, $4, listValue($5));
             }
-ids         : { $$ = nil; }
-            | ID ids { $$ = prim_cons($1, $2); }
-blocks      : block { $$ = prim_cons($1, nil); }
-            | block blocks { $$ = prim_cons($1, $2); }
+ids         : { $$ = emptyList(); }
+            | ids ID { $$ = listAppend($1, $2); }
+blocks      : block { $$ = listAppend(emptyList(), $1); }
+            | blocks block { $$ = listAppend($1, $2); }
 block       : '(' DEFINE '(' ID ids ')' '(' stmts transfer ')' {
-                $$ = runtime_makeTuple4(CLASS_FiBlock, $4, $5, $8, $9);
+                $$ = runtime_makeTuple4(CLASS_FiBlock, $4, listValue($5),
+                    listValue($8), $9);
             }
-stmts       : { $$ = nil; }
-            | stmt stmts { $$ = prim_cons($1, $2); }
+stmts       : { $$ = emptyList(); }
+            | stmts stmt { $$ = listAppend($1, $2); }
 stmt        : SET ID expr ')' '(' {
                 $$ = runtime_makeTuple2(CLASS_FiStmt, $2, $3);
             }
 transfer    : call | match | goto | return
 call        : ID '(' ID ids ')' ')' {
-                $$ = runtime_makeTuple3(CLASS_FiCall, $1, $3, $4);
+                $$ = runtime_makeTuple3(CLASS_FiCall, $1, $3, listValue($4));
             }
 call        : RETURN '(' ID ids ')' ')' {
                 /* TODO What to use instead of nil? */
-                $$ = runtime_makeTuple3(CLASS_FiCall, nil, $3, $4);
+                $$ = runtime_makeTuple3(CLASS_FiCall, nil, $3, listValue($4));
             }
 match       : MATCH ID clauses ')' {
-                $$ = runtime_makeTuple2(CLASS_FiMatch, $2, $3);
+                $$ = runtime_makeTuple2(CLASS_FiMatch, $2, listValue($3));
             }
-clauses     : { $$ = nil; }
-            | '(' CASE ID ID ')' clauses {
-                $$ = prim_cons(runtime_makeTuple2(CLASS_FiCase, $3, $4), $6);
+clauses     : { $$ = emptyList(); }
+            | clauses '(' CASE ID ID ')' {
+                $$ = listAppend($1, runtime_makeTuple2(CLASS_FiCase, $4, $5));
             }
-            | '(' ELSE ID ')' clauses {
-                $$ = prim_cons(runtime_makeTuple1(CLASS_FiElse, $3), $5);
+            | clauses '(' ELSE ID ')' {
+                $$ = listAppend($1, runtime_makeTuple1(CLASS_FiElse, $4));
             }
 goto        : GOTO '(' ID ids ')' ')' {
-                $$ = runtime_makeTuple2(CLASS_FiGoto, $3, $4);
+                $$ = runtime_makeTuple2(CLASS_FiGoto, $3, listValue($4));
             }
 return      : RETURN ID ')' {
                 $$ = runtime_makeTuple1(CLASS_FiReturn, $2);
             }
+            | RETURN ID ID ids ')' {
+                long xs;
+                xs = prim_cons($2, prim_cons($3, listValue($4)));
+                $$ = runtime_makeTuple1(CLASS_FiReturnValues, xs);
+            }
 const       : NUMBER | STRING
-expr        : const | app
+expr        : const | app | ID
 app         : '(' ID ids ')' {
                 const char *name;
                 name = runtime_stringValue(prim_fetch($2, 0));
                 if (isupper(name[0]))
-                    $$ = runtime_makeTuple2(CLASS_FiConsApp, $2, $3);
+                    $$ = runtime_makeTuple2(CLASS_FiConsApp, $2, listValue($3));
                 else
-                    $$ = runtime_makeTuple2(CLASS_FiPrimApp, $2, $3);
+                    $$ = runtime_makeTuple2(CLASS_FiPrimApp, $2, listValue($3));
             }
 
 %%
 
 #include "lexer.c"
 
-int yyerror(const char *e)
+int yyerror(struct lexer *lexer, long *program, const char *e)
 {
-    fprintf(stderr, "Line: %d\n", lexer_lineNr);
+    fprintf(stderr, "File: %s Line: %d\n", lexer->name, lexer->lineNr);
     die(e);
     return 0;
 }
 
-long parse(void)
+long parse(FILE *in, const char *name)
 {
-    yyparse();
-    return fiProgram;
+    struct lexer lexer;
+    long program;
+
+    lexer_init(&lexer, in, name);
+    yyparse(&lexer, &program);
+    return program;
 }
@@ -0,0 +1,396 @@
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "names.h"
+#include "runtime.h"
+#include "fi.h"
+#include "util.h"
+
+struct walk {
+    struct names labels;
+    long *blocks;
+    char *seen;
+    int *stack;
+    int depth;
+};
+
+static void push(struct walk *walk, long label)
+{
+    int i;
+
+    i = names_find(&walk->labels, label);
+    if (i < 0)
+        die("Failed to find block.");
+    if (walk->seen[i])
+        return;
+    walk->seen[i] = 1;
+    walk->stack[walk->depth++] = i;
+}
+
+/*
+ * Returns the labels of the blocks that transfer continues at, in the order
+ * they appear.
+ */
+static long successors(long transfer)
+{
+    long ret, f, args, id, clauses, clause, cons, target, targets = nil;
+
+    if (match(transfer, CLASS_FiCall, &ret, &f, &args)) {
+        if (runtime_class(ret) == CLASS_Id)
+            targets = prim_cons(ret, nil);
+    } else if (match(transfer, CLASS_FiGoto, &target, &args)) {
+        targets = prim_cons(target, nil);
+    } else if (match(transfer, CLASS_FiMatch, &id, &clauses)) {
+        forEach(clauses, clause) {
+            if (!match(clause, CLASS_FiCase, &cons, &target))
+                match(clause, CLASS_FiElse, &target);
+            targets = prim_cons(target, targets);
+        }
+        targets = reverse(targets);
+    }
+    return targets;
+}
+
+static void pushSuccessors(struct walk *walk, long transfer)
+{
+    long target;
+
+    forEach(successors(transfer), target)
+        push(walk, target);
+}
+
+/*
+ * Returns the blocks of a function that can be reached from its first
+ * block, in their original order.
+ */
+long fi_reachableBlocks(long blocks)
+{
+    struct walk walk;
+    long block, id, args, stmts, transfer, reachable = nil;
+    int i, n;
+
+    n = length(blocks);
+    walk.blocks = malloc((n + 1) * sizeof(long));
+    walk.seen = calloc(n + 1, 1);
+    walk.stack = malloc((n + 1) * sizeof(int));
+    if (walk.blocks == NULL || walk.seen == NULL || walk.stack == NULL)
+        die("Failed to allocate memory.");
+    walk.depth = 0;
+
+    names_init(&walk.labels);
+    i = 0;
+    forEach(blocks, block) {
+        match(block, CLASS_FiBlock, &id, &args, &stmts, &transfer);
+        names_add(&walk.labels, id);
+        walk.blocks[i++] = block;
+    }
+
+    if (n > 0) {
+        match(walk.blocks[0], CLASS_FiBlock, &id, &args, &stmts, &transfer);
+        push(&walk, id);
+    }
+    while (walk.depth > 0) {
+        i = walk.stack[--walk.depth];
+        match(walk.blocks[i], CLASS_FiBlock, &id, &args, &stmts, &transfer);
+        pushSuccessors(&walk, transfer);
+    }
+
+    for (i = n - 1; i >= 0; i--)
+        if (walk.seen[i])
+            reachable = prim_cons(walk.blocks[i], reachable);
+
+    names_release(&walk.labels);
+    free(walk.stack);
+    free(walk.seen);
+    free(walk.blocks);
+
+    return reachable;
+}
+
+/*
+ * Returns the label that transfer jumps to unconditionally, either with a
+ * goto or after a call returns, or nil. Code for a block that is laid out
+ * just before that label can fall through to it.
+ */
+long fi_fallThrough(long transfer)
+{
+    long ret, f, args, target;
+
+    if (match(transfer, CLASS_FiCall, &ret, &f, &args)
+            && runtime_class(ret) == CLASS_Id)
+        return ret;
+    if (match(transfer, CLASS_FiGoto, &target, &args))
+        return target;
+    return nil;
+}
+
+static int callsDie(long block)
+{
+    long id, args, stmts, transfer, stmt, x, expr, ret, f;
+
+    match(block, CLASS_FiBlock, &id, &args, &stmts, &transfer);
+    forEach(stmts, stmt) {
+        match(stmt, CLASS_FiStmt, &x, &expr);
+        if (match(expr, CLASS_FiPrimApp, &f, &args)
+                && !strcmp(idString(f), "die"))
+            return 1;
+    }
+    return match(transfer, CLASS_FiCall, &ret, &f, &args)
+        && !strcmp(idString(f), "die");
+}
+
+struct layout {
+    struct names labels;
+    long *blocks;
+    char *cold;
+    char *seen;
+    int *postorder;
+    int nrVisited;
+};
+
+static int blockIndex(struct layout *layout, long label)
+{
+    int i;
+
+    i = names_find(&layout->labels, label);
+    if (i < 0)
+        die("Failed to find block.");
+    return i;
+}
+
+static long blockTransfer(struct layout *layout, int i)
+{
+    long id, args, stmts, transfer;
+
+    match(layout->blocks[i], CLASS_FiBlock, &id, &args, &stmts, &transfer);
+    return transfer;
+}
+
+/*
+ * Successors are visited last to first, so that in reverse postorder a
+ * block is followed by its first successor when possible.
+ */
+static void visit(struct layout *layout, int i)
+{
+    long target;
+    int j;
+
+    layout->seen[i] = 1;
+    forEach(reverse(successors(blockTransfer(layout, i))), target) {
+        j = blockIndex(layout, target);
+        if (!layout->seen[j])
+            visit(layout, j);
+    }
+    layout->postorder[layout->nrVisited++] = i;
+}
+
+/*
+ * Blocks that call die are cold, and so are blocks that can only continue
+ * at cold blocks. The first block never is.
+ */
+static void markCold(struct layout *layout, int n)
+{
+    long target;
+    int i, changed, allCold, any;
+
+    for (i = 1; i < n; i++)
+        layout->cold[i] = callsDie(layout->blocks[i]);
+    do {
+        changed = 0;
+        for (i = 1; i < n; i++) {
+            if (layout->cold[i])
+                continue;
+            allCold = 1, any = 0;
+            forEach(successors(blockTransfer(layout, i)), target) {
+                allCold &= layout->cold[blockIndex(layout, target)];
+                any = 1;
+            }
+            if (any && allCold)
+                layout->cold[i] = changed = 1;
+        }
+    } while (changed);
+}
+
+/*
+ * Orders the reachable blocks of a function for emitting. The hot blocks
+ * come first, in reverse postorder from the first block, except that a
+ * block whose transfer can fall through is followed by its target when
+ * that is still unplaced. The cold blocks follow in the same way. Returns
+ * the ordered blocks and sets *nrHot to the number of hot ones.
+ */
+long fi_layoutBlocks(long blocks, int *nrHot)
+{
+    struct layout layout;
+    long block, id, args, stmts, transfer, target, laidOut = nil;
+    char *placed;
+    int i, k, n, pass;
+
+    n = length(blocks);
+    layout.blocks = malloc((n + 1) * sizeof(long));
+    layout.cold = calloc(n + 1, 1);
+    layout.seen = calloc(n + 1, 1);
+    layout.postorder = malloc((n + 1) * sizeof(int));
+    placed = calloc(n + 1, 1);
+    if (layout.blocks == NULL || layout.cold == NULL || layout.seen == NULL
+            || layout.postorder == NULL || placed == NULL)
+        die("Failed to allocate memory.");
+    layout.nrVisited = 0;
+
+    names_init(&layout.labels);
+    i = 0;
+    forEach(blocks, block) {
+        match(block, CLASS_FiBlock, &id, &args, &stmts, &transfer);
+        names_add(&layout.labels, id);
+        layout.blocks[i++] = block;
+    }
+
+    *nrHot = 0;
+    if (n > 0) {
+        visit(&layout, 0);
+        markCold(&layout, n);
+    }
+
+    for (pass = 0; pass < 2; pass++) {
+        for (k = layout.nrVisited - 1; k >= 0; k--) {
+            i = layout.postorder[k];
+            while (i >= 0 && !placed[i] && layout.cold[i] == pass) {
+                placed[i] = 1;
+                laidOut = prim_cons(layout.blocks[i], laidOut);
+                if (!pass)
+                    (*nrHot)++;
+                target = fi_fallThrough(blockTransfer(&layout, i));
+                i = target == nil ? -1 : blockIndex(&layout, target);
+            }
+        }
+    }
+
+    names_release(&layout.labels);
+    free(placed);
+    free(layout.postorder);
+    free(layout.seen);
+    free(layout.cold);
+    free(layout.blocks);
+
+    return reverse(laidOut);
+}
+
+static const struct {
+    const char *name;
+    unsigned short class;
+} builtinClasses[] = {
+    { "Fixnum", CLASS_Fixnum },
+    { "String", CLASS_String },
+    { "Nil", CLASS_Nil },
+    { "Cons", CLASS_Cons },
+    { "Id", CLASS_Id },
+    { "Map", CLASS_Map },
+    { "Vector", CLASS_Vector },
+    { "HiDefineVar", CLASS_HiDefineVar },
+    { "HiDefineFunc", CLASS_HiDefineFunc },
+    { "HiDefineCons", CLASS_HiDefineCons },
+    { "HiDefineByMatch", CLASS_HiDefineByMatch },
+    { "HiFunc", CLASS_HiFunc },
+    { "HiBegin", CLASS_HiBegin },
+    { "HiBlock", CLASS_HiBlock },
+    { "HiCall", CLASS_HiCall },
+    { "HiConsApp", CLASS_HiConsApp },
+    { "HiPrimApp", CLASS_HiPrimApp },
+    { "HiMatch", CLASS_HiMatch },
+    { "HiCase", CLASS_HiCase },
+    { "HiElse", CLASS_HiElse },
+    { "FiDefineVar", CLASS_FiDefineVar },
+    { "FiDefineFunc", CLASS_FiDefineFunc },
+    { "FiDefineCons", CLASS_FiDefineCons },
+    { "FiBlock", CLASS_FiBlock },
+    { "FiStmt", CLASS_FiStmt },
+    { "FiCall", CLASS_FiCall },
+    { "FiGoto", CLASS_FiGoto },
+    { "FiReturn", CLASS_FiReturn },
+    { "FiReturnValues", CLASS_FiReturnValues },
+    { "FiMatch", CLASS_FiMatch },
+    { "FiCase", CLASS_FiCase },
+    { "FiElse", CLASS_FiElse },
+    { "FiConsApp", CLASS_FiConsApp },
+    { "FiPrimApp", CLASS_FiPrimApp },
+};
+
+/*
+ * Returns the class of a builtin constructor, or -1 if id names none.
+ */
+int fi_builtinClass(long id)
+{
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(builtinClasses); i++)
+        if (!strcmp(builtinClasses[i].name, idString(id)))
+            return builtinClasses[i].class;
+    return -1;
+}
+
+static int blocksReturnArity(struct names *funcs, int *returnArities,
+        long blocks)
+{
+    long block, id, args, stmts, transfer, ret, f, x;
+    int i;
+
+    forEach(blocks, block) {
+        match(block, CLASS_FiBlock, &id, &args, &stmts, &transfer);
+        if (match(transfer, CLASS_FiReturnValues, &args))
+            return length(args);
+        if (match(transfer, CLASS_FiReturn, &x))
+            return 1;
+    }
+    forEach(blocks, block) {
+        match(block, CLASS_FiBlock, &id, &args, &stmts, &transfer);
+        if (match(transfer, CLASS_FiCall, &ret, &f, &args)
+                && match(ret, CLASS_Nil)) {
+            i = names_find(funcs, f);
+            if (i < 0)
+                return 1;
+            if (returnArities[i] > 0)
+                return returnArities[i];
+        }
+    }
+    return 0;
+}
+
+/*
+ * Returns the number of values each function of fi returns, indexed like
+ * the names that are added to funcs. Zero means the function never
+ * returns, which callers may treat as one value.
+ */
+int *fi_returnArities(long fi, struct names *funcs)
+{
+    long def, id, args, blocks;
+    int *returnArities;
+    int i, changed;
+
+    names_init(funcs);
+    forEach(fi, def)
+        if (match(def, CLASS_FiDefineFunc, &id, &args, &blocks))
+            names_add(funcs, id);
+
+    returnArities = calloc(funcs->nr + 1, sizeof(int));
+    if (returnArities == NULL)
+        die("Failed to allocate memory.");
+
+    /*
+     * Functions that only tail call inherit the arity of their callees.
+     */
+    do {
+        changed = 0;
+        forEach(fi, def) {
+            if (match(def, CLASS_FiDefineFunc, &id, &args, &blocks)) {
+                i = names_find(funcs, id);
+                if (returnArities[i] == 0) {
+                    returnArities[i] = blocksReturnArity(funcs, returnArities,
+                        blocks);
+                    changed |= returnArities[i] != 0;
+                }
+            }
+        }
+    } while (changed);
+
+    return returnArities;
+}
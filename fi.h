@@ -0,0 +1,79 @@
+/*
+ * Helpers for taking apart FI syntax trees. The printer and the analyses
+ * that run over FI programs share them.
+ */
+
+static inline int match(long x, unsigned short class, ...)
+{
+    va_list ap;
+    long *p;
+    int arity, i, matched;
+
+    va_start(ap, class);
+
+    matched = (runtime_class(x) == class);
+    arity = runtime_classArities[class];
+    for (i = 0; i < arity; i++) {
+        p = va_arg(ap, long *);
+        if (matched)
+            *p = prim_fetch(x, runtime_makeNumber(i));
+    }
+
+    va_end(ap);
+
+    return matched;
+}
+
+#define forEach(xs, x)                          \
+    for (long forEach_state_##__LINE__ = xs;    \
+            match(forEach_state_##__LINE__,     \
+                CLASS_Cons, &x,                 \
+                &forEach_state_##__LINE__); )
+
+static inline long idName(long id)
+{
+    return prim_fetch(id, runtime_0);
+}
+
+static inline const char *idString(long id)
+{
+    return runtime_stringValue(idName(id));
+}
+
+static inline int length(long xs)
+{
+    long x;
+    int len = 0;
+    forEach(xs, x)
+        len++;
+    return len;
+}
+
+static inline int idEq(long a, long b)
+{
+    return !strcmp(idString(a), idString(b));
+}
+
+/*
+ * Functions named memo followed by a capital letter, such as memoClassify,
+ * are memoized; see runtime_memoCall.
+ */
+static inline int fi_isMemoized(long name)
+{
+    const char *s = idString(name);
+
+    return !strncmp(s, "memo", 4) && s[4] >= 'A' && s[4] <= 'Z';
+}
+
+static inline long reverse(long xs)
+{
+    return runtime_listReverse(xs);
+}
+
+long fi_reachableBlocks(long blocks);
+long fi_fallThrough(long transfer);
+long fi_layoutBlocks(long blocks, int *nrHot);
+int fi_builtinClass(long id);
+
+struct names;
+int *fi_returnArities(long fi, struct names *funcs);
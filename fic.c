@@ -1,21 +1,157 @@
-#include "lexer.h"
+#include <stdio.h>
+#include <string.h>
+
+#include "asm.h"
+#include "gvn.h"
 #include "parser.h"
+#include "passes.h"
 #include "printer.h"
 #include "runtime.h"
+#include "strip.h"
+#include "unbox.h"
 #include "util.h"
 
-int main(void)
+/*
+ * Set by -S: write x86-64 assembly instead of C.
+ */
+static int assembly;
+
+static struct passes_options options = { 1, 0, 0, NULL };
+
+static long parseTimed(int n, char **paths)
+{
+    struct passes_mark mark;
+    long fi;
+
+    mark = passes_mark();
+    if (n > 0)
+        fi = parseFiles(n, paths);
+    else
+        fi = parse(stdin, "<stdin>");
+    if (options.timing)
+        passes_report("parse", mark);
+    return fi;
+}
+
+static void compile(long fi, FILE *out)
+{
+    struct passes_mark mark;
+
+    fi = passes_run(fi, &options);
+
+    mark = passes_mark();
+    if (assembly)
+        assemble(fi, out);
+    else
+        print(fi, out);
+    if (options.timing)
+        passes_report(assembly ? "assemble" : "print", mark);
+}
+
+/*
+ * Compiles one input file to one output file and then resets the runtime,
+ * so that the next unit starts with an empty store.
+ */
+static void compileUnit(char *inPath, const char *outPath)
+{
+    FILE *out;
+    long fi;
+
+    fi = parseTimed(1, &inPath);
+
+    out = fopen(outPath, "w");
+    if (out == NULL) {
+        fprintf(stderr, "File: %s\n", outPath);
+        die("Failed to open output file.");
+    }
+    compile(fi, out);
+    if (fclose(out) != 0) {
+        fprintf(stderr, "File: %s\n", outPath);
+        die("Failed to write output file.");
+    }
+
+    runtime_reset();
+}
+
+/*
+ * Batch mode: fic -b in1.fi out1.c in2.fi out2.c ...
+ */
+static void batch(int argc, char **argv)
+{
+    int i;
+
+    if (argc % 2 != 0)
+        die("Batch mode needs pairs of input and output files.");
+    for (i = 0; i < argc; i += 2)
+        compileUnit(argv[i], argv[i + 1]);
+}
+
+/*
+ * Server mode: fic -s reads requests of the form "in.fi out.c", one per
+ * line, from standard input. After writing each output file it answers
+ * "ok out.c" on standard output. It stops at end of input or at an empty
+ * line. Errors end the process, as they do for a single run.
+ */
+static void serve(void)
+{
+    char line[8192];
+    char *inPath, *outPath;
+
+    while (fgets(line, sizeof(line), stdin) != NULL) {
+        if (strchr(line, '\n') == NULL && !feof(stdin))
+            die("Request line too long.");
+        inPath = strtok(line, " \t\r\n");
+        if (inPath == NULL)
+            break;
+        outPath = strtok(NULL, " \t\r\n");
+        if (outPath == NULL || strtok(NULL, " \t\r\n") != NULL)
+            die("Requests must name an input and an output file.");
+
+        compileUnit(inPath, outPath);
+        printf("ok %s\n", outPath);
+        fflush(stdout);
+    }
+}
+
+int main(int argc, char **argv)
 {
     long fi;
 
     require64BitLongs();
 
     runtime_init();
-    lexer_init();
 
-    fi = parse();
+    passes_register("strip", 1, stripUnreachable);
+    passes_register("unbox", 1, unboxTuples);
+    passes_register("gvn", 2, gvnFunctions);
+
+    for (; argc > 1 && argv[1][0] == '-'; argc--, argv++) {
+        if (!strcmp(argv[1], "-S"))
+            assembly = 1;
+        else if (!strcmp(argv[1], "-O0") || !strcmp(argv[1], "-O1")
+                || !strcmp(argv[1], "-O2"))
+            options.level = argv[1][2] - '0';
+        else if (!strcmp(argv[1], "-V"))
+            options.verify = 1;
+        else if (!strcmp(argv[1], "-t"))
+            options.timing = 1;
+        else if (!strcmp(argv[1], "-d") && argc > 2)
+            options.dumpAfter = argv[2], argc--, argv++;
+        else
+            break;
+    }
+    if (argc > 1 && !strcmp(argv[1], "-b")) {
+        batch(argc - 2, argv + 2);
+        return 0;
+    }
+    if (argc > 1 && !strcmp(argv[1], "-s")) {
+        serve();
+        return 0;
+    }
+
+    fi = parseTimed(argc - 1, argv + 1);
 
-    print(fi);
+    compile(fi, stdout);
 
     return 0;
 }
@@ -0,0 +1,682 @@
+#include <ctype.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fuse.h"
+#include "names.h"
+#include "runtime.h"
+#include "fi.h"
+#include "util.h"
+
+/*
+ * List fusion for HI programs.
+ *
+ * The list combinators map, fold and append are recognized by their
+ * definitions, which must be those of compiler.hi up to the names of the
+ * variables:
+ *
+ *     (define (map xs f)
+ *         (match xs
+ *             (case (Cons y ys) (cons (f y) (map ys f)))
+ *             (else nil)))
+ *
+ * and likewise a right fold (f y (fold ys a f)) with a in the else clause,
+ * and (cons y (append ys zs)) with zs. Chains of them are rewritten so that
+ * no intermediate list is built:
+ *
+ *     (map (map xs f) g)          =>  (map xs (func (y) (g (f y))))
+ *     (fold (map xs f) a g)       =>  (fold xs a (func (y r) (g (f y) r)))
+ *     (append (map xs f) ys)      =>  (fold xs ys (func (y r) (cons (f y) r)))
+ *     (map (append xs ys) f)      =>  (append (map xs f) (map ys f))
+ *     (fold (append xs ys) a g)   =>  (fold xs (fold ys a g) g)
+ *     (append (append xs ys) zs)  =>  (append xs (append ys zs))
+ *
+ * A variable that a begin form binds to a map or append and then uses once,
+ * as the list argument of a combinator, is substituted first.
+ *
+ * Function arguments must be variables or func forms. Func forms are applied
+ * by binding their arguments in a begin form. Fusion interleaves the calls
+ * of f and g and moves them past the evaluation of other arguments, so a
+ * chain is only rewritten when its functions are known to be pure: func
+ * forms whose bodies are pure, or toplevel functions that call only pure
+ * primitives, constructors and pure toplevel functions. A producer is only
+ * moved to its use when it is pure in the same sense.
+ */
+
+enum {
+    MAP,
+    FOLD,
+    APPEND,
+};
+
+static const struct {
+    const char *name;
+    int arity;
+} combinators[] = {
+    [MAP] = { "map", 2 },
+    [FOLD] = { "fold", 3 },
+    [APPEND] = { "append", 2 },
+};
+
+static int defined[ARRAY_SIZE(combinators)];
+static int counter;
+
+/*
+ * Toplevel functions, with pure set for those known to have no effects,
+ * and the variables bound anywhere below the toplevel, whose names are not
+ * taken to mean the toplevel functions.
+ */
+static struct names funcs;
+static char *pure;
+static struct names locals;
+
+/* Primitives other than these may have effects or call functions. */
+static const char *purePrims[] = {
+    "fetch", "cons",
+    "mapEmpty", "mapGet", "mapPut", "mapRemove", "mapSize",
+    "vectorMake", "vectorFromList", "vectorLength", "vectorRef",
+    "stringLength", "stringRef",
+};
+
+static int isPureExpr(long x);
+
+static long makeId(const char *name)
+{
+    return Id(runtime_makeString(name));
+}
+
+static long fresh(void)
+{
+    char name[32];
+
+    /* The underscore keeps the name apart from those of the program. */
+    snprintf(name, sizeof(name), "fuse_%d", counter++);
+    return makeId(name);
+}
+
+static long list1(long a)
+{
+    return prim_cons(a, nil);
+}
+
+static long list2(long a, long b)
+{
+    return prim_cons(a, list1(b));
+}
+
+static long list3(long a, long b, long c)
+{
+    return prim_cons(a, list2(b, c));
+}
+
+static int isCall(long x, int which, long *args)
+{
+    long f, xs, arg;
+    int i = 0;
+
+    if (!defined[which] || !match(x, CLASS_HiCall, &f, &xs))
+        return 0;
+    if (strcmp(idString(f), combinators[which].name))
+        return 0;
+    if (length(xs) != combinators[which].arity)
+        return 0;
+    forEach(xs, arg)
+        args[i++] = arg;
+    return 1;
+}
+
+static long call(int which, long args)
+{
+    return HiCall(makeId(combinators[which].name), args);
+}
+
+static int isPureCallee(long f)
+{
+    const char *name;
+    int i;
+
+    if (runtime_class(f) != CLASS_Id || names_find(&locals, f) >= 0)
+        return 0;
+    name = idString(f);
+    if (isupper((unsigned char)name[0]))
+        return 1;
+    for (i = 0; i < ARRAY_SIZE(purePrims); i++)
+        if (!strcmp(name, purePrims[i]))
+            return 1;
+    i = names_find(&funcs, f);
+    return i >= 0 && pure[i];
+}
+
+/*
+ * Whether calling f, a function argument of a combinator, has no effects.
+ */
+static int isPureFunction(long f)
+{
+    if (runtime_class(f) == CLASS_Id)
+        return isPureCallee(f);
+    return runtime_class(f) == CLASS_HiFunc && isPureExpr(f);
+}
+
+static long lambda(long args, long body)
+{
+    return HiFunc(args, HiBlock(body, nil));
+}
+
+/*
+ * Applies a variable or func form to arguments that are variables.
+ */
+static long apply(long f, long args)
+{
+    long params, block, param, arg, forms = nil;
+
+    if (!match(f, CLASS_HiFunc, &params, &block)
+            || length(params) != length(args))
+        return HiCall(f, args);
+
+    forEach(params, param) {
+        match(args, CLASS_Cons, &arg, &args);
+        forms = prim_cons(HiDefineVar(param, HiBlock(arg, nil)), forms);
+    }
+    return HiBegin(reverse(prim_cons(block, forms)));
+}
+
+static long fuse(long x)
+{
+    long a[3], b[3], y, r, body;
+
+    if (isCall(x, MAP, a) && isPureFunction(a[1])) {
+        if (isCall(a[0], MAP, b) && isPureFunction(b[1])) {
+            y = fresh();
+            body = apply(a[1], list1(apply(b[1], list1(y))));
+            return fuse(call(MAP, list2(b[0], lambda(list1(y), body))));
+        }
+        if (isCall(a[0], APPEND, b) && defined[FOLD]) {
+            return fuse(call(APPEND, list2(
+                fuse(call(MAP, list2(b[0], a[1]))),
+                fuse(call(MAP, list2(b[1], a[1]))))));
+        }
+    }
+
+    if (isCall(x, FOLD, a) && isPureFunction(a[2])) {
+        if (isCall(a[0], MAP, b) && isPureFunction(b[1])) {
+            y = fresh();
+            r = fresh();
+            body = apply(a[2], list2(apply(b[1], list1(y)), r));
+            return fuse(call(FOLD, list3(b[0], a[1],
+                lambda(list2(y, r), body))));
+        }
+        if (isCall(a[0], APPEND, b)) {
+            return fuse(call(FOLD, list3(b[0],
+                fuse(call(FOLD, list3(b[1], a[1], a[2]))), a[2])));
+        }
+    }
+
+    if (isCall(x, APPEND, a)) {
+        if (isCall(a[0], MAP, b) && isPureFunction(b[1]) && defined[FOLD]) {
+            y = fresh();
+            r = fresh();
+            body = HiCall(makeId("cons"),
+                list2(apply(b[1], list1(y)), r));
+            return fuse(call(FOLD, list3(b[0], a[1],
+                lambda(list2(y, r), body))));
+        }
+        if (isCall(a[0], APPEND, b)) {
+            return call(APPEND, list2(b[0],
+                fuse(call(APPEND, list2(b[1], a[1])))));
+        }
+    }
+
+    return x;
+}
+
+static int isHi(long x)
+{
+    unsigned short class = runtime_class(x);
+
+    return class >= CLASS_HiDefineVar && class <= CLASS_HiElse;
+}
+
+static long makeTuple(unsigned short class, long *fields)
+{
+    switch (runtime_classArities[class]) {
+    case 0:
+        return runtime_makeTuple0(class);
+    case 1:
+        return runtime_makeTuple1(class, fields[0]);
+    case 2:
+        return runtime_makeTuple2(class, fields[0], fields[1]);
+    case 3:
+        return runtime_makeTuple3(class, fields[0], fields[1], fields[2]);
+    }
+    die("Unexpected arity of syntax tree node.");
+    return nil;
+}
+
+/*
+ * Counts the occurrences of the variable v, including binding ones.
+ */
+static int occurrences(long x, long v)
+{
+    long y;
+    int i, n = 0;
+
+    if (runtime_class(x) == CLASS_Id)
+        return idEq(x, v);
+    if (runtime_class(x) == CLASS_Cons) {
+        forEach(x, y)
+            n += occurrences(y, v);
+        return n;
+    }
+    if (!isHi(x))
+        return 0;
+    for (i = 0; i < runtime_classArities[runtime_class(x)]; i++)
+        n += occurrences(prim_fetch(x, runtime_makeNumber(i)), v);
+    return n;
+}
+
+static void collectIds(long x, struct names *ids)
+{
+    long y;
+    int i;
+
+    if (runtime_class(x) == CLASS_Id) {
+        names_add(ids, x);
+    } else if (runtime_class(x) == CLASS_Cons) {
+        forEach(x, y)
+            collectIds(y, ids);
+    } else if (isHi(x)) {
+        for (i = 0; i < runtime_classArities[runtime_class(x)]; i++)
+            collectIds(prim_fetch(x, runtime_makeNumber(i)), ids);
+    }
+}
+
+/*
+ * Collects the variables that x binds anywhere within it.
+ */
+static void collectBinders(long x, struct names *ids)
+{
+    long y;
+    int i;
+
+    if (runtime_class(x) == CLASS_Cons) {
+        forEach(x, y)
+            collectBinders(y, ids);
+        return;
+    }
+    if (!isHi(x))
+        return;
+
+    switch (runtime_class(x)) {
+    case CLASS_HiDefineVar:
+    case CLASS_HiDefineFunc:
+    case CLASS_HiDefineByMatch:
+        names_add(ids, prim_fetch(x, runtime_makeNumber(0)));
+        if (runtime_class(x) != CLASS_HiDefineVar)
+            collectIds(prim_fetch(x, runtime_makeNumber(1)), ids);
+        break;
+    case CLASS_HiFunc:
+        collectIds(prim_fetch(x, runtime_makeNumber(0)), ids);
+        break;
+    case CLASS_HiCase:
+        collectIds(prim_fetch(x, runtime_makeNumber(1)), ids);
+        break;
+    }
+    for (i = 0; i < runtime_classArities[runtime_class(x)]; i++)
+        collectBinders(prim_fetch(x, runtime_makeNumber(i)), ids);
+}
+
+/*
+ * Whether evaluating x has no effects. A func form is only pure when its
+ * body is, so that it stays pure where fusion applies it. A match that
+ * fails is not taken for an effect.
+ */
+static int isPureExpr(long x)
+{
+    long f, args, y;
+    int i;
+
+    if (runtime_class(x) == CLASS_Cons) {
+        forEach(x, y)
+            if (!isPureExpr(y))
+                return 0;
+        return 1;
+    }
+    if (!isHi(x))
+        return 1;
+
+    if ((match(x, CLASS_HiCall, &f, &args)
+            || match(x, CLASS_HiPrimApp, &f, &args)) && !isPureCallee(f))
+        return 0;
+    for (i = 0; i < runtime_classArities[runtime_class(x)]; i++)
+        if (!isPureExpr(prim_fetch(x, runtime_makeNumber(i))))
+            return 0;
+    return 1;
+}
+
+/*
+ * Replaces the combinator call whose list argument is v by a call on e.
+ * Func forms and local functions are not entered since that would change
+ * how often e is evaluated, and neither are defines by match.
+ */
+static long substitute(long x, long v, long e, int *done)
+{
+    long fields[3], a[3], f, args, rest, y, ys = nil;
+    unsigned short class;
+    int i, which, changed = 0;
+
+    class = runtime_class(x);
+    if (class == CLASS_Cons) {
+        forEach(x, y) {
+            long z = substitute(y, v, e, done);
+            changed |= z != y;
+            ys = prim_cons(z, ys);
+        }
+        return changed ? reverse(ys) : x;
+    }
+    if (!isHi(x) || class == CLASS_HiFunc || class == CLASS_HiDefineFunc
+            || class == CLASS_HiDefineByMatch)
+        return x;
+
+    for (which = 0; which < ARRAY_SIZE(combinators); which++) {
+        if (isCall(x, which, a) && runtime_class(a[0]) == CLASS_Id
+                && idEq(a[0], v)) {
+            match(x, CLASS_HiCall, &f, &args);
+            match(args, CLASS_Cons, &y, &rest);
+            *done = 1;
+            return fuse(HiCall(f, prim_cons(e, rest)));
+        }
+    }
+
+    for (i = 0; i < runtime_classArities[class]; i++) {
+        fields[i] = prim_fetch(x, runtime_makeNumber(i));
+        y = substitute(fields[i], v, e, done);
+        changed |= y != fields[i];
+        fields[i] = y;
+    }
+    x = changed ? makeTuple(class, fields) : x;
+    if (changed && class == CLASS_HiCall)
+        x = fuse(x);
+    return x;
+}
+
+/*
+ * Tries to move the producer bound by stmts[i] into its single use.
+ */
+static int inlineProducer(long *stmts, int n, int i)
+{
+    struct names free;
+    long v, block, e, defines, a[3], rest;
+    int j, k, uses = 0, done = 0, ok = 1;
+
+    if (!match(stmts[i], CLASS_HiDefineVar, &v, &block)
+            || !match(block, CLASS_HiBlock, &e, &defines) || defines != nil)
+        return 0;
+    if (isCall(e, MAP, a))
+        ok = isPureFunction(a[1]);
+    else if (isCall(e, APPEND, a))
+        ok = isPureExpr(a[1]);
+    else
+        return 0;
+    if (!ok || !isPureExpr(a[0]))
+        return 0;
+
+    for (j = i + 1; j < n; j++)
+        uses += occurrences(stmts[j], v);
+    if (uses != 1)
+        return 0;
+
+    /*
+     * The free variables of e must mean the same at the point of use.
+     */
+    names_init(&free);
+    collectIds(e, &free);
+    for (j = i + 1; j < n && ok; j++) {
+        struct names bound;
+
+        names_init(&bound);
+        collectBinders(stmts[j], &bound);
+        for (k = 0; k < free.nr && ok; k++)
+            if (names_find(&bound, free.ids[k]) >= 0)
+                ok = 0;
+        names_release(&bound);
+    }
+    names_release(&free);
+    if (!ok)
+        return 0;
+
+    for (j = i + 1; j < n && !done; j++) {
+        rest = substitute(stmts[j], v, e, &done);
+        if (done)
+            stmts[j] = rest;
+    }
+    return done;
+}
+
+static long fuseBegin(long x)
+{
+    long forms, form, *stmts;
+    int i, n, m, changed = 0;
+
+    match(x, CLASS_HiBegin, &forms);
+    n = length(forms);
+    stmts = malloc(n * sizeof(*stmts));
+    if (!stmts)
+        die("Failed to allocate memory.");
+    i = 0;
+    forEach(forms, form)
+        stmts[i++] = form;
+
+    /* Compacting in place leaves stmts[i + 1..n) intact for the search. */
+    for (i = 0, m = 0; i < n; i++) {
+        if (i < n - 1 && inlineProducer(stmts, n, i))
+            changed = 1;
+        else
+            stmts[m++] = stmts[i];
+    }
+
+    if (changed) {
+        forms = nil;
+        for (i = m - 1; i >= 0; i--)
+            forms = prim_cons(stmts[i], forms);
+        x = HiBegin(forms);
+    }
+    free(stmts);
+    return x;
+}
+
+static long rewrite(long x)
+{
+    long fields[3], y, ys = nil;
+    unsigned short class;
+    int i, changed = 0;
+
+    class = runtime_class(x);
+    if (class == CLASS_Cons) {
+        forEach(x, y) {
+            long z = rewrite(y);
+            changed |= z != y;
+            ys = prim_cons(z, ys);
+        }
+        return changed ? reverse(ys) : x;
+    }
+    if (!isHi(x))
+        return x;
+
+    for (i = 0; i < runtime_classArities[class]; i++) {
+        fields[i] = prim_fetch(x, runtime_makeNumber(i));
+        y = rewrite(fields[i]);
+        changed |= y != fields[i];
+        fields[i] = y;
+    }
+    if (changed)
+        x = makeTuple(class, fields);
+
+    if (class == CLASS_HiCall)
+        x = fuse(x);
+    else if (class == CLASS_HiBegin)
+        x = fuseBegin(x);
+    return x;
+}
+
+/*
+ * Definitions.
+ */
+static long body(long x)
+{
+    long forms, form, rest, expr, defines;
+
+    for (;;) {
+        if (match(x, CLASS_HiBlock, &expr, &defines) && defines == nil)
+            x = expr;
+        else if (match(x, CLASS_HiBegin, &forms)
+                && match(forms, CLASS_Cons, &form, &rest) && rest == nil)
+            x = form;
+        else
+            return x;
+    }
+}
+
+static int isVar(long x, long v)
+{
+    return runtime_class(x) == CLASS_Id && idEq(x, v);
+}
+
+/*
+ * Matches x against a call of the variable f with n arguments.
+ */
+static int callArgs(long x, long f, int n, long *args)
+{
+    long g, xs, arg;
+    int i = 0;
+
+    if (!match(x, CLASS_HiCall, &g, &xs) || !isVar(g, f) || length(xs) != n)
+        return 0;
+    forEach(xs, arg)
+        args[i++] = arg;
+    return 1;
+}
+
+/*
+ * Matches x against (f v0 v1 ...), with variables for the arguments.
+ */
+static int isCallOf(long x, long f, int n, const long *vars)
+{
+    long args[3];
+    int i;
+
+    if (!callArgs(x, f, n, args))
+        return 0;
+    for (i = 0; i < n; i++)
+        if (!isVar(args[i], vars[i]))
+            return 0;
+    return 1;
+}
+
+static int hasShape(int which, long id, long params, long block)
+{
+    long p[3], test, clauses, clause, c, vars, caseBlock, param, y, ys;
+    long a[3], v[3], step = nil, base = nil;
+    int i = 0;
+
+    if (length(params) != combinators[which].arity)
+        return 0;
+    forEach(params, param)
+        p[i++] = param;
+    if (!match(body(block), CLASS_HiMatch, &test, &clauses)
+            || !isVar(test, p[0]) || length(clauses) != 2)
+        return 0;
+
+    forEach(clauses, clause) {
+        if (match(clause, CLASS_HiCase, &c, &vars, &caseBlock)
+                && !strcmp(idString(c), "Cons") && length(vars) == 2) {
+            match(vars, CLASS_Cons, &y, &vars);
+            match(vars, CLASS_Cons, &ys, &vars);
+            step = body(caseBlock);
+        } else if (match(clause, CLASS_HiElse, &caseBlock)
+                || (match(clause, CLASS_HiCase, &c, &vars, &caseBlock)
+                    && !strcmp(idString(c), "Nil") && vars == nil)) {
+            base = body(caseBlock);
+        }
+    }
+    if (step == nil || base == nil || idEq(y, ys))
+        return 0;
+    for (i = 0; i < combinators[which].arity; i++)
+        if (idEq(y, p[i]) || idEq(ys, p[i]))
+            return 0;
+
+    v[0] = ys;
+    v[1] = p[1];
+    v[2] = p[2];
+    switch (which) {
+    case MAP:
+        return isVar(base, makeId("nil"))
+            && callArgs(step, makeId("cons"), 2, a)
+            && isCallOf(a[0], p[1], 1, &y)
+            && isCallOf(a[1], id, 2, v);
+    case FOLD:
+        return isVar(base, p[1])
+            && callArgs(step, p[2], 2, a)
+            && isVar(a[0], y)
+            && isCallOf(a[1], id, 3, v);
+    case APPEND:
+        return isVar(base, p[1])
+            && callArgs(step, makeId("cons"), 2, a)
+            && isVar(a[0], y)
+            && isCallOf(a[1], id, 2, v);
+    }
+    return 0;
+}
+
+long fuseLists(long hi)
+{
+    long define, id, args, block;
+    int i, changed;
+
+    names_init(&funcs);
+    names_init(&locals);
+    forEach(hi, define) {
+        if (!match(define, CLASS_HiDefineFunc, &id, &args, &block))
+            continue;
+        names_add(&funcs, id);
+        collectIds(args, &locals);
+        collectBinders(block, &locals);
+    }
+
+    /* Functions are pure until they are found to do something that is not. */
+    pure = malloc(funcs.nr + 1);
+    if (pure == NULL)
+        die("Failed to allocate memory.");
+    memset(pure, 1, funcs.nr + 1);
+    do {
+        changed = 0;
+        forEach(hi, define) {
+            if (!match(define, CLASS_HiDefineFunc, &id, &args, &block))
+                continue;
+            i = names_find(&funcs, id);
+            if (pure[i] && !isPureExpr(block)) {
+                pure[i] = 0;
+                changed = 1;
+            }
+        }
+    } while (changed);
+
+    for (i = 0; i < ARRAY_SIZE(combinators); i++)
+        defined[i] = 0;
+    forEach(hi, define) {
+        if (!match(define, CLASS_HiDefineFunc, &id, &args, &block)
+                || names_find(&locals, id) >= 0)
+            continue;
+        for (i = 0; i < ARRAY_SIZE(combinators); i++)
+            if (!strcmp(idString(id), combinators[i].name)
+                    && hasShape(i, id, args, block))
+                defined[i] = 1;
+    }
+
+    hi = rewrite(hi);
+    free(pure);
+    names_release(&locals);
+    names_release(&funcs);
+    return hi;
+}
@@ -0,0 +1 @@
+long fuseLists(long hi);
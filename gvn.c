@@ -0,0 +1,697 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "names.h"
+#include "runtime.h"
+#include "fi.h"
+#include "gvn.h"
+#include "util.h"
+
+/*
+ * Value numbering over the dominator tree of each function.
+ *
+ * A statement that computes the same pure primitive application as one in
+ * a dominating block, or a copy, or a fixnum constant seen before, is
+ * dropped and its variable renamed to the earlier one. A value whose class
+ * and fields are known, because it was built by a constructor or because
+ * the block is the only way in from a case of a match on it, gives its
+ * fields to later fetches, and a later match on it becomes a goto to the
+ * clause that it takes.
+ *
+ * FI variables are not scoped, and hand-written FI sometimes assigns one
+ * variable in several blocks. Only variables with a single definition take
+ * part, so that a name always stands for the same value wherever it is
+ * visible.
+ */
+
+static const char *pure[] = {
+    "fetch", "mapGet", "mapSize", "vectorLength", "vectorRef",
+    "stringLength", "stringRef",
+};
+
+struct block {
+    long label;
+    long args;
+    long stmts;
+    long transfer;
+    int *succs;
+    int nrSuccs;
+    int *preds;
+    int nrPreds;
+    int order;
+    int idom;
+    int visited;
+};
+
+struct function {
+    struct block *blocks;
+    int nrBlocks;
+    struct names labels;
+    int *rpo;
+    int nrRpo;
+    struct names vars;
+    int *defs;
+    long *renamed;
+    long *constants;
+    int varsSize;
+};
+
+static void *allocate(size_t size)
+{
+    void *p;
+
+    p = calloc(1, size);
+    if (p == NULL)
+        die("Failed to allocate memory.");
+    return p;
+}
+
+static int isPure(long f)
+{
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(pure); i++)
+        if (!strcmp(pure[i], idString(f)))
+            return 1;
+    return 0;
+}
+
+/*
+ * Variables.
+ */
+static int var(struct function *fn, long x)
+{
+    int i, nr;
+
+    nr = fn->vars.nr;
+    i = names_add(&fn->vars, x);
+    if (i == fn->varsSize) {
+        fn->varsSize = 2 * fn->varsSize + 16;
+        fn->defs = realloc(fn->defs, fn->varsSize * sizeof(int));
+        fn->renamed = realloc(fn->renamed, fn->varsSize * sizeof(long));
+        fn->constants = realloc(fn->constants, fn->varsSize * sizeof(long));
+        if (fn->defs == NULL || fn->renamed == NULL || fn->constants == NULL)
+            die("Failed to allocate memory.");
+    }
+    if (i == nr) {
+        fn->defs[i] = 0;
+        fn->renamed[i] = x;
+        fn->constants[i] = nil;
+    }
+    return i;
+}
+
+static void define(struct function *fn, long x)
+{
+    int i;
+
+    i = var(fn, x);
+    fn->defs[i]++;
+}
+
+static void defineAll(struct function *fn, long xs)
+{
+    long x;
+
+    forEach(xs, x)
+        define(fn, x);
+}
+
+static long canonical(struct function *fn, long x)
+{
+    int i;
+
+    i = names_find(&fn->vars, x);
+    return i < 0 ? x : fn->renamed[i];
+}
+
+static long canonicalAll(struct function *fn, long xs)
+{
+    long x, ys = nil;
+
+    forEach(xs, x)
+        ys = prim_cons(canonical(fn, x), ys);
+    return reverse(ys);
+}
+
+/*
+ * A variable that is assigned once, or not at all in this function, which
+ * makes it a global or a function, always has the same value.
+ */
+static int isStable(struct function *fn, long x)
+{
+    int i;
+
+    i = names_find(&fn->vars, x);
+    return i < 0 || fn->defs[i] <= 1;
+}
+
+static int allStable(struct function *fn, long xs)
+{
+    long x;
+
+    forEach(xs, x)
+        if (!isStable(fn, x))
+            return 0;
+    return 1;
+}
+
+static void renameVar(struct function *fn, long x, long y)
+{
+    fn->renamed[names_find(&fn->vars, x)] = canonical(fn, y);
+}
+
+/*
+ * Keys of the table of available values. Variables that hold a fixnum
+ * constant are keyed by the constant, so that (fetch x i) and (fetch x j)
+ * agree when i and j are both 0.
+ */
+struct key {
+    char *s;
+    size_t len;
+    size_t size;
+};
+
+static void keyAdd(struct key *key, const char *s)
+{
+    size_t n;
+
+    n = strlen(s);
+    if (key->len + n + 2 > key->size) {
+        key->size = 2 * (key->len + n + 2);
+        key->s = realloc(key->s, key->size);
+        if (key->s == NULL)
+            die("Failed to allocate memory.");
+    }
+    if (key->len > 0)
+        key->s[key->len++] = ' ';
+    memcpy(key->s + key->len, s, n + 1);
+    key->len += n;
+}
+
+static void keyAddVar(struct function *fn, struct key *key, long x)
+{
+    char number[32];
+    int i;
+
+    x = canonical(fn, x);
+    i = names_find(&fn->vars, x);
+    if (i >= 0 && fn->constants[i] != nil) {
+        sprintf(number, "#%ld", runtime_fixnumValue(fn->constants[i]));
+        keyAdd(key, number);
+    } else {
+        keyAdd(key, idString(x));
+    }
+}
+
+static long keyString(struct key *key)
+{
+    long s;
+
+    s = runtime_makeString(key->s);
+    free(key->s);
+    return s;
+}
+
+static long appKey(struct function *fn, const char *f, long args)
+{
+    struct key key = { NULL, 0, 0 };
+    long arg;
+
+    keyAdd(&key, f);
+    forEach(args, arg)
+        keyAddVar(fn, &key, arg);
+    return keyString(&key);
+}
+
+static long fieldKey(struct function *fn, long x, int i)
+{
+    struct key key = { NULL, 0, 0 };
+    char number[32];
+
+    keyAdd(&key, "fetch");
+    keyAddVar(fn, &key, x);
+    sprintf(number, "#%d", i);
+    keyAdd(&key, number);
+    return keyString(&key);
+}
+
+static long consKey(struct function *fn, long x)
+{
+    struct key key = { NULL, 0, 0 };
+
+    keyAdd(&key, "Cons");
+    keyAddVar(fn, &key, x);
+    return keyString(&key);
+}
+
+/*
+ * Records that x was built by (class fields).
+ */
+static long know(struct function *fn, long avail, long x, long class,
+        long fields)
+{
+    long field;
+    int i = 0;
+
+    avail = prim_mapPut(avail, consKey(fn, x), FiConsApp(class, fields));
+    forEach(fields, field)
+        avail = prim_mapPut(avail, fieldKey(fn, x, i++), field);
+    return avail;
+}
+
+/*
+ * The control flow graph.
+ */
+static int blockIndex(struct function *fn, long label)
+{
+    int i;
+
+    i = names_find(&fn->labels, label);
+    if (i < 0)
+        die("Jump to a block that does not exist.");
+    return i;
+}
+
+static void addEdge(struct function *fn, int from, long label)
+{
+    struct block *b = &fn->blocks[from];
+
+    b->succs[b->nrSuccs++] = blockIndex(fn, label);
+}
+
+static void findSuccessors(struct function *fn, int i)
+{
+    struct block *b = &fn->blocks[i];
+    long ret, f, args, label, x, clauses, clause, cons;
+
+    b->succs = allocate(sizeof(int));
+    if (match(b->transfer, CLASS_FiCall, &ret, &f, &args)) {
+        if (runtime_class(ret) == CLASS_Id)
+            addEdge(fn, i, ret);
+    } else if (match(b->transfer, CLASS_FiGoto, &label, &args)) {
+        addEdge(fn, i, label);
+    } else if (match(b->transfer, CLASS_FiMatch, &x, &clauses)) {
+        free(b->succs);
+        b->succs = allocate((length(clauses) + 1) * sizeof(int));
+        forEach(clauses, clause) {
+            if (match(clause, CLASS_FiCase, &cons, &label)
+                    || match(clause, CLASS_FiElse, &label))
+                addEdge(fn, i, label);
+        }
+    }
+}
+
+static void findPredecessors(struct function *fn)
+{
+    struct block *b;
+    int i, j;
+
+    for (i = 0; i < fn->nrBlocks; i++)
+        for (j = 0; j < fn->blocks[i].nrSuccs; j++)
+            fn->blocks[fn->blocks[i].succs[j]].nrPreds++;
+    for (i = 0; i < fn->nrBlocks; i++) {
+        b = &fn->blocks[i];
+        b->preds = allocate((b->nrPreds + 1) * sizeof(int));
+        b->nrPreds = 0;
+    }
+    for (i = 0; i < fn->nrBlocks; i++) {
+        for (j = 0; j < fn->blocks[i].nrSuccs; j++) {
+            b = &fn->blocks[fn->blocks[i].succs[j]];
+            b->preds[b->nrPreds++] = i;
+        }
+    }
+}
+
+static void postorder(struct function *fn, int i, int *nr)
+{
+    struct block *b = &fn->blocks[i];
+    int j;
+
+    b->visited = 1;
+    for (j = 0; j < b->nrSuccs; j++)
+        if (!fn->blocks[b->succs[j]].visited)
+            postorder(fn, b->succs[j], nr);
+    b->order = (*nr)++;
+}
+
+static int intersect(struct function *fn, int a, int b)
+{
+    while (a != b) {
+        while (fn->blocks[a].order < fn->blocks[b].order)
+            a = fn->blocks[a].idom;
+        while (fn->blocks[b].order < fn->blocks[a].order)
+            b = fn->blocks[b].idom;
+    }
+    return a;
+}
+
+/*
+ * Cooper, Harvey and Kennedy, "A Simple, Fast Dominance Algorithm". Blocks
+ * that cannot be reached keep an idom of -1.
+ */
+static void findDominators(struct function *fn)
+{
+    struct block *b;
+    int i, j, k, idom, changed;
+
+    for (i = 0; i < fn->nrBlocks; i++)
+        fn->blocks[i].idom = -1;
+    if (fn->nrBlocks == 0)
+        return;
+
+    fn->nrRpo = 0;
+    postorder(fn, 0, &fn->nrRpo);
+    fn->rpo = allocate((fn->nrRpo + 1) * sizeof(int));
+    for (i = 0; i < fn->nrBlocks; i++)
+        if (fn->blocks[i].visited)
+            fn->rpo[fn->nrRpo - 1 - fn->blocks[i].order] = i;
+
+    fn->blocks[0].idom = 0;
+    do {
+        changed = 0;
+        for (i = 1; i < fn->nrRpo; i++) {
+            b = &fn->blocks[fn->rpo[i]];
+            idom = -1;
+            for (j = 0; j < b->nrPreds; j++) {
+                k = b->preds[j];
+                if (fn->blocks[k].idom < 0)
+                    continue;
+                idom = idom < 0 ? k : intersect(fn, k, idom);
+            }
+            if (b->idom != idom) {
+                b->idom = idom;
+                changed = 1;
+            }
+        }
+    } while (changed);
+}
+
+/*
+ * The values that a block knows on entry from the match that is its only
+ * predecessor: the matched value has the class of the case, and the
+ * block's arguments are its fields.
+ */
+static long entryFacts(struct function *fn, int i, long avail)
+{
+    struct block *b = &fn->blocks[i], *p;
+    long x, clauses, clause, cons, label, found = nil;
+
+    if (b->nrPreds != 1)
+        return avail;
+    p = &fn->blocks[b->preds[0]];
+    if (!match(p->transfer, CLASS_FiMatch, &x, &clauses))
+        return avail;
+    forEach(clauses, clause)
+        if (match(clause, CLASS_FiCase, &cons, &label) && idEq(label, b->label))
+            found = cons;
+    if (found == nil || !isStable(fn, x) || !allStable(fn, b->args))
+        return avail;
+    return know(fn, avail, canonical(fn, x), found, b->args);
+}
+
+static long numberStmt(struct function *fn, long stmt, long *avail)
+{
+    long x, expr, f, args, key, y;
+
+    match(stmt, CLASS_FiStmt, &x, &expr);
+    if (!isStable(fn, x))
+        return stmt;
+
+    if (runtime_class(expr) == CLASS_Id) {
+        if (!isStable(fn, expr))
+            return stmt;
+        renameVar(fn, x, expr);
+        return nil;
+    } else if (runtime_class(expr) == CLASS_Fixnum) {
+        fn->constants[names_find(&fn->vars, x)] = expr;
+        key = appKey(fn, "const", prim_cons(x, nil));
+        y = prim_mapGet(*avail, key, nil);
+        if (y != nil) {
+            renameVar(fn, x, y);
+            return nil;
+        }
+        *avail = prim_mapPut(*avail, key, x);
+    } else if (match(expr, CLASS_FiPrimApp, &f, &args)) {
+        if (!isPure(f) || !allStable(fn, args))
+            return stmt;
+        key = appKey(fn, idString(f), args);
+        y = prim_mapGet(*avail, key, nil);
+        if (y != nil) {
+            renameVar(fn, x, y);
+            return nil;
+        }
+        *avail = prim_mapPut(*avail, key, x);
+    } else if (match(expr, CLASS_FiConsApp, &f, &args)) {
+        if (allStable(fn, args))
+            *avail = know(fn, *avail, x, f, canonicalAll(fn, args));
+    }
+    return stmt;
+}
+
+/*
+ * A match on a value of known class becomes a goto to its clause.
+ */
+static long numberTransfer(struct function *fn, long transfer, long avail)
+{
+    long x, clauses, clause, known, class, fields, cons, label;
+
+    if (!match(transfer, CLASS_FiMatch, &x, &clauses) || !isStable(fn, x))
+        return transfer;
+    known = prim_mapGet(avail, consKey(fn, x), nil);
+    if (!match(known, CLASS_FiConsApp, &class, &fields))
+        return transfer;
+
+    forEach(clauses, clause) {
+        if (match(clause, CLASS_FiCase, &cons, &label) && idEq(cons, class)) {
+            if (length(fn->blocks[blockIndex(fn, label)].args)
+                    != length(fields))
+                return transfer;
+            return FiGoto(label, fields);
+        }
+    }
+    forEach(clauses, clause)
+        if (match(clause, CLASS_FiElse, &label))
+            return FiGoto(label, nil);
+    return transfer;
+}
+
+static void numberBlock(struct function *fn, int i, long avail)
+{
+    struct block *b = &fn->blocks[i];
+    long stmt, stmts = nil;
+    int j;
+
+    avail = entryFacts(fn, i, avail);
+    forEach(b->stmts, stmt) {
+        stmt = numberStmt(fn, stmt, &avail);
+        if (stmt != nil)
+            stmts = prim_cons(stmt, stmts);
+    }
+    b->stmts = reverse(stmts);
+    b->transfer = numberTransfer(fn, b->transfer, avail);
+
+    for (j = 0; j < fn->nrRpo; j++)
+        if (fn->rpo[j] != i && fn->blocks[fn->rpo[j]].idom == i)
+            numberBlock(fn, fn->rpo[j], avail);
+}
+
+/*
+ * Rewriting with the final names.
+ */
+static long renameExpr(struct function *fn, long expr)
+{
+    long f, args;
+
+    if (runtime_class(expr) == CLASS_Id)
+        return canonical(fn, expr);
+    if (match(expr, CLASS_FiPrimApp, &f, &args))
+        return FiPrimApp(f, canonicalAll(fn, args));
+    if (match(expr, CLASS_FiConsApp, &f, &args))
+        return FiConsApp(f, canonicalAll(fn, args));
+    return expr;
+}
+
+static long renameTransfer(struct function *fn, long transfer)
+{
+    long ret, f, args, label, x, clauses;
+
+    if (match(transfer, CLASS_FiCall, &ret, &f, &args))
+        return FiCall(ret, f, canonicalAll(fn, args));
+    if (match(transfer, CLASS_FiGoto, &label, &args))
+        return FiGoto(label, canonicalAll(fn, args));
+    if (match(transfer, CLASS_FiReturn, &x))
+        return FiReturn(canonical(fn, x));
+    if (match(transfer, CLASS_FiReturnValues, &args))
+        return FiReturnValues(canonicalAll(fn, args));
+    if (match(transfer, CLASS_FiMatch, &x, &clauses))
+        return FiMatch(canonical(fn, x), clauses);
+    return transfer;
+}
+
+static void renameBlock(struct function *fn, struct block *b)
+{
+    long stmt, x, expr, stmts = nil;
+
+    forEach(b->stmts, stmt) {
+        match(stmt, CLASS_FiStmt, &x, &expr);
+        stmts = prim_cons(FiStmt(x, renameExpr(fn, expr)), stmts);
+    }
+    b->stmts = reverse(stmts);
+    b->transfer = renameTransfer(fn, b->transfer);
+}
+
+/*
+ * Statements whose value is no longer used, typically constructor
+ * applications that every match has been forwarded past, are dropped.
+ */
+static void use(struct function *fn, int *uses, long x)
+{
+    int i;
+
+    if (runtime_class(x) == CLASS_Id && (i = names_find(&fn->vars, x)) >= 0)
+        uses[i]++;
+}
+
+static void useAll(struct function *fn, int *uses, long xs)
+{
+    long x;
+
+    forEach(xs, x)
+        use(fn, uses, x);
+}
+
+static void countUses(struct function *fn, int *uses, struct block *b)
+{
+    long stmt, x, expr, f, args, ret, label, clauses;
+
+    forEach(b->stmts, stmt) {
+        match(stmt, CLASS_FiStmt, &x, &expr);
+        if (match(expr, CLASS_FiPrimApp, &f, &args)
+                || match(expr, CLASS_FiConsApp, &f, &args))
+            useAll(fn, uses, args);
+        else
+            use(fn, uses, expr);
+    }
+    if (match(b->transfer, CLASS_FiCall, &ret, &f, &args)
+            || match(b->transfer, CLASS_FiGoto, &label, &args)
+            || match(b->transfer, CLASS_FiReturnValues, &args))
+        useAll(fn, uses, args);
+    else if (match(b->transfer, CLASS_FiReturn, &x)
+            || match(b->transfer, CLASS_FiMatch, &x, &clauses))
+        use(fn, uses, x);
+}
+
+/*
+ * Primitive applications stay even when their values are unused: the pure
+ * ones die on a bad index or on a value of the wrong class, and -O2 must
+ * report such errors as -O1 does.
+ */
+static int isDead(struct function *fn, int *uses, long stmt)
+{
+    long x, expr, f, args;
+
+    match(stmt, CLASS_FiStmt, &x, &expr);
+    if (uses[names_find(&fn->vars, x)] > 0)
+        return 0;
+    return !match(expr, CLASS_FiPrimApp, &f, &args);
+}
+
+static void removeDead(struct function *fn)
+{
+    struct block *b;
+    long stmt, stmts;
+    int *uses, i, changed;
+
+    uses = allocate((fn->vars.nr + 1) * sizeof(int));
+    do {
+        changed = 0;
+        memset(uses, 0, fn->vars.nr * sizeof(int));
+        for (i = 0; i < fn->nrBlocks; i++)
+            if (fn->blocks[i].idom >= 0)
+                countUses(fn, uses, &fn->blocks[i]);
+        for (i = 0; i < fn->nrBlocks; i++) {
+            b = &fn->blocks[i];
+            stmts = nil;
+            forEach(b->stmts, stmt) {
+                if (isDead(fn, uses, stmt))
+                    changed = 1;
+                else
+                    stmts = prim_cons(stmt, stmts);
+            }
+            b->stmts = reverse(stmts);
+        }
+    } while (changed);
+    free(uses);
+}
+
+static long numberFunction(long name, long params, long blocks)
+{
+    struct function fn;
+    struct block *b;
+    long block, stmt, x, expr, result = nil;
+    int i = 0;
+
+    memset(&fn, 0, sizeof(fn));
+    fn.nrBlocks = length(blocks);
+    fn.blocks = allocate((fn.nrBlocks + 1) * sizeof(struct block));
+    names_init(&fn.labels);
+    names_init(&fn.vars);
+
+    defineAll(&fn, params);
+    forEach(blocks, block) {
+        b = &fn.blocks[i++];
+        match(block, CLASS_FiBlock, &b->label, &b->args, &b->stmts,
+            &b->transfer);
+        names_add(&fn.labels, b->label);
+        defineAll(&fn, b->args);
+        forEach(b->stmts, stmt) {
+            match(stmt, CLASS_FiStmt, &x, &expr);
+            define(&fn, x);
+        }
+    }
+    for (i = 0; i < fn.nrBlocks; i++)
+        findSuccessors(&fn, i);
+    findPredecessors(&fn);
+    findDominators(&fn);
+
+    if (fn.nrBlocks > 0)
+        numberBlock(&fn, 0, prim_mapEmpty());
+
+    for (i = 0; i < fn.nrBlocks; i++)
+        renameBlock(&fn, &fn.blocks[i]);
+    removeDead(&fn);
+    for (i = 0; i < fn.nrBlocks; i++) {
+        b = &fn.blocks[i];
+        result = prim_cons(FiBlock(b->label, b->args, b->stmts, b->transfer),
+            result);
+    }
+
+    for (i = 0; i < fn.nrBlocks; i++) {
+        free(fn.blocks[i].succs);
+        free(fn.blocks[i].preds);
+    }
+    free(fn.blocks);
+    free(fn.rpo);
+    free(fn.defs);
+    free(fn.renamed);
+    free(fn.constants);
+    names_release(&fn.labels);
+    names_release(&fn.vars);
+
+    return FiDefineFunc(name, params, fi_reachableBlocks(reverse(result)));
+}
+
+long gvnFunctions(long fi)
+{
+    long def, id, args, blocks, result = nil;
+
+    forEach(fi, def) {
+        if (match(def, CLASS_FiDefineFunc, &id, &args, &blocks))
+            def = numberFunction(id, args, blocks);
+        result = prim_cons(def, result);
+    }
+    return reverse(result);
+}
@@ -0,0 +1 @@
+long gvnFunctions(long fi);
@@ -1,3 +1,7 @@
+%define api.pure full
+%parse-param {struct lexer *lexer} {long *program}
+%lex-param {struct lexer *lexer}
+
 %{
 
 #include <ctype.h>
@@ -10,18 +14,45 @@
 #include "runtime.h"
 #include "util.h"
 
-int yylex(void);
-int yyerror(const char *e);
+/*
+ * Lists are built left-recursively so that the parser stack does not grow
+ * with the length of a list. The elements are collected while the list is
+ * still private to the parser, and listValue stores them as one run.
+ */
+static struct runtime_list emptyList(void)
+{
+    struct runtime_list xs;
+
+    runtime_listInit(&xs);
+    return xs;
+}
 
-static long hiProgram;
+static struct runtime_list listAppend(struct runtime_list xs, long x)
+{
+    runtime_listAppend(&xs, x);
+    return xs;
+}
+
+static long listValue(struct runtime_list xs)
+{
+    return runtime_listFinish(&xs, nil);
+}
 
 %}
 
 %union {
     char text[64];
     long syntax;
+    struct runtime_list list;
 }
 
+%{
+
+int yylex(YYSTYPE *lval, struct lexer *lexer);
+int yyerror(struct lexer *lexer, long *program, const char *e);
+
+%}
+
 %token <syntax> ID
 %token <syntax> NUMBER
 %token <syntax> STRING
@@ -41,59 +72,60 @@ static long hiProgram;
 %type <syntax> defineVar
 %type <syntax> defineFunc
 %type <syntax> defineCons
-%type <syntax> ids
+%type <list> ids
 %type <syntax> const
-%type <syntax> exprs
+%type <list> exprs
 %type <syntax> expr
 %type <syntax> define
-%type <syntax> defines
+%type <list> defines
 %type <syntax> func
 %type <syntax> begin
 %type <syntax> block
 %type <syntax> stmt
-%type <syntax> stmts
+%type <list> stmts
 %type <syntax> call
 %type <syntax> match
-%type <syntax> clauses
+%type <list> clauses
 %type <syntax> clause
 
 %start program
 
 %%
 
-program     : defines { hiProgram = $1; }
-defines     : { $$ = nil; }
-            | define defines { $$ = prim_cons($1, $2); }
+program     : defines { *program = listValue($1); }
+defines     : { $$ = emptyList(); }
+            | defines define { $$ = listAppend($1, $2); }
 define      : defineVar | defineFunc | defineCons
 defineVar   : '(' DEFINE ID expr ')' {
                 $$ = runtime_makeTuple2(CLASS_HiDefineVar, $3, $4);
             }
 defineFunc  : '(' DEFINE '(' ID ids ')' expr defines ')' {
                 long block;
-                block = runtime_makeTuple2(CLASS_HiBlock, $7, $8);
-                $$ = runtime_makeTuple3(CLASS_HiDefineFunc, $4, $5, block);
+                block = runtime_makeTuple2(CLASS_HiBlock, $7, listValue($8));
+                $$ = runtime_makeTuple3(CLASS_HiDefineFunc, $4, listValue($5),
+                    block);
             }
 defineCons  : '(' DEFINE '(' ID ids ')' ')' {
-                $$ = runtime_makeTuple2(CLASS_HiDefineCons, $4, $5);
+                $$ = runtime_makeTuple2(CLASS_HiDefineCons, $4, listValue($5));
             }
 func        : '(' FUNC '(' ids ')' expr defines ')' {
                 long block;
-                block = runtime_makeTuple2(CLASS_HiBlock, $6, $7);
-                $$ = runtime_makeTuple2(CLASS_HiFunc, $4, block);
+                block = runtime_makeTuple2(CLASS_HiBlock, $6, listValue($7));
+                $$ = runtime_makeTuple2(CLASS_HiFunc, listValue($4), block);
             }
-ids         : { $$ = nil; }
-            | ID ids { $$ = prim_cons($1, $2); }
+ids         : { $$ = emptyList(); }
+            | ids ID { $$ = listAppend($1, $2); }
 begin       : '(' BEGIN stmts ')' {
-                $$ = runtime_makeTuple1(CLASS_HiBegin, $3);
+                $$ = runtime_makeTuple1(CLASS_HiBegin, listValue($3));
             }
 block       : '(' BLOCK expr defines ')' {
-                $$ = runtime_makeTuple2(CLASS_HiBlock, $3, $4);
+                $$ = runtime_makeTuple2(CLASS_HiBlock, $3, listValue($4));
             }
-stmts       : { $$ = nil; }
-            | stmt stmts { $$ = prim_cons($1, $2); }
+stmts       : { $$ = emptyList(); }
+            | stmts stmt { $$ = listAppend($1, $2); }
 stmt        : '(' DEFINE ID expr defines ')' {
                 long block;
-                block = runtime_makeTuple2(CLASS_HiBlock, $4, $5);
+                block = runtime_makeTuple2(CLASS_HiBlock, $4, listValue($5));
                 $$ = runtime_makeTuple2(CLASS_HiDefineVar, $3, block);
             }
             | '(' DEFINE '(' ID ids ')' expr defines ')' {
@@ -101,51 +133,55 @@ stmt        : '(' DEFINE ID expr defines ')' {
                 const char *name;
                 long block;
                 name = runtime_stringValue(prim_fetch($4, 0));
-                block = runtime_makeTuple2(CLASS_HiBlock, $7, $8);
+                block = runtime_makeTuple2(CLASS_HiBlock, $7, listValue($8));
                 if (isupper(name[0]))
                     $$ = runtime_makeTuple3(
-                        CLASS_HiDefineByMatch, $4, $5, block);
+                        CLASS_HiDefineByMatch, $4, listValue($5), block);
                 else
                     $$ = runtime_makeTuple3(
-                        CLASS_HiDefineFunc, $4, $5, block);
+                        CLASS_HiDefineFunc, $4, listValue($5), block);
             }
             | expr
 call        : '(' ID exprs ')' {
-                $$ = runtime_makeTuple2(CLASS_HiCall, $2, $3);
+                $$ = runtime_makeTuple2(CLASS_HiCall, $2, listValue($3));
             }
 match       : '(' MATCH expr clauses ')' {
-                $$ = runtime_makeTuple2(CLASS_HiMatch, $3, $4);
+                $$ = runtime_makeTuple2(CLASS_HiMatch, $3, listValue($4));
             }
-clauses     : { $$ = nil; }
-            | clause clauses { $$ = prim_cons($1, $2); }
+clauses     : { $$ = emptyList(); }
+            | clauses clause { $$ = listAppend($1, $2); }
 clause      : '(' CASE '(' ID ids ')' expr defines ')' {
                 long block;
-                block = runtime_makeTuple2(CLASS_HiBlock, $7, $8);
-                $$ = runtime_makeTuple3(CLASS_HiCase, $4, $5, block);
+                block = runtime_makeTuple2(CLASS_HiBlock, $7, listValue($8));
+                $$ = runtime_makeTuple3(CLASS_HiCase, $4, listValue($5), block);
             }
             | '(' ELSE expr defines ')' {
                 long block;
-                block = runtime_makeTuple2(CLASS_HiBlock, $3, $4);
+                block = runtime_makeTuple2(CLASS_HiBlock, $3, listValue($4));
                 $$ = runtime_makeTuple1(CLASS_HiElse, block);
             }
 const       : NUMBER | STRING
-exprs       : { $$ = nil; }
-            | expr exprs { $$ = prim_cons($1, $2); }
+exprs       : { $$ = emptyList(); }
+            | exprs expr { $$ = listAppend($1, $2); }
 expr        : const | ID | func | begin | block | call | match
 
 %%
 
 #include "lexer.c"
 
-int yyerror(const char *e)
+int yyerror(struct lexer *lexer, long *program, const char *e)
 {
-    fprintf(stderr, "Line: %d\n", lexer_lineNr);
+    fprintf(stderr, "File: %s Line: %d\n", lexer->name, lexer->lineNr);
     die(e);
     return 0;
 }
 
-long parse(void)
+long parse(FILE *in, const char *name)
 {
-    yyparse();
-    return hiProgram;
+    struct lexer lexer;
+    long program;
+
+    lexer_init(&lexer, in, name);
+    yyparse(&lexer, &program);
+    return program;
 }
@@ -1,10 +1,14 @@
+#include <stdio.h>
+
+#include "closure.h"
 #include "compiler.h"
+#include "fuse.h"
 #include "parser.h"
 #include "printer.h"
 #include "runtime.h"
 #include "util.h"
 
-int main(void)
+int main(int argc, char **argv)
 {
     long hi;
     long fi;
@@ -14,10 +18,15 @@ int main(void)
     runtime_init();
     compiler_init();
 
-    hi = parse();
+    if (argc > 1)
+        hi = parseFiles(argc - 1, argv + 1);
+    else
+        hi = parse(stdin, "<stdin>");
+    hi = fuseLists(hi);
+    hi = convertClosures(hi);
     fi = compile(hi);
 
-    print(fi);
+    print(fi, stdout);
 
     return 0;
 }
@@ -0,0 +1,506 @@
+#include <ctype.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "closure.h"
+#include "fuse.h"
+#include "names.h"
+#include "parser.h"
+#include "runtime.h"
+#include "fi.h"
+#include "util.h"
+
+/*
+ * A direct evaluator for HI programs, which checks the HI to HI passes of
+ * bootstrap1 by running a program before and after them: 'make check' runs
+ * the programs in tests/ this way.
+ *
+ * The program is read from the files given and its function main is called
+ * without arguments. The value it returns is written to standard output,
+ * after anything the program writes with fdWrite.
+ *
+ *   -f     runs fuseLists first.
+ *   -c     runs convertClosures first, after fusion, and then treats func
+ *          forms, local functions and calls through variables as errors.
+ *   -v     writes to standard error, as '#! name: value' lines, whether
+ *          fusion changed the program and how many calls went to the apply
+ *          functions of closure conversion.
+ */
+
+enum {
+    NUMBER,
+    STRING,
+    ID,
+    TUPLE,
+    CLOSURE,
+};
+
+struct env;
+
+struct value {
+    int kind;
+    long number;
+    const char *name;           /* STRING, ID and TUPLE */
+    int nrFields;               /* TUPLE */
+    struct value **fields;
+    long params;                /* CLOSURE */
+    long block;
+    struct env *env;
+};
+
+struct env {
+    long name;
+    struct value *value;
+    struct env *next;
+};
+
+static struct names globals;
+static struct value **globalValues;
+static long *globalDefs;
+
+static int firstOrder;
+static long nrApplyCalls;
+static int tmpCounter;
+static int labelCounter;
+
+static struct value *eval(long x, struct env *env);
+static struct value *evalBlock(long block, struct env *env);
+
+static void *allocate(size_t size)
+{
+    void *p;
+
+    p = calloc(1, size);
+    if (p == NULL)
+        die("Failed to allocate memory.");
+    return p;
+}
+
+static struct value *makeValue(int kind)
+{
+    struct value *v;
+
+    v = allocate(sizeof(*v));
+    v->kind = kind;
+    return v;
+}
+
+static struct value *makeName(int kind, const char *name)
+{
+    struct value *v;
+
+    v = makeValue(kind);
+    v->name = name;
+    return v;
+}
+
+static struct value *makeTuple(const char *name, int n)
+{
+    struct value *v;
+
+    v = makeName(TUPLE, name);
+    v->nrFields = n;
+    v->fields = allocate((n + 1) * sizeof(*v->fields));
+    return v;
+}
+
+static struct value *makeClosure(long params, long block, struct env *env)
+{
+    struct value *v;
+
+    if (firstOrder)
+        die("Func form after closure conversion.");
+    v = makeValue(CLOSURE);
+    v->params = params;
+    v->block = block;
+    v->env = env;
+    return v;
+}
+
+static int isTuple(struct value *v, const char *name)
+{
+    return v->kind == TUPLE && !strcmp(v->name, name);
+}
+
+/*
+ * Scopes.
+ */
+static struct env *bind(long name, struct value *value, struct env *next)
+{
+    struct env *env;
+
+    env = allocate(sizeof(*env));
+    env->name = name;
+    env->value = value;
+    env->next = next;
+    return env;
+}
+
+static struct env *lookupLocal(long name, struct env *env)
+{
+    for (; env != NULL; env = env->next)
+        if (idEq(env->name, name))
+            return env;
+    return NULL;
+}
+
+static struct value *global(long name)
+{
+    long id, args, block, value;
+    int i;
+
+    i = names_find(&globals, name);
+    if (i < 0)
+        return NULL;
+    if (globalValues[i] == NULL) {
+        if (match(globalDefs[i], CLASS_HiDefineFunc, &id, &args, &block)) {
+            globalValues[i] = makeValue(CLOSURE);
+            globalValues[i]->params = args;
+            globalValues[i]->block = block;
+        } else {
+            match(globalDefs[i], CLASS_HiDefineVar, &id, &value);
+            globalValues[i] = eval(value, NULL);
+        }
+    }
+    return globalValues[i];
+}
+
+static struct value *lookup(long name, struct env *env)
+{
+    struct env *local;
+    struct value *v;
+
+    local = lookupLocal(name, env);
+    if (local != NULL && local->value != NULL)
+        return local->value;
+    if (local == NULL && (v = global(name)) != NULL) {
+        if (firstOrder && v->kind == CLOSURE)
+            die("Function used as a value after closure conversion.");
+        return v;
+    }
+    if (local == NULL && !strcmp(idString(name), "nil"))
+        return makeTuple("Nil", 0);
+    fprintf(stderr, "Variable: %s\n", idString(name));
+    die("Unbound variable.");
+}
+
+/*
+ * Output.
+ */
+static void writeValue(FILE *out, struct value *v)
+{
+    struct value *rest;
+    int i;
+
+    switch (v->kind) {
+    case NUMBER:
+        fprintf(out, "%ld", v->number);
+        break;
+    case STRING:
+        fprintf(out, "\"%s\"", v->name);
+        break;
+    case ID:
+        fprintf(out, "%s", v->name);
+        break;
+    case CLOSURE:
+        fprintf(out, "<function>");
+        break;
+    case TUPLE:
+        for (rest = v; isTuple(rest, "Cons"); rest = rest->fields[1])
+            ;
+        if (isTuple(rest, "Nil")) {
+            fprintf(out, "[");
+            for (rest = v; isTuple(rest, "Cons"); rest = rest->fields[1]) {
+                writeValue(out, rest->fields[0]);
+                if (isTuple(rest->fields[1], "Cons"))
+                    fprintf(out, " ");
+            }
+            fprintf(out, "]");
+            break;
+        }
+        fprintf(out, "(%s", v->name);
+        for (i = 0; i < v->nrFields; i++) {
+            fprintf(out, " ");
+            writeValue(out, v->fields[i]);
+        }
+        fprintf(out, ")");
+        break;
+    }
+}
+
+/*
+ * Primitives. Only those that the tests need are provided.
+ */
+static struct value *genName(const char *prefix, int *counter)
+{
+    char *name;
+
+    name = allocate(strlen(prefix) + 32);
+    sprintf(name, "%s%d", prefix, ++*counter);
+    return makeName(ID, name);
+}
+
+static struct value *prim(long f, int n, struct value **args)
+{
+    const char *name = idString(f);
+    struct value *v;
+
+    if (!strcmp(name, "cons") && n == 2) {
+        v = makeTuple("Cons", 2);
+        v->fields[0] = args[0];
+        v->fields[1] = args[1];
+        return v;
+    }
+    if (!strcmp(name, "genTmp") && n == 0)
+        return genName("x", &tmpCounter);
+    if (!strcmp(name, "genLabel") && n == 0)
+        return genName("L", &labelCounter);
+    if (!strcmp(name, "fdWrite") && n == 2) {
+        if (args[1]->kind == STRING)
+            fputs(args[1]->name, stdout);
+        else
+            writeValue(stdout, args[1]);
+        return args[0];
+    }
+    if (!strcmp(name, "die") && n == 1) {
+        if (args[0]->kind == STRING)
+            die(args[0]->name);
+        die("Program died.");
+    }
+    fprintf(stderr, "Primitive: %s\n", name);
+    die("Unsupported primitive.");
+}
+
+/*
+ * Evaluation.
+ */
+static struct value *apply(struct value *f, int n, struct value **args)
+{
+    struct env *env;
+    long param, params;
+    int i = 0;
+
+    if (f->kind != CLOSURE)
+        die("Call of a value that is not a function.");
+    params = f->params;
+    if (length(params) != n)
+        die("Wrong number of arguments.");
+    env = f->env;
+    forEach(params, param)
+        env = bind(param, args[i++], env);
+    return evalBlock(f->block, env);
+}
+
+static struct value *call(long f, long xs, struct env *env)
+{
+    struct value **args, *v;
+    struct env *local;
+    long x;
+    int i = 0, n;
+
+    n = length(xs);
+    args = allocate((n + 1) * sizeof(*args));
+    forEach(xs, x)
+        args[i++] = eval(x, env);
+
+    if (isupper((unsigned char)idString(f)[0])) {
+        if (!strcmp(idString(f), "Nil") && n == 0)
+            return makeTuple("Nil", 0);
+        v = makeTuple(idString(f), n);
+        for (i = 0; i < n; i++)
+            v->fields[i] = args[i];
+        return v;
+    }
+
+    local = lookupLocal(f, env);
+    if (local != NULL && firstOrder)
+        die("Call through a variable after closure conversion.");
+    if (local != NULL)
+        return apply(local->value, n, args);
+    if ((v = global(f)) != NULL) {
+        if (!strncmp(idString(f), "apply_", 6))
+            nrApplyCalls++;
+        return apply(v, n, args);
+    }
+    if (runtime_isPrim(idString(f)))
+        return prim(f, n, args);
+    fprintf(stderr, "Function: %s\n", idString(f));
+    die("Unbound function.");
+}
+
+static int matches(struct value *v, long c, long args)
+{
+    const char *name = idString(c);
+    int n = length(args);
+
+    if (!strcmp(name, "Fixnum"))
+        return v->kind == NUMBER && n == 0;
+    if (!strcmp(name, "String"))
+        return v->kind == STRING && n == 0;
+    if (!strcmp(name, "Id"))
+        return v->kind == ID && n <= 1;
+    return isTuple(v, name) && v->nrFields == n;
+}
+
+static struct env *bindFields(struct value *v, long args, struct env *env)
+{
+    long arg;
+    int i = 0;
+
+    forEach(args, arg)
+        env = bind(arg, v->kind == ID ? makeName(STRING, v->name)
+            : v->fields[i++], env);
+    return env;
+}
+
+static struct value *evalMatch(long test, long clauses, struct env *env)
+{
+    struct value *v;
+    long clause, c, args, block;
+
+    v = eval(test, env);
+    forEach(clauses, clause) {
+        if (match(clause, CLASS_HiCase, &c, &args, &block)) {
+            if (matches(v, c, args))
+                return evalBlock(block, bindFields(v, args, env));
+        } else {
+            match(clause, CLASS_HiElse, &block);
+            return evalBlock(block, env);
+        }
+    }
+    die("No clause matches.");
+}
+
+static struct value *evalBegin(long forms, struct env *env)
+{
+    struct value *v = NULL;
+    long form, id, c, args, block;
+
+    forEach(forms, form) {
+        if (match(form, CLASS_HiDefineVar, &id, &block)) {
+            v = eval(block, env);
+            env = bind(id, v, env);
+        } else if (match(form, CLASS_HiDefineFunc, &id, &args, &block)) {
+            if (firstOrder)
+                die("Local function after closure conversion.");
+            env = bind(id, NULL, env);
+            env->value = makeClosure(args, block, env);
+        } else if (match(form, CLASS_HiDefineByMatch, &c, &args, &block)) {
+            v = eval(block, env);
+            if (!matches(v, c, args))
+                die("Define does not match.");
+            env = bindFields(v, args, env);
+        } else {
+            v = eval(form, env);
+        }
+    }
+    if (v == NULL)
+        die("Empty begin form.");
+    return v;
+}
+
+/*
+ * The defines of a block are mutually recursive: all of them are bound
+ * before functions are made and variables are evaluated in order.
+ */
+static struct value *evalBlock(long block, struct env *env)
+{
+    long expr, defines, define, id, args, body, value;
+
+    match(block, CLASS_HiBlock, &expr, &defines);
+    forEach(defines, define)
+        if (match(define, CLASS_HiDefineFunc, &id, &args, &body)
+                || match(define, CLASS_HiDefineVar, &id, &value))
+            env = bind(id, NULL, env);
+    forEach(defines, define)
+        if (match(define, CLASS_HiDefineFunc, &id, &args, &body))
+            lookupLocal(id, env)->value = makeClosure(args, body, env);
+    forEach(defines, define)
+        if (match(define, CLASS_HiDefineVar, &id, &value))
+            lookupLocal(id, env)->value = eval(value, env);
+    return eval(expr, env);
+}
+
+static struct value *eval(long x, struct env *env)
+{
+    struct value *v;
+    long f, args, test, clauses, forms;
+
+    switch (runtime_class(x)) {
+    case CLASS_Fixnum:
+        v = makeValue(NUMBER);
+        v->number = runtime_fixnumValue(x);
+        return v;
+    case CLASS_String:
+        return makeName(STRING, runtime_stringValue(x));
+    case CLASS_Id:
+        return lookup(x, env);
+    case CLASS_HiFunc:
+        match(x, CLASS_HiFunc, &args, &f);
+        return makeClosure(args, f, env);
+    case CLASS_HiBlock:
+        return evalBlock(x, env);
+    case CLASS_HiBegin:
+        match(x, CLASS_HiBegin, &forms);
+        return evalBegin(forms, env);
+    case CLASS_HiCall:
+        match(x, CLASS_HiCall, &f, &args);
+        return call(f, args, env);
+    case CLASS_HiMatch:
+        match(x, CLASS_HiMatch, &test, &clauses);
+        return evalMatch(test, clauses, env);
+    }
+    fprintf(stderr, "Class: %d\n", (int)runtime_class(x));
+    die("Cannot evaluate this form.");
+}
+
+int main(int argc, char **argv)
+{
+    long hi, fused, define, id, args, block, value;
+    int i, fuse = 0, convert = 0, verbose = 0;
+
+    require64BitLongs();
+    runtime_init();
+
+    for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+        if (!strcmp(argv[i], "-f"))
+            fuse = 1;
+        else if (!strcmp(argv[i], "-c"))
+            convert = 1;
+        else if (!strcmp(argv[i], "-v"))
+            verbose = 1;
+        else
+            die("Usage: hirun [-f] [-c] [-v] file...");
+    }
+    if (i == argc)
+        die("Usage: hirun [-f] [-c] [-v] file...");
+
+    hi = parseFiles(argc - i, argv + i);
+    fused = fuse ? fuseLists(hi) : hi;
+    if (verbose && fuse)
+        fprintf(stderr, "#! fuse: %s\n", fused != hi ? "changed" : "unchanged");
+    hi = fused;
+    if (convert) {
+        hi = convertClosures(hi);
+        firstOrder = 1;
+    }
+
+    names_init(&globals);
+    globalDefs = allocate((length(hi) + 1) * sizeof(*globalDefs));
+    globalValues = allocate((length(hi) + 1) * sizeof(*globalValues));
+    forEach(hi, define)
+        if (match(define, CLASS_HiDefineFunc, &id, &args, &block)
+                || match(define, CLASS_HiDefineVar, &id, &value))
+            globalDefs[names_add(&globals, id)] = define;
+
+    id = Id(runtime_makeString("main"));
+    if (global(id) == NULL)
+        die("The program does not define main.");
+    writeValue(stdout, call(id, nil, NULL));
+    printf("\n");
+    if (verbose && convert)
+        fprintf(stderr, "#! apply calls: %ld\n", nrApplyCalls);
+    return 0;
+}
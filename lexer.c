@@ -1,8 +1,6 @@
 #include "util.h"
 
-int lexer_lineNr;
-
-struct {
+static const struct {
     const char *keyword;
     int token;
 } keywords[] = {
@@ -20,30 +18,32 @@ struct {
     { "goto", GOTO },
 };
 
-void lexer_init(void)
+void lexer_init(struct lexer *lexer, FILE *in, const char *name)
 {
-    lexer_lineNr = 1;
+    lexer->in = in;
+    lexer->name = name;
+    lexer->lineNr = 1;
 }
 
-int yylex(void)
+int yylex(YYSTYPE *lval, struct lexer *lexer)
 {
     int c;
     char *buf;
     int i;
     int isNumber;
 
-    buf = yylval.text;
+    buf = lval->text;
 
     for (;;) {
         do {
-            c = fgetc(stdin);
+            c = fgetc(lexer->in);
             if (c == '\n')
-                lexer_lineNr++;
+                lexer->lineNr++;
         } while (c == ' ' || c == '\n');
         if (c != '#')
             break;
-        do c = fgetc(stdin); while (c != '\n');
-        lexer_lineNr++;
+        do c = fgetc(lexer->in); while (c != '\n');
+        lexer->lineNr++;
     }
 
     if (c == EOF)
@@ -54,16 +54,16 @@ int yylex(void)
 
     if (c == '"') {
         for (i = 0; ; buf[i++] = c) {
-            if (i == sizeof(yylval.text))
+            if (i == sizeof(lval->text))
                 die("String is too large.");
-            c = fgetc(stdin);
+            c = fgetc(lexer->in);
             if (c == '"')
                 break;
             if (c == EOF)
                 die("Incomplete input.");
         }
         buf[i] = '\0';
-        yylval.syntax = runtime_makeString(buf);
+        lval->syntax = runtime_makeString(buf);
         return STRING;
     }
 
@@ -74,19 +74,19 @@ int yylex(void)
     i = 0;
     do {
         buf[i++] = (char)c;
-        if (i == sizeof(yylval.text))
+        if (i == sizeof(lval->text))
             die("Token is too large.");
-        c = fgetc(stdin);
+        c = fgetc(lexer->in);
         if (isNumber && isalpha(c))
             die("Bad token.");
     } while(isalnum(c));
     buf[i] = '\0';
 
-    if (ungetc(c, stdin) == EOF)
+    if (ungetc(c, lexer->in) == EOF)
         die("File stream error.");
 
     if (isNumber) {
-        yylval.syntax = runtime_makeNumber(atol(buf));
+        lval->syntax = runtime_makeNumber(atol(buf));
         return NUMBER;
     }
 
@@ -94,6 +94,6 @@ int yylex(void)
         if (!strcmp(keywords[i].keyword, buf))
             return keywords[i].token;
 
-    yylval.syntax = runtime_makeTuple1(CLASS_Id, runtime_makeString(buf));
+    lval->syntax = runtime_makeTuple1(CLASS_Id, runtime_makeString(buf));
     return ID;
 }
@@ -1,3 +1,7 @@
-extern int lexer_lineNr;
+struct lexer {
+    FILE *in;
+    const char *name;
+    int lineNr;
+};
 
-void lexer_init(void);
+void lexer_init(struct lexer *lexer, FILE *in, const char *name);
@@ -0,0 +1,92 @@
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "names.h"
+#include "runtime.h"
+#include "fi.h"
+#include "util.h"
+
+static unsigned long hashString(const char *s)
+{
+    unsigned long h = 5381;
+
+    while (*s)
+        h = h * 33 + (unsigned char)*s++;
+    return h;
+}
+
+static void allocate(struct names *names, int size)
+{
+    int i;
+
+    names->size = size;
+    names->ids = malloc(size / 2 * sizeof(long));
+    names->table = malloc(size * sizeof(int));
+    if (names->ids == NULL || names->table == NULL)
+        die("Failed to allocate memory.");
+    for (i = 0; i < size; i++)
+        names->table[i] = -1;
+}
+
+void names_init(struct names *names)
+{
+    names->nr = 0;
+    allocate(names, 16);
+}
+
+void names_release(struct names *names)
+{
+    free(names->ids);
+    free(names->table);
+}
+
+static int *lookup(struct names *names, const char *s)
+{
+    unsigned long i;
+    int *p;
+
+    i = hashString(s) & (names->size - 1);
+    for (;;) {
+        p = &names->table[i];
+        if (*p < 0 || !strcmp(idString(names->ids[*p]), s))
+            return p;
+        i = (i + 1) & (names->size - 1);
+    }
+}
+
+int names_find(struct names *names, long id)
+{
+    return *lookup(names, idString(id));
+}
+
+static void grow(struct names *names)
+{
+    struct names old = *names;
+    int i;
+
+    allocate(names, 2 * old.size);
+    for (i = 0; i < old.nr; i++) {
+        names->ids[i] = old.ids[i];
+        *lookup(names, idString(old.ids[i])) = i;
+    }
+    names_release(&old);
+}
+
+int names_add(struct names *names, long id)
+{
+    int *p;
+
+    p = lookup(names, idString(id));
+    if (*p >= 0)
+        return *p;
+
+    if (2 * (names->nr + 1) > names->size) {
+        grow(names);
+        p = lookup(names, idString(id));
+    }
+    names->ids[names->nr] = id;
+    *p = names->nr++;
+
+    return *p;
+}
@@ -0,0 +1,15 @@
+/*
+ * Tables mapping identifier names to small consecutive integers, in order
+ * of insertion.
+ */
+struct names {
+    int size;
+    int nr;
+    long *ids;
+    int *table;
+};
+
+void names_init(struct names *names);
+void names_release(struct names *names);
+int names_find(struct names *names, long id);
+int names_add(struct names *names, long id);
@@ -0,0 +1,80 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "parser.h"
+#include "runtime.h"
+#include "util.h"
+
+struct job {
+    const char *path;
+    long program;
+};
+
+static void *parseJob(void *arg)
+{
+    struct job *job = arg;
+    FILE *in;
+
+    in = fopen(job->path, "r");
+    if (in == NULL) {
+        fprintf(stderr, "File: %s\n", job->path);
+        die("Failed to open input file.");
+    }
+    job->program = parse(in, job->path);
+    fclose(in);
+
+    return NULL;
+}
+
+static long lastCell(long xs)
+{
+    long d;
+
+    for (;;) {
+        d = prim_fetch(xs, runtime_1);
+        if (runtime_class(d) != CLASS_Cons)
+            return xs;
+        xs = d;
+    }
+}
+
+/*
+ * Parses each file on its own thread and concatenates the resulting lists
+ * of toplevel forms in the order the files were given.
+ */
+long parseFiles(int nrFiles, char **paths)
+{
+    struct job *jobs;
+    pthread_t *threads;
+    long program = nil, last = nil;
+    int i;
+
+    jobs = malloc(nrFiles * sizeof(*jobs));
+    threads = malloc(nrFiles * sizeof(*threads));
+    if (jobs == NULL || threads == NULL)
+        die("Failed to allocate memory.");
+
+    for (i = 0; i < nrFiles; i++) {
+        jobs[i].path = paths[i];
+        if (pthread_create(&threads[i], NULL, parseJob, &jobs[i]))
+            die("Failed to create parser thread.");
+    }
+
+    for (i = 0; i < nrFiles; i++) {
+        if (pthread_join(threads[i], NULL))
+            die("Failed to join parser thread.");
+        if (jobs[i].program == nil)
+            continue;
+        if (program == nil)
+            program = jobs[i].program;
+        else
+            runtime_setTail(last, jobs[i].program);
+        last = lastCell(jobs[i].program);
+    }
+
+    free(threads);
+    free(jobs);
+
+    return program;
+}
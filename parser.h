@@ -1 +1,2 @@
-long parse(void);
+long parse(FILE *in, const char *name);
+long parseFiles(int nrFiles, char **paths);
@@ -0,0 +1,379 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "names.h"
+#include "passes.h"
+#include "runtime.h"
+#include "fi.h"
+#include "util.h"
+
+struct pass {
+    const char *name;
+    int level;
+    long (*run)(long fi);
+};
+
+static struct pass *passes;
+static int nrPasses;
+
+void passes_register(const char *name, int level, long (*run)(long fi))
+{
+    passes = realloc(passes, (nrPasses + 1) * sizeof(*passes));
+    if (passes == NULL)
+        die("Failed to allocate memory.");
+    passes[nrPasses].name = name;
+    passes[nrPasses].level = level;
+    passes[nrPasses].run = run;
+    nrPasses++;
+}
+
+/*
+ * Timing.
+ */
+struct passes_mark passes_mark(void)
+{
+    struct passes_mark mark;
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    mark.time = t.tv_sec + t.tv_nsec / 1e9;
+    mark.storeUsed = runtime_storeUsed();
+    return mark;
+}
+
+void passes_report(const char *name, struct passes_mark since)
+{
+    struct passes_mark now;
+
+    now = passes_mark();
+    fprintf(stderr, "%-16s %9.3f ms %12lu bytes\n", name,
+        (now.time - since.time) * 1e3, now.storeUsed - since.storeUsed);
+}
+
+/*
+ * Dumping.
+ */
+static FILE *out;
+
+static void pr(const char *s)
+{
+    fputs(s, out);
+}
+
+static void prId(long id)
+{
+    pr(idString(id));
+}
+
+static void prIds(long ids)
+{
+    long id;
+
+    forEach(ids, id)
+        pr(" "), prId(id);
+}
+
+static void prConst(long x)
+{
+    if (match(x, CLASS_Fixnum))
+        fprintf(out, "%ld", runtime_fixnumValue(x));
+    else if (match(x, CLASS_String))
+        pr("\""), pr(runtime_stringValue(x)), pr("\"");
+    else
+        die("Unknown constant type.");
+}
+
+static void prApp(long f, long args)
+{
+    pr("("), prId(f), prIds(args), pr(")");
+}
+
+static void prExpr(long expr)
+{
+    long f, args, name;
+
+    if (match(expr, CLASS_FiPrimApp, &f, &args)
+            || match(expr, CLASS_FiConsApp, &f, &args))
+        prApp(f, args);
+    else if (match(expr, CLASS_Id, &name))
+        prId(expr);
+    else
+        prConst(expr);
+}
+
+static void prTransfer(long transfer)
+{
+    long ret, f, args, x, clauses, clause, cons, label;
+
+    if (match(transfer, CLASS_FiCall, &ret, &f, &args)) {
+        pr("(");
+        if (match(ret, CLASS_Nil))
+            pr("return");
+        else
+            prId(ret);
+        pr(" "), prApp(f, args), pr(")");
+    } else if (match(transfer, CLASS_FiGoto, &label, &args)) {
+        pr("(goto "), prApp(label, args), pr(")");
+    } else if (match(transfer, CLASS_FiReturn, &x)) {
+        pr("(return "), prId(x), pr(")");
+    } else if (match(transfer, CLASS_FiReturnValues, &args)) {
+        pr("(return"), prIds(args), pr(")");
+    } else if (match(transfer, CLASS_FiMatch, &x, &clauses)) {
+        pr("(match "), prId(x);
+        forEach(clauses, clause) {
+            if (match(clause, CLASS_FiCase, &cons, &label))
+                pr("\n            (case "), prId(cons), pr(" ");
+            else if (match(clause, CLASS_FiElse, &label))
+                pr("\n            (else ");
+            prId(label), pr(")");
+        }
+        pr(")");
+    }
+}
+
+static void prBlock(long block)
+{
+    long id, args, stmts, transfer, stmt, x, expr;
+
+    match(block, CLASS_FiBlock, &id, &args, &stmts, &transfer);
+    pr("\n    (define "), prApp(id, args);
+    forEach(stmts, stmt) {
+        match(stmt, CLASS_FiStmt, &x, &expr);
+        pr("\n        (set "), prId(x), pr(" "), prExpr(expr), pr(")");
+    }
+    pr("\n        "), prTransfer(transfer), pr(")");
+}
+
+void passes_dump(long fi, FILE *stream)
+{
+    long def, id, args, value, blocks, block;
+    const char *sep = "";
+
+    out = stream;
+    forEach(fi, def) {
+        pr(sep), sep = "\n";
+        if (match(def, CLASS_FiDefineVar, &id, &value)) {
+            pr("(define "), prId(id), pr(" "), prConst(value), pr(")\n");
+        } else if (match(def, CLASS_FiDefineCons, &id, &args)) {
+            pr("(define "), prApp(id, args), pr(")\n");
+        } else if (match(def, CLASS_FiDefineFunc, &id, &args, &blocks)) {
+            pr("(define "), prApp(id, args);
+            forEach(blocks, block)
+                prBlock(block);
+            pr(")\n");
+        }
+    }
+}
+
+/*
+ * Verification.
+ */
+struct verifier {
+    const char *after;
+    struct names conses;
+    int *consArities;
+    struct names funcs;
+    int *returnArities;
+    long func;
+    long block;
+    struct names labels;
+    long *formals;
+};
+
+static void fail(struct verifier *v, const char *e)
+{
+    long id, args, stmts, transfer;
+
+    if (v->after != NULL)
+        fprintf(stderr, "After: %s ", v->after);
+    fprintf(stderr, "Function: %s", idString(v->func));
+    if (v->block != nil) {
+        match(v->block, CLASS_FiBlock, &id, &args, &stmts, &transfer);
+        fprintf(stderr, " Block: %s", idString(id));
+    }
+    fprintf(stderr, "\n");
+    die(e);
+}
+
+/*
+ * Returns the arity of a constructor, or -1 if id does not name one.
+ */
+static int consArity(struct verifier *v, long id)
+{
+    int i;
+
+    i = names_find(&v->conses, id);
+    if (i >= 0)
+        return v->consArities[i];
+    i = fi_builtinClass(id);
+    if (i >= 0)
+        return runtime_classArities[i];
+    return -1;
+}
+
+static int nrValues(struct verifier *v, long f)
+{
+    int i;
+
+    if (consArity(v, f) >= 0)
+        return 1;
+    i = names_find(&v->funcs, f);
+    return i < 0 || v->returnArities[i] == 0 ? 1 : v->returnArities[i];
+}
+
+static long formals(struct verifier *v, long label)
+{
+    int i;
+
+    i = names_find(&v->labels, label);
+    if (i < 0)
+        fail(v, "Jump to a block that does not exist.");
+    return v->formals[i];
+}
+
+static void checkTarget(struct verifier *v, long label, int n, const char *e)
+{
+    if (length(formals(v, label)) != n)
+        fail(v, e);
+}
+
+static void checkConsApp(struct verifier *v, long f, long args)
+{
+    int n;
+
+    n = consArity(v, f);
+    if (n < 0)
+        fail(v, "Unknown constructor.");
+    if (n != length(args))
+        fail(v, "Wrong number of constructor arguments.");
+}
+
+static void verifyBlock(struct verifier *v)
+{
+    long id, args, stmts, transfer, stmt, x, expr, f, ret, clauses, clause;
+    long cons, label;
+    int n;
+
+    match(v->block, CLASS_FiBlock, &id, &args, &stmts, &transfer);
+    forEach(stmts, stmt) {
+        match(stmt, CLASS_FiStmt, &x, &expr);
+        if (match(expr, CLASS_FiConsApp, &f, &args))
+            checkConsApp(v, f, args);
+    }
+
+    if (match(transfer, CLASS_FiCall, &ret, &f, &args)) {
+        if (consArity(v, f) >= 0)
+            checkConsApp(v, f, args);
+        if (!match(ret, CLASS_Nil))
+            checkTarget(v, ret, nrValues(v, f),
+                "Block does not take the values the call returns.");
+    } else if (match(transfer, CLASS_FiGoto, &label, &args)) {
+        checkTarget(v, label, length(args),
+            "Wrong number of arguments in goto.");
+    } else if (match(transfer, CLASS_FiMatch, &x, &clauses)) {
+        forEach(clauses, clause) {
+            if (match(clause, CLASS_FiCase, &cons, &label)) {
+                n = consArity(v, cons);
+                if (n < 0)
+                    fail(v, "Unknown constructor.");
+                checkTarget(v, label, n,
+                    "Case block does not take the fields of its class.");
+            } else if (match(clause, CLASS_FiElse, &label)) {
+                checkTarget(v, label, 0, "Else block takes arguments.");
+            }
+        }
+    }
+}
+
+static void verifyFunction(struct verifier *v, long blocks)
+{
+    long block, id, args, stmts, transfer;
+    int i = 0;
+
+    v->block = nil;
+    v->formals = malloc((length(blocks) + 1) * sizeof(long));
+    if (v->formals == NULL)
+        die("Failed to allocate memory.");
+    names_init(&v->labels);
+    forEach(blocks, block) {
+        match(block, CLASS_FiBlock, &id, &args, &stmts, &transfer);
+        if (names_find(&v->labels, id) >= 0) {
+            v->block = block;
+            fail(v, "Block defined twice.");
+        }
+        names_add(&v->labels, id);
+        v->formals[i++] = args;
+    }
+
+    forEach(blocks, block) {
+        v->block = block;
+        verifyBlock(v);
+    }
+
+    names_release(&v->labels);
+    free(v->formals);
+}
+
+void passes_verify(long fi, const char *after)
+{
+    struct verifier v;
+    long def, id, args, blocks;
+
+    v.after = after;
+    v.returnArities = fi_returnArities(fi, &v.funcs);
+    names_init(&v.conses);
+    v.consArities = calloc(length(fi) + 1, sizeof(int));
+    if (v.consArities == NULL)
+        die("Failed to allocate memory.");
+    forEach(fi, def)
+        if (match(def, CLASS_FiDefineCons, &id, &args))
+            v.consArities[names_add(&v.conses, id)] = length(args);
+
+    forEach(fi, def) {
+        if (match(def, CLASS_FiDefineFunc, &id, &args, &blocks)) {
+            v.func = id;
+            verifyFunction(&v, blocks);
+        }
+    }
+
+    free(v.consArities);
+    names_release(&v.conses);
+    names_release(&v.funcs);
+    free(v.returnArities);
+}
+
+/*
+ * Running.
+ */
+static void after(long fi, const char *name,
+        const struct passes_options *options)
+{
+    if (options->verify)
+        passes_verify(fi, name);
+    if (options->dumpAfter != NULL && (!strcmp(options->dumpAfter, name)
+            || !strcmp(options->dumpAfter, "all"))) {
+        fprintf(stderr, "# After %s\n", name);
+        passes_dump(fi, stderr);
+    }
+}
+
+long passes_run(long fi, const struct passes_options *options)
+{
+    struct passes_mark mark;
+    int i;
+
+    after(fi, "parse", options);
+    for (i = 0; i < nrPasses; i++) {
+        if (passes[i].level > options->level)
+            continue;
+        mark = passes_mark();
+        fi = passes[i].run(fi);
+        if (options->timing)
+            passes_report(passes[i].name, mark);
+        after(fi, passes[i].name, options);
+    }
+    return fi;
+}
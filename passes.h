@@ -0,0 +1,36 @@
+/*
+ * The FI pass manager. Passes are FI to FI functions that run in the order
+ * they are registered; each runs when the optimization level is at least
+ * its own.
+ */
+struct passes_options {
+    int level;
+    int verify;
+    int timing;
+    const char *dumpAfter;
+};
+
+void passes_register(const char *name, int level, long (*run)(long fi));
+long passes_run(long fi, const struct passes_options *options);
+
+/*
+ * Writes fi in the syntax that fi-parser.y reads.
+ */
+void passes_dump(long fi, FILE *out);
+
+/*
+ * Dies with a message unless the blocks, gotos, calls, matches and
+ * constructor applications of fi agree on the number of values they pass.
+ */
+void passes_verify(long fi, const char *after);
+
+/*
+ * Time and store use since a mark, for reporting phases outside the passes.
+ */
+struct passes_mark {
+    double time;
+    unsigned long storeUsed;
+};
+
+struct passes_mark passes_mark(void);
+void passes_report(const char *name, struct passes_mark since);
@@ -3,40 +3,18 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "names.h"
 #include "printer.h"
 #include "runtime.h"
+#include "fi.h"
+#include "slots.h"
 #include "util.h"
 
-static int match(long x, unsigned short class, ...)
-{
-    va_list ap;
-    long *p;
-    int arity, i, matched;
-
-    va_start(ap, class);
-
-    matched = (runtime_class(x) == class);
-    arity = runtime_classArities[class];
-    for (i = 0; i < arity; i++) {
-        p = va_arg(ap, long *);
-        if (matched)
-            *p = prim_fetch(x, runtime_makeNumber(i));
-    }
-
-    va_end(ap);
-
-    return matched;
-}
-
-#define forEach(xs, x)                          \
-    for (long forEach_state_##__LINE__ = xs;    \
-            match(forEach_state_##__LINE__,     \
-                CLASS_Cons, &x,                 \
-                &forEach_state_##__LINE__); )
+static FILE *out;
 
 static void pr(const char *s)
 {
-    printf(s);
+    fputs(s, out);
 }
 
 static void prStr(long s)
@@ -44,14 +22,26 @@ static void prStr(long s)
     pr(runtime_stringValue(s));
 }
 
-static void prNum(long n)
+/*
+ * Writes a string constant as the body of a C string literal.
+ */
+static void prLiteral(long s)
 {
-    printf("%ld", runtime_fixnumValue(n));
+    const unsigned char *c;
+
+    for (c = (const unsigned char *)runtime_stringValue(s); *c; c++) {
+        if (*c == '"' || *c == '\\')
+            fprintf(out, "\\%c", *c);
+        else if (*c < ' ' || *c > '~')
+            fprintf(out, "\\%03o", *c);
+        else
+            fputc(*c, out);
+    }
 }
 
-static long idName(long id)
+static void prNum(long n)
 {
-    return prim_fetch(id, runtime_0);
+    fprintf(out, "%ld", runtime_fixnumValue(n));
 }
 
 static void prId(long id)
@@ -59,13 +49,54 @@ static void prId(long id)
     prStr(idName(id));
 }
 
+/*
+ * The slot assignment of the function being printed, if any.
+ */
+static struct slots *slots;
+
+static long varName(long id)
+{
+    int slot;
+
+    if (slots == NULL || (slot = slots_lookup(slots, id)) < 0)
+        return id;
+    return slots_name(slots, slot);
+}
+
+/*
+ * The parameters of the function being printed, and the functions of the
+ * program. A variable that is neither local nor a parameter but names a
+ * function stands for the function's address, as prim_spawn takes.
+ */
+static long params;
+static struct names funcs;
+
+static int isFunctionRef(long id)
+{
+    long param;
+
+    if (slots != NULL && slots_lookup(slots, id) >= 0)
+        return 0;
+    forEach(params, param)
+        if (idEq(param, id))
+            return 0;
+    return names_find(&funcs, id) >= 0;
+}
+
+static void prVar(long id)
+{
+    if (isFunctionRef(id))
+        pr("(long)");
+    prId(varName(id));
+}
+
 static void prIds(long ids)
 {
     long id;
     const char *sep = "";
 
     forEach(ids, id)
-        pr(sep), prId(id), sep = ", ";
+        pr(sep), prVar(id), sep = ", ";
 }
 
 static void prTypedIds(long ids)
@@ -88,9 +119,9 @@ static void prExpr(long expr)
     else if (match(expr, CLASS_Fixnum))
        pr("runtime_makeNumber("), prNum(expr), pr(")");
     else if (match(expr, CLASS_String))
-        pr("runtime_makeString(\""), prStr(expr), pr("\")");
+        pr("runtime_makeString(\""), prLiteral(expr), pr("\")");
     else if (match(expr, CLASS_Id, &name))
-        prId(expr);
+        prVar(expr);
     else {
         fprintf(stderr, "Expression class: %d.\n", (int)runtime_class(expr));
         die("Unknown expression class.");
@@ -113,7 +144,55 @@ static long findArgs(long key, long blocks)
     return nil;
 }
 
-static void prTransfer(long transfer, long blocks)
+/*
+ * The number of values returned by each function of the program. Functions
+ * rewritten by unboxTuples may return several values, which the generated
+ * code passes around in small structs.
+ */
+static int *returnArities;
+
+static int returnArity(long name)
+{
+    int i;
+
+    i = names_find(&funcs, name);
+    return i < 0 || returnArities[i] == 0 ? 1 : returnArities[i];
+}
+
+static void computeReturnArities(long fi)
+{
+    returnArities = fi_returnArities(fi, &funcs);
+}
+
+static void prValuesStructs(void)
+{
+    char seen[256] = { 0 };
+    int i, n;
+
+    for (i = 0; i < funcs.nr; i++) {
+        n = returnArity(funcs.ids[i]);
+        if (n < 2 || n >= sizeof(seen) || seen[n])
+            continue;
+        seen[n] = 1;
+        pr("\n");
+        fprintf(out, "struct values%d {\n", n);
+        fprintf(out, "    long v[%d];\n", n);
+        pr("};\n");
+    }
+}
+
+/*
+ * The labels that some transfer jumps to; the others are fallen into or
+ * not reached at all and get no label.
+ */
+static struct names jumpTargets;
+
+static int isNext(long label, long next)
+{
+    return next != nil && idEq(label, next);
+}
+
+static void prTransfer(long transfer, long blocks, long next)
 {
     long ret, id, arg, args, name, clauses, els, cont, formalArg;
 
@@ -128,12 +207,28 @@ static void prTransfer(long transfer, long blocks)
                 pr("prim_");
             prStr(name), pr("("), prIds(args), pr(");\n");
         } else if (match(ret, CLASS_Id, &cont)) {
-            long vars;
+            long vars, var;
+            int n, i = 0;
 
             vars = findArgs(cont, blocks);
-            pr("    "), prIds(vars), pr(" = "), prStr(name);
-            pr("("), prIds(args), pr(");\n");
-            pr("    goto "), prStr(cont), pr(";\n");
+            n = returnArity(id);
+            if (n > 1) {
+                pr("    {\n");
+                fprintf(out, "        struct values%d values_ = ", n);
+                prStr(name), pr("("), prIds(args), pr(");\n\n");
+                forEach(vars, var) {
+                    pr("        "), prVar(var);
+                    fprintf(out, " = values_.v[%d];\n", i++);
+                }
+                pr("    }\n");
+            } else {
+                pr("    "), prIds(vars), pr(" = ");
+                if (runtime_isPrim(runtime_stringValue(name)))
+                    pr("prim_");
+                prStr(name), pr("("), prIds(args), pr(");\n");
+            }
+            if (!isNext(ret, next))
+                pr("    goto "), prStr(cont), pr(";\n");
         }
     } else if (match(transfer, CLASS_FiGoto, &id, &args)) {
         /*
@@ -142,19 +237,28 @@ static void prTransfer(long transfer, long blocks)
         forEach(findArgs(idName(id), blocks), formalArg) {
             if (!match(args, CLASS_Cons, &arg, &args))
                 die("Wrong number of arguments in goto.");
-            pr("        "), prId(formalArg), pr(" = "), prId(arg), pr(";\n");
+            if (varName(formalArg) == varName(arg))
+                continue;
+            pr("        "), prVar(formalArg), pr(" = "), prVar(arg), pr(";\n");
         }
-        pr("    goto "), prId(id), pr(";\n");
+        if (!isNext(id, next))
+            pr("    goto "), prId(id), pr(";\n");
     } else if (match(transfer, CLASS_FiReturn, &id)) {
         /*
          * Return
          */
-        pr("    return "), prId(id), pr(";\n");
+        pr("    return "), prVar(id), pr(";\n");
+    } else if (match(transfer, CLASS_FiReturnValues, &args)) {
+        /*
+         * Return several values
+         */
+        fprintf(out, "    return (struct values%d){ { ", length(args));
+        prIds(args), pr(" } };\n");
     } else if (match(transfer, CLASS_FiMatch, &id, &clauses, &els)) {
         /*
          * Match
          */
-        pr("    switch (runtime_class("), prId(id), pr(")) {\n");
+        pr("    switch (runtime_class("), prVar(id), pr(")) {\n");
         {
             /*
              * Cases
@@ -167,9 +271,9 @@ static void prTransfer(long transfer, long blocks)
                     pr("    case CLASS_"), prId(cons), pr(":\n");
                     i = 0;
                     forEach(findArgs(idName(label), blocks), arg) {
-                        pr("        "), prId(arg), pr(" = prim_fetch(");
-                        prId(id);
-                        pr(", "), printf("runtime_makeNumber(%d)", i++);
+                        pr("        "), prVar(arg), pr(" = prim_fetch(");
+                        prVar(id);
+                        pr(", "), fprintf(out, "runtime_makeNumber(%d)", i++);
                         pr(");\n");
                     }
                     pr("        goto "), prId(label), pr(";\n");
@@ -189,61 +293,87 @@ static void prTransfer(long transfer, long blocks)
     }
 }
 
-static void prVariables(long blocks)
+static void prVariables(void)
 {
-    long id, block, var, allVars = nil, arg, args, stmts, stmt, transfer;
-    long expr;
     const char *sep = "";
+    int i;
 
-    forEach(blocks, block) {
-        if (match(block, CLASS_FiBlock, &id, &args, &stmts, &transfer)) {
-            forEach(args, arg)
-                allVars = prim_cons(arg, allVars);
-            forEach(stmts, stmt)
-                if (match(stmt, CLASS_FiStmt, &id, &expr))
-                    allVars = prim_cons(id, allVars);
-        }
-    }
-
-    if (allVars == nil)
+    if (slots->nrSlots == 0)
         return;
 
     pr("    long ");
-    forEach(allVars, var)
-        pr(sep), prId(var), sep = ", ";
+    for (i = 0; i < slots->nrSlots; i++)
+        pr(sep), prId(slots_name(slots, i)), sep = ", ";
     pr(";\n");
 }
 
-static void prBlocks(long blocks)
+static long blockLabel(long blocks)
 {
-    long id, args, stmts, transfer, expr, block, stmt;
-    int flag = 0;
+    long block, id, args, stmts, transfer;
 
-    forEach(blocks, block) {
-        if (match(block, CLASS_FiBlock, &id, &args, &stmts, &transfer)) {
-            if (!flag)
-                pr("    goto "), prId(id), pr(";\n"), flag = 1;
-            prId(id), pr(":\n");
-            forEach(stmts, stmt)
-                if (match(stmt, CLASS_FiStmt, &id, &expr))
-                    pr("    "), prId(id), pr(" = "), prExpr(expr), pr(";\n");
-            prTransfer(transfer, blocks);
+    if (!match(blocks, CLASS_Cons, &block, &blocks))
+        return nil;
+    match(block, CLASS_FiBlock, &id, &args, &stmts, &transfer);
+    return id;
+}
+
+static void addJumpTargets(long transfer, long next)
+{
+    long target, test, clauses, clause, cons;
+
+    target = fi_fallThrough(transfer);
+    if (target != nil) {
+        if (!isNext(target, next))
+            names_add(&jumpTargets, target);
+    } else if (match(transfer, CLASS_FiMatch, &test, &clauses)) {
+        forEach(clauses, clause) {
+            if (match(clause, CLASS_FiCase, &cons, &target)
+                    || match(clause, CLASS_FiElse, &target))
+                names_add(&jumpTargets, target);
         }
     }
 }
 
-static int length(long args)
+/*
+ * Blocks are printed in the order of fi_layoutBlocks, so transfers to the
+ * next block need no goto. Cold blocks come last, and their labels ask the
+ * C compiler to keep them out of the hot path.
+ */
+static void prBlocks(long blocks)
 {
-    long arg;
-    int len = 0;
-    forEach(args, arg)
-        len++;
-    return len;
+    long layout, rest, next, id, args, stmts, transfer, expr, block, stmt;
+    int nrHot, i;
+
+    layout = fi_layoutBlocks(blocks, &nrHot);
+
+    names_init(&jumpTargets);
+    i = 0;
+    for (rest = layout; match(rest, CLASS_Cons, &block, &rest); i++) {
+        match(block, CLASS_FiBlock, &id, &args, &stmts, &transfer);
+        next = i + 1 == nrHot ? nil : blockLabel(rest);
+        addJumpTargets(transfer, next);
+    }
+
+    i = 0;
+    for (rest = layout; match(rest, CLASS_Cons, &block, &rest); i++) {
+        match(block, CLASS_FiBlock, &id, &args, &stmts, &transfer);
+        next = i + 1 == nrHot ? nil : blockLabel(rest);
+        if (names_find(&jumpTargets, id) >= 0) {
+            prId(id);
+            pr(i < nrHot ? ":\n" : ": RUNTIME_COLD_LABEL;\n");
+        }
+        forEach(stmts, stmt)
+            if (match(stmt, CLASS_FiStmt, &id, &expr))
+                pr("    "), prVar(id), pr(" = "), prExpr(expr), pr(";\n");
+        prTransfer(transfer, blocks, next);
+    }
+
+    names_release(&jumpTargets);
 }
 
-static void prFuncSpec(long name, long args)
+static void prParams(long args)
 {
-    pr("long "), prStr(name), pr("(");
+    pr("(");
     if (length(args) > 0)
         prTypedIds(args);
     else
@@ -251,6 +381,50 @@ static void prFuncSpec(long name, long args)
     pr(")");
 }
 
+static void prFuncSpec(long id, long args)
+{
+    int n;
+
+    n = returnArity(id);
+    if (n > 1)
+        fprintf(out, "struct values%d ", n);
+    else
+        pr("long ");
+    prId(id), prParams(args);
+}
+
+/*
+ * A memoized function keeps its body under another name and is itself a
+ * wrapper that calls the body through its memo table.
+ */
+static void prMemoBodySpec(long id, long args)
+{
+    if (length(args) > RUNTIME_MEMO_MAX_ARGS || returnArity(id) > 1) {
+        fprintf(stderr, "Function: %s\n", idString(id));
+        die("Memoized functions take at most four arguments and return "
+            "one value.");
+    }
+    pr("static long "), prId(id), pr("_body"), prParams(args);
+}
+
+static void prMemoWrapper(long id, long args)
+{
+    pr("\n");
+    prFuncSpec(id, args), pr("\n");
+    pr("{\n");
+    pr("    static long table;\n");
+    pr("\n");
+    pr("    return runtime_memoCall(&table, \""), prId(id), pr("\", (long)");
+    prId(id), fprintf(out, "_body, %d, ", length(args));
+    params = args;
+    if (length(args) > 0)
+        pr("(long[]){ "), prIds(args), pr(" });\n");
+    else
+        pr("0);\n");
+    params = nil;
+    pr("}\n");
+}
+
 static int nrClasses(long defs)
 {
     long def, id, args;
@@ -265,10 +439,13 @@ static int nrClasses(long defs)
 static unsigned char arities[1 << 16];
 static int classCounter = USER_CLASS_MIN;
 
-void print(long fi)
+void print(long fi, FILE *stream)
 {
     long def, id, args, value, blocks;
 
+    out = stream;
+    classCounter = USER_CLASS_MIN;
+
     /*
      * Includes.
      */
@@ -293,6 +470,12 @@ void print(long fi)
         pr("};\n");
     }
 
+    /*
+     * Structs for returning several values.
+     */
+    computeReturnArities(fi);
+    prValuesStructs();
+
     /*
      * Declarations.
      */
@@ -310,7 +493,7 @@ void print(long fi)
             if (isVar)
                 pr("long "), prId(id), pr(";\n");
             else
-                prFuncSpec(idName(id), args), pr(";\n");
+                prFuncSpec(id, args), pr(";\n");
         }
     }
 
@@ -324,29 +507,53 @@ void print(long fi)
                  * Func
                  */
                 pr("\n");
-                prFuncSpec(idName(id), args), pr("\n");
+                if (fi_isMemoized(id))
+                    prMemoBodySpec(id, args), pr("\n");
+                else
+                    prFuncSpec(id, args), pr("\n");
                 pr("{\n");
-                prVariables(blocks);
-                prBlocks(blocks);
+                {
+                    struct slots functionSlots;
+
+                    slots_init(&functionSlots, blocks);
+                    slots = &functionSlots;
+                    params = args;
+                    prVariables();
+                    prBlocks(blocks);
+                    slots = NULL;
+                    params = nil;
+                    slots_release(&functionSlots);
+                }
                 pr("}\n");
+                if (fi_isMemoized(id))
+                    prMemoWrapper(id, args);
             } else if (match(def, CLASS_FiDefineCons, &id, &args)) {
                 /*
                  * Cons
                  */
                 pr("\n");
-                prFuncSpec(idName(id), args), pr("\n");
+                prFuncSpec(id, args), pr("\n");
                 pr("{\n");
                 {
                     int len;
 
                     len = length(args);
-                    arities[classCounter++] = length(args);
-                    printf("    return runtime_makeTuple%d(CLASS_", len);
-                    prId(id);
-                    if (len > 0)
-                        pr(", "), prIds(args), pr(");\n");
-                    else
-                        pr(");\n");
+                    if (len > 255)
+                        die("Constructor has too many fields.");
+                    arities[classCounter++] = len;
+                    if (len > 4) {
+                        pr("    return runtime_makeTuple(CLASS_"), prId(id);
+                        fprintf(out, ", %d, (long[]){ ", len);
+                        prIds(args), pr(" });\n");
+                    } else {
+                        fprintf(out, "    return runtime_makeTuple%d(CLASS_",
+                            len);
+                        prId(id);
+                        if (len > 0)
+                            pr(", "), prIds(args), pr(");\n");
+                        else
+                            pr(");\n");
+                    }
                 }
                 pr("}\n");
             }
@@ -363,7 +570,7 @@ void print(long fi)
         pr("void compiler_init(void)\n");
         pr("{\n");
         for (i = USER_CLASS_MIN; i < classCounter; i++) {
-            printf("    runtime_classArities[%d] = %d;\n",
+            fprintf(out, "    runtime_classArities[%d] = %d;\n",
                 i, (int)arities[i]);
         }
         forEach(fi, def) {
@@ -372,7 +579,7 @@ void print(long fi)
                 if (match(value, CLASS_Fixnum))
                     pr("runtime_makeNumber("), prNum(value);
                 else if (match(value, CLASS_String))
-                    pr("runtime_makeString(\""), prStr(value), pr("\"");
+                    pr("runtime_makeString(\""), prLiteral(value), pr("\"");
                 else
                     die("Unknown constant type.");
                 pr(");\n");
@@ -380,4 +587,7 @@ void print(long fi)
         }
         pr("}\n");
     }
+
+    names_release(&funcs);
+    free(returnArities);
 }
@@ -1 +1 @@
-void print(long fi);
+void print(long fi, FILE *out);
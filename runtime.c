@@ -1,17 +1,15 @@
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "runtime.h"
 #include "util.h"
 
-struct store {
-    unsigned long size;
-    unsigned long firstFree;
-    void *data;
-};
-
-static struct store store;
+struct runtime_store runtime_store;
 
 unsigned char runtime_classArities[1 << 16] = {
     [CLASS_Fixnum] = 0,
@@ -19,6 +17,9 @@ unsigned char runtime_classArities[1 << 16] = {
     [CLASS_Nil] = 0,
     [CLASS_Cons] = 2,
     [CLASS_Id] = 1,
+    [CLASS_Map] = 0,
+    [CLASS_Vector] = 0,
+    [CLASS_Task] = 0,
     [CLASS_HiDefineVar] = 2,
     [CLASS_HiDefineFunc] = 3,
     [CLASS_HiDefineCons] = 2,
@@ -40,6 +41,7 @@ unsigned char runtime_classArities[1 << 16] = {
     [CLASS_FiCall] = 3,
     [CLASS_FiGoto] = 2,
     [CLASS_FiReturn] = 1,
+    [CLASS_FiReturnValues] = 1,
     [CLASS_FiMatch] = 2,
     [CLASS_FiCase] = 2,
     [CLASS_FiElse] = 1,
@@ -62,29 +64,141 @@ static void mustBe(unsigned short class, long x)
 
 static void storeInit(unsigned long size)
 {
-    store.size = size;
-    store.firstFree = 0;
-    store.data = malloc(size);
-    if (store.data == NULL)
+    runtime_store.size = size;
+    runtime_store.firstFree = 0;
+    runtime_store.data = malloc(size);
+    if (runtime_store.data == NULL)
         die("Failed to allocate memory.");
 }
 
-static long storeAlloc(unsigned long align, unsigned long size)
+/*
+ * Shared allocation is a compare-and-swap on the bump pointer so that
+ * several threads (e.g. parsers working on separate files) may share the
+ * store.
+ */
+static unsigned long sharedAlloc(unsigned long align, unsigned long size)
 {
+    unsigned long old;
     unsigned long i;
 
-    i = align * (store.firstFree + align - 1) / align;
-    if (i + size > store.size)
-        die("Out of memory.");
+    old = __atomic_load_n(&runtime_store.firstFree, __ATOMIC_RELAXED);
+    do {
+        i = align * ((old + align - 1) / align);
+        if (i + size > runtime_store.size)
+            die("Out of memory.");
+    } while (!__atomic_compare_exchange_n(&runtime_store.firstFree, &old,
+            i + size, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    return i;
+}
+
+/*
+ * Each thread bumps through a buffer of its own, which it takes from the
+ * store in chunks, so threads seldom touch the shared bump pointer. The
+ * buffers of all threads are listed so that runtime_reset can empty them
+ * and runtime_storeUsed can leave out their unused parts; a thread leaves
+ * the list when it exits. tlabWaste counts the bytes left unused in the
+ * buffers that were given up, on a refill or at thread exit.
+ */
+#define TLAB_SIZE (64 * 1024)
+
+__thread struct runtime_tlab runtime_tlab;
+
+static struct runtime_tlab *tlabs;
+static pthread_mutex_t tlabsLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t tlabKey;
+static unsigned long tlabWaste;
+
+static void unlistTlab(void *tlab)
+{
+    struct runtime_tlab **p;
+
+    pthread_mutex_lock(&tlabsLock);
+    for (p = &tlabs; *p != NULL; p = &(*p)->link) {
+        if (*p == tlab) {
+            __atomic_add_fetch(&tlabWaste, (*p)->end - (*p)->next,
+                    __ATOMIC_RELAXED);
+            *p = (*p)->link;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&tlabsLock);
+}
+
+static void listTlab(void)
+{
+    pthread_mutex_lock(&tlabsLock);
+    runtime_tlab.link = tlabs;
+    tlabs = &runtime_tlab;
+    runtime_tlab.listed = 1;
+    pthread_mutex_unlock(&tlabsLock);
+    if (pthread_setspecific(tlabKey, &runtime_tlab))
+        die("Failed to set thread-specific data.");
+}
+
+unsigned long runtime_tlabRefill(unsigned long size)
+{
+    unsigned long i;
+
+    if (!runtime_tlab.listed)
+        listTlab();
+    if (size > TLAB_SIZE / 4
+            || runtime_store.firstFree + TLAB_SIZE > runtime_store.size)
+        return sharedAlloc(sizeof(long), size);
+
+    i = sharedAlloc(sizeof(long), TLAB_SIZE);
+    __atomic_add_fetch(&tlabWaste, runtime_tlab.end - runtime_tlab.next,
+            __ATOMIC_RELAXED);
+    runtime_tlab.next = i + size;
+    runtime_tlab.end = i + TLAB_SIZE;
+    return i;
+}
 
-    store.firstFree = i + size;
+/*
+ * Sizes are rounded up to whole words, which keeps the buffer aligned for
+ * the inline allocation in assembly.
+ */
+static unsigned long storeAlloc(unsigned long align, unsigned long size)
+{
+    unsigned long i;
 
+    if (align > sizeof(long))
+        die("Unsupported alignment.");
+    size = (size + sizeof(long) - 1) & ~(sizeof(long) - 1);
+    i = runtime_tlab.next;
+    if (i + size > runtime_tlab.end)
+        return runtime_tlabRefill(size);
+    runtime_tlab.next = i + size;
     return i;
 }
 
+/*
+ * The bytes handed out by storeAlloc and the inline allocation in
+ * assembly. Buffers of threads that are still allocating are read as they
+ * are at the moment.
+ */
+unsigned long runtime_storeUsed(void)
+{
+    struct runtime_tlab *tlab;
+    unsigned long unused;
+
+    pthread_mutex_lock(&tlabsLock);
+    unused = __atomic_load_n(&tlabWaste, __ATOMIC_RELAXED);
+    for (tlab = tlabs; tlab != NULL; tlab = tlab->link)
+        unused += tlab->end - tlab->next;
+    pthread_mutex_unlock(&tlabsLock);
+    return runtime_store.firstFree - unused;
+}
+
+/*
+ * Offsets take 32 bits above the class. The 16 bits above them are zero,
+ * except in Cons values that point into a run; see below.
+ */
+#define OFFSET_MASK 0xffffffffUL
+
 static void *storeAddr(long x)
 {
-    return store.data + ((unsigned long)x >> 16);
+    return runtime_store.data + (((unsigned long)x >> 16) & OFFSET_MASK);
 }
 
 static long makeNumber(long n)
@@ -92,23 +206,27 @@ static long makeNumber(long n)
     return (long)((unsigned long)n << 16);
 }
 
-static long makeString(const char *s)
+static long makeStringN(const char *s, unsigned long len)
 {
     unsigned long align;
     unsigned long size;
-    unsigned long len;
     unsigned long i;
 
-    len = strlen(s);
     align = sizeof(long);
     size = sizeof(long) + len + 1;
     i = storeAlloc(align, size);
-    *(long *)(store.data + i) = makeNumber((long)len);
-    memmove(store.data + i + sizeof(long), s, len + 1);
+    *(long *)(runtime_store.data + i) = makeNumber((long)len);
+    memmove(runtime_store.data + i + sizeof(long), s, len);
+    ((char *)runtime_store.data)[i + sizeof(long) + len] = '\0';
 
     return (long)(i << 16 | CLASS_String);
 }
 
+static long makeString(const char *s)
+{
+    return makeStringN(s, strlen(s));
+}
+
 long runtime_makeString(const char *s)
 {
     return makeString(s);
@@ -122,7 +240,7 @@ const char *runtime_stringValue(long s)
     return storeAddr(s) + sizeof(long);
 }
 
-static long classArgSave;
+static __thread long classArgSave;
 
 unsigned short runtime_class(long x)
 {
@@ -146,6 +264,28 @@ long runtime_fixnumValue(long n)
     return fixnumValue(n);
 }
 
+/*
+ * Lists built in order are stored in runs: the elements one after another,
+ * followed by the tail of the last cell. A Cons value that points into a
+ * run carries the number of elements after its own in the top 16 bits, so
+ * its tail is the next word unless that number is 0. An ordinary two-word
+ * cell is a run of one.
+ */
+#define RUN_SHIFT 48
+#define MAX_RUN (1UL << 16)
+
+static unsigned long runLeft(long c)
+{
+    return (unsigned long)c >> RUN_SHIFT;
+}
+
+static long consTail(long c)
+{
+    if (runLeft(c) > 0)
+        return c - (1L << RUN_SHIFT) + (long)(sizeof(long) << 16);
+    return ((long *)storeAddr(c))[1];
+}
+
 long prim_fetch(long m, long k)
 {
     long *tuple;
@@ -159,6 +299,8 @@ long prim_fetch(long m, long k)
 
     if (i >= arity)
         die("Fetching slot that does not exist.");
+    if (i == 1 && runtime_class(m) == CLASS_Cons)
+        return consTail(m);
 
     tuple = storeAddr(m);
     return tuple[i];
@@ -177,8 +319,6 @@ long prim_die(long e)
 
     s = storeAddr(e) + sizeof(long);
     die(s);
-
-    return 0;
 }
 
 long runtime_makeTuple0(unsigned short class)
@@ -206,7 +346,7 @@ long runtime_makeTuple1(unsigned short class, long a)
     align = sizeof(long);
     size = sizeof(long);
     i = storeAlloc(align, size);
-    tuple = store.data + i;
+    tuple = runtime_store.data + i;
 
     tuple[0] = a;
 
@@ -228,7 +368,7 @@ long runtime_makeTuple2(unsigned short class, long a, long b)
     align = sizeof(long);
     size = 2 * sizeof(long);
     i = storeAlloc(align, size);
-    tuple = store.data + i;
+    tuple = runtime_store.data + i;
 
     tuple[0] = a;
     tuple[1] = b;
@@ -251,7 +391,7 @@ long runtime_makeTuple3(unsigned short class, long a, long b, long c)
     align = sizeof(long);
     size = 3 * sizeof(long);
     i = storeAlloc(align, size);
-    tuple = store.data + i;
+    tuple = runtime_store.data + i;
 
     tuple[0] = a;
     tuple[1] = b;
@@ -275,7 +415,7 @@ long runtime_makeTuple4(unsigned short class, long a, long b, long c, long d)
     align = sizeof(long);
     size = 4 * sizeof(long);
     i = storeAlloc(align, size);
-    tuple = store.data + i;
+    tuple = runtime_store.data + i;
 
     tuple[0] = a;
     tuple[1] = b;
@@ -285,6 +425,26 @@ long runtime_makeTuple4(unsigned short class, long a, long b, long c, long d)
     return (long)(i << 16 | class);
 }
 
+/*
+ * Tuples of any arity up to the 255 fields that a class can record.
+ */
+long runtime_makeTuple(unsigned short class, int n, const long *fields)
+{
+    unsigned long i;
+
+    if (runtime_classArities[class] != n) {
+        fprintf(stderr, "Class: %d Arity: %d\n", (int)class, n);
+        die("Arity error while making tuple.");
+    }
+    if (n == 0)
+        return (long)class;
+
+    i = storeAlloc(sizeof(long), n * sizeof(long));
+    memcpy(runtime_store.data + i, fields, n * sizeof(long));
+
+    return (long)(i << 16 | class);
+}
+
 void runtime_matchFailure(int line)
 {
     char buf[256];
@@ -298,25 +458,1085 @@ long prim_cons(long a, long d)
     return runtime_makeTuple2(CLASS_Cons, a, d);
 }
 
+void runtime_setTail(long c, long d)
+{
+    long *cell;
+
+    mustBe(CLASS_Cons, c);
+    if (runLeft(c) > 0)
+        die("Cannot replace the tail of a list cell inside a run.");
+
+    cell = storeAddr(c);
+    cell[1] = d;
+}
+
+static long runValue(unsigned long start, unsigned long count)
+{
+    return (long)((count - 1) << RUN_SHIFT | start << 16 | CLASS_Cons);
+}
+
+void runtime_listInit(struct runtime_list *xs)
+{
+    xs->elements = NULL;
+    xs->count = 0;
+    xs->capacity = 0;
+}
+
+void runtime_listAppend(struct runtime_list *xs, long x)
+{
+    if (xs->count == xs->capacity) {
+        xs->capacity = 2 * xs->capacity + 4;
+        xs->elements = realloc(xs->elements, xs->capacity * sizeof(long));
+        if (xs->elements == NULL)
+            die("Failed to allocate memory.");
+    }
+    xs->elements[xs->count++] = x;
+}
+
+/*
+ * The runs are made from the end, so that each knows its tail. Only the
+ * first can be shorter than MAX_RUN.
+ */
+long runtime_listFinish(struct runtime_list *xs, long tail)
+{
+    unsigned long n, count, start;
+    long *run;
+
+    for (n = xs->count; n > 0; n -= count) {
+        count = n < MAX_RUN ? n : MAX_RUN;
+        start = storeAlloc(sizeof(long), (count + 1) * sizeof(long));
+        run = runtime_store.data + start;
+        memcpy(run, xs->elements + n - count, count * sizeof(long));
+        run[count] = tail;
+        tail = runValue(start, count);
+    }
+    free(xs->elements);
+    runtime_listInit(xs);
+    return tail;
+}
+
+long runtime_listReverse(long xs)
+{
+    struct runtime_list ys;
+    unsigned long i;
+    long x;
+
+    runtime_listInit(&ys);
+    for (; runtime_class(xs) == CLASS_Cons; xs = consTail(xs))
+        runtime_listAppend(&ys, ((long *)storeAddr(xs))[0]);
+    for (i = 0; i < ys.count / 2; i++) {
+        x = ys.elements[i];
+        ys.elements[i] = ys.elements[ys.count - 1 - i];
+        ys.elements[ys.count - 1 - i] = x;
+    }
+    return runtime_listFinish(&ys, nil);
+}
+
 static int tmpCounter;
 static int labelCounter;
 
 long prim_genTmp(void)
 {
     char name[16];
-    snprintf(name, sizeof(name), "x%d", tmpCounter++);
+    snprintf(name, sizeof(name), "x%d",
+        __atomic_fetch_add(&tmpCounter, 1, __ATOMIC_RELAXED));
     return Id(makeString(name));
 }
 
 long prim_genLabel(void)
 {
     char name[16];
-    snprintf(name, sizeof(name), "L%d", labelCounter++);
+    snprintf(name, sizeof(name), "L%d",
+        __atomic_fetch_add(&labelCounter, 1, __ATOMIC_RELAXED));
     return Id(makeString(name));
 }
 
+/*
+ * Maps are hash array mapped tries laid out as in CHAMP. A node has a bitmap
+ * of the hash fragments whose entry is stored inline as a key/value pair, a
+ * bitmap of those that lead to a subnode, and the number of entries below
+ * it. The pairs follow, then the subnodes. Updates copy the path from the
+ * root. Keys whose hashes agree in all bits share a collision node, which
+ * has empty bitmaps and a plain array of pairs.
+ *
+ * Map values are opaque: their class has no fields that fetch can reach.
+ */
+#define MAP_BITS 5
+#define MAP_HASH_BITS 32
+
+struct mapNode {
+    unsigned int dataMap;
+    unsigned int nodeMap;
+    long count;
+    long slots[];
+};
+
+static long emptyMap;
+
+static struct mapNode *mapNode(long m)
+{
+    mustBe(CLASS_Map, m);
+    return storeAddr(m);
+}
+
+static long newMapNode(unsigned int dataMap, unsigned int nodeMap,
+        long count, int nrSlots, struct mapNode **node)
+{
+    unsigned long i;
+
+    i = storeAlloc(sizeof(long),
+        sizeof(struct mapNode) + nrSlots * sizeof(long));
+    *node = (struct mapNode *)((char *)runtime_store.data + i);
+    (*node)->dataMap = dataMap;
+    (*node)->nodeMap = nodeMap;
+    (*node)->count = count;
+
+    return (long)(i << 16 | CLASS_Map);
+}
+
+/*
+ * Strings are hashed and compared by their stored length, since chunks read
+ * by fdRead may contain NUL bytes.
+ */
+static unsigned long stringLength(long s)
+{
+    return fixnumValue(*(long *)storeAddr(s));
+}
+
+static unsigned int hashString(long s, unsigned int h)
+{
+    const unsigned char *p;
+    unsigned long n;
+
+    p = (const unsigned char *)storeAddr(s) + sizeof(long);
+    for (n = stringLength(s); n > 0; n--)
+        h = (h ^ *p++) * 16777619u;
+    return h;
+}
+
+static int stringEq(long a, long b)
+{
+    unsigned long n;
+
+    n = stringLength(a);
+    return n == stringLength(b) && !memcmp(storeAddr(a) + sizeof(long),
+        storeAddr(b) + sizeof(long), n);
+}
+
+static unsigned int mapHash(long k)
+{
+    unsigned long x;
+
+    switch (runtime_class(k)) {
+    case CLASS_Fixnum:
+        x = (unsigned long)k;
+        x = (x ^ (x >> 33)) * 0xff51afd7ed558ccdUL;
+        x = (x ^ (x >> 33)) * 0xc4ceb9fe1a85ec53UL;
+        return (unsigned int)(x ^ (x >> 33));
+    case CLASS_String:
+        return hashString(k, 2166136261u);
+    case CLASS_Id:
+        return hashString(prim_fetch(k, runtime_0),
+            2166136261u ^ 0x9e3779b9u);
+    }
+    die("Type error.");
+    return 0;
+}
+
+static int keyEq(long a, long b)
+{
+    if (a == b)
+        return 1;
+    if (runtime_class(a) != runtime_class(b))
+        return 0;
+    switch (runtime_class(a)) {
+    case CLASS_String:
+        return stringEq(a, b);
+    case CLASS_Id:
+        return stringEq(prim_fetch(a, runtime_0), prim_fetch(b, runtime_0));
+    }
+    return 0;
+}
+
+static unsigned int fragment(unsigned int hash, int shift)
+{
+    return 1u << ((hash >> shift) & ((1 << MAP_BITS) - 1));
+}
+
+static int below(unsigned int map, unsigned int bit)
+{
+    return __builtin_popcount(map & (bit - 1));
+}
+
+/*
+ * Builds the smallest subtree holding two keys whose hashes agree below
+ * shift.
+ */
+static long mapPair(long k1, long v1, unsigned int h1,
+        long k2, long v2, unsigned int h2, int shift)
+{
+    struct mapNode *node;
+    unsigned int b1, b2;
+    long m;
+
+    if (shift >= MAP_HASH_BITS) {
+        m = newMapNode(0, 0, 2, 4, &node);
+        node->slots[0] = k1, node->slots[1] = v1;
+        node->slots[2] = k2, node->slots[3] = v2;
+        return m;
+    }
+
+    b1 = fragment(h1, shift);
+    b2 = fragment(h2, shift);
+    if (b1 == b2) {
+        long sub = mapPair(k1, v1, h1, k2, v2, h2, shift + MAP_BITS);
+        m = newMapNode(0, b1, 2, 1, &node);
+        node->slots[0] = sub;
+        return m;
+    }
+
+    m = newMapNode(b1 | b2, 0, 2, 4, &node);
+    if (b1 > b2) {
+        long k = k1, v = v1;
+        k1 = k2, v1 = v2;
+        k2 = k, v2 = v;
+    }
+    node->slots[0] = k1, node->slots[1] = v1;
+    node->slots[2] = k2, node->slots[3] = v2;
+    return m;
+}
+
+static long collisionPut(long m, long k, long v, int *added)
+{
+    struct mapNode *old, *node;
+    long n, i, copy;
+
+    old = mapNode(m);
+    n = old->count;
+    for (i = 0; i < n; i++) {
+        if (keyEq(old->slots[2 * i], k)) {
+            if (old->slots[2 * i + 1] == v)
+                return m;
+            copy = newMapNode(0, 0, n, 2 * n, &node);
+            memcpy(node->slots, old->slots, 2 * n * sizeof(long));
+            node->slots[2 * i + 1] = v;
+            return copy;
+        }
+    }
+
+    *added = 1;
+    copy = newMapNode(0, 0, n + 1, 2 * (n + 1), &node);
+    memcpy(node->slots, old->slots, 2 * n * sizeof(long));
+    node->slots[2 * n] = k;
+    node->slots[2 * n + 1] = v;
+    return copy;
+}
+
+static long mapPut(long m, long k, long v, unsigned int hash, int shift,
+        int *added)
+{
+    struct mapNode *old, *node;
+    unsigned int bit;
+    int nd, nn, i, j;
+    long copy, sub;
+
+    if (shift >= MAP_HASH_BITS)
+        return collisionPut(m, k, v, added);
+
+    old = mapNode(m);
+    nd = __builtin_popcount(old->dataMap);
+    nn = __builtin_popcount(old->nodeMap);
+    bit = fragment(hash, shift);
+
+    if (old->dataMap & bit) {
+        i = below(old->dataMap, bit);
+        if (keyEq(old->slots[2 * i], k)) {
+            if (old->slots[2 * i + 1] == v)
+                return m;
+            copy = newMapNode(old->dataMap, old->nodeMap, old->count,
+                2 * nd + nn, &node);
+            memcpy(node->slots, old->slots, (2 * nd + nn) * sizeof(long));
+            node->slots[2 * i + 1] = v;
+            return copy;
+        }
+
+        /* Push the existing pair down into a new subnode. */
+        *added = 1;
+        sub = mapPair(old->slots[2 * i], old->slots[2 * i + 1],
+            mapHash(old->slots[2 * i]), k, v, hash, shift + MAP_BITS);
+        j = below(old->nodeMap, bit);
+        copy = newMapNode(old->dataMap & ~bit, old->nodeMap | bit,
+            old->count + 1, 2 * (nd - 1) + nn + 1, &node);
+        memcpy(node->slots, old->slots, 2 * i * sizeof(long));
+        memcpy(node->slots + 2 * i, old->slots + 2 * (i + 1),
+            (2 * (nd - i - 1) + j) * sizeof(long));
+        node->slots[2 * (nd - 1) + j] = sub;
+        memcpy(node->slots + 2 * (nd - 1) + j + 1, old->slots + 2 * nd + j,
+            (nn - j) * sizeof(long));
+        return copy;
+    }
+
+    if (old->nodeMap & bit) {
+        j = below(old->nodeMap, bit);
+        sub = mapPut(old->slots[2 * nd + j], k, v, hash, shift + MAP_BITS,
+            added);
+        if (sub == old->slots[2 * nd + j])
+            return m;
+        copy = newMapNode(old->dataMap, old->nodeMap, old->count + *added,
+            2 * nd + nn, &node);
+        memcpy(node->slots, old->slots, (2 * nd + nn) * sizeof(long));
+        node->slots[2 * nd + j] = sub;
+        return copy;
+    }
+
+    *added = 1;
+    i = below(old->dataMap, bit);
+    copy = newMapNode(old->dataMap | bit, old->nodeMap, old->count + 1,
+        2 * (nd + 1) + nn, &node);
+    memcpy(node->slots, old->slots, 2 * i * sizeof(long));
+    node->slots[2 * i] = k;
+    node->slots[2 * i + 1] = v;
+    memcpy(node->slots + 2 * (i + 1), old->slots + 2 * i,
+        (2 * (nd - i) + nn) * sizeof(long));
+    return copy;
+}
+
+static long collisionRemove(long m, long k)
+{
+    struct mapNode *old, *node;
+    long n, i, copy;
+
+    old = mapNode(m);
+    n = old->count;
+    for (i = 0; i < n; i++) {
+        if (keyEq(old->slots[2 * i], k)) {
+            copy = newMapNode(0, 0, n - 1, 2 * (n - 1), &node);
+            memcpy(node->slots, old->slots, 2 * i * sizeof(long));
+            memcpy(node->slots + 2 * i, old->slots + 2 * (i + 1),
+                2 * (n - i - 1) * sizeof(long));
+            return copy;
+        }
+    }
+    return m;
+}
+
+static long mapRemove(long m, long k, unsigned int hash, int shift)
+{
+    struct mapNode *old, *node, *child;
+    unsigned int bit;
+    int nd, nn, i, j;
+    long copy, sub;
+
+    if (shift >= MAP_HASH_BITS)
+        return collisionRemove(m, k);
+
+    old = mapNode(m);
+    nd = __builtin_popcount(old->dataMap);
+    nn = __builtin_popcount(old->nodeMap);
+    bit = fragment(hash, shift);
+
+    if (old->dataMap & bit) {
+        i = below(old->dataMap, bit);
+        if (!keyEq(old->slots[2 * i], k))
+            return m;
+        copy = newMapNode(old->dataMap & ~bit, old->nodeMap, old->count - 1,
+            2 * (nd - 1) + nn, &node);
+        memcpy(node->slots, old->slots, 2 * i * sizeof(long));
+        memcpy(node->slots + 2 * i, old->slots + 2 * (i + 1),
+            (2 * (nd - i - 1) + nn) * sizeof(long));
+        return copy;
+    }
+
+    if (!(old->nodeMap & bit))
+        return m;
+
+    j = below(old->nodeMap, bit);
+    sub = mapRemove(old->slots[2 * nd + j], k, hash, shift + MAP_BITS);
+    if (sub == old->slots[2 * nd + j])
+        return m;
+
+    child = mapNode(sub);
+    if (child->count != 1) {
+        copy = newMapNode(old->dataMap, old->nodeMap, old->count - 1,
+            2 * nd + nn, &node);
+        memcpy(node->slots, old->slots, (2 * nd + nn) * sizeof(long));
+        node->slots[2 * nd + j] = sub;
+        return copy;
+    }
+
+    /* A subtree left with one entry is inlined to keep the trie canonical. */
+    i = below(old->dataMap, bit);
+    copy = newMapNode(old->dataMap | bit, old->nodeMap & ~bit,
+        old->count - 1, 2 * (nd + 1) + nn - 1, &node);
+    memcpy(node->slots, old->slots, 2 * i * sizeof(long));
+    node->slots[2 * i] = child->slots[0];
+    node->slots[2 * i + 1] = child->slots[1];
+    memcpy(node->slots + 2 * (i + 1), old->slots + 2 * i,
+        (2 * (nd - i) + j) * sizeof(long));
+    memcpy(node->slots + 2 * (nd + 1) + j, old->slots + 2 * nd + j + 1,
+        (nn - j - 1) * sizeof(long));
+    return copy;
+}
+
+long prim_mapEmpty(void)
+{
+    return emptyMap;
+}
+
+long prim_mapGet(long m, long k, long otherwise)
+{
+    struct mapNode *node;
+    unsigned int hash, bit;
+    int shift, i;
+
+    hash = mapHash(k);
+    for (shift = 0; shift < MAP_HASH_BITS; shift += MAP_BITS) {
+        node = mapNode(m);
+        bit = fragment(hash, shift);
+        if (node->dataMap & bit) {
+            i = below(node->dataMap, bit);
+            if (keyEq(node->slots[2 * i], k))
+                return node->slots[2 * i + 1];
+            return otherwise;
+        }
+        if (!(node->nodeMap & bit))
+            return otherwise;
+        m = node->slots[2 * __builtin_popcount(node->dataMap)
+            + below(node->nodeMap, bit)];
+    }
+
+    node = mapNode(m);
+    for (i = 0; i < node->count; i++)
+        if (keyEq(node->slots[2 * i], k))
+            return node->slots[2 * i + 1];
+    return otherwise;
+}
+
+long prim_mapPut(long m, long k, long v)
+{
+    int added = 0;
+
+    return mapPut(m, k, v, mapHash(k), 0, &added);
+}
+
+long prim_mapRemove(long m, long k)
+{
+    return mapRemove(m, k, mapHash(k), 0);
+}
+
+long prim_mapSize(long m)
+{
+    return makeNumber(mapNode(m)->count);
+}
+
+/*
+ * Vectors start with their length, which fetch cannot reach, followed by
+ * the elements.
+ */
+static long makeVector(long n, long **elements)
+{
+    unsigned long i;
+    long *vector;
+
+    if (n < 0)
+        die("Negative vector length.");
+    i = storeAlloc(sizeof(long), (n + 1) * sizeof(long));
+    vector = runtime_store.data + i;
+    vector[0] = n;
+    *elements = vector + 1;
+
+    return (long)(i << 16 | CLASS_Vector);
+}
+
+long prim_vectorMake(long n, long x)
+{
+    long *elements;
+    long v, i;
+
+    mustBe(CLASS_Fixnum, n);
+    v = makeVector(fixnumValue(n), &elements);
+    for (i = 0; i < fixnumValue(n); i++)
+        elements[i] = x;
+
+    return v;
+}
+
+long prim_vectorFromList(long xs)
+{
+    long *elements;
+    long v, ys, n = 0;
+
+    for (ys = xs; runtime_class(ys) == CLASS_Cons; n++)
+        ys = consTail(ys);
+    mustBe(CLASS_Nil, ys);
+
+    v = makeVector(n, &elements);
+    for (ys = xs; runtime_class(ys) == CLASS_Cons; ys = consTail(ys))
+        *elements++ = ((long *)storeAddr(ys))[0];
+
+    return v;
+}
+
+long prim_vectorLength(long v)
+{
+    mustBe(CLASS_Vector, v);
+    return makeNumber(*(long *)storeAddr(v));
+}
+
+long prim_vectorRef(long v, long i)
+{
+    long *vector;
+    long k;
+
+    mustBe(CLASS_Vector, v);
+    mustBe(CLASS_Fixnum, i);
+    vector = storeAddr(v);
+    k = fixnumValue(i);
+    if (k < 0 || k >= vector[0])
+        die("Vector index out of range.");
+
+    return vector[k + 1];
+}
+
+/*
+ * Tasks run on a pool of worker threads, started by the first spawn, with
+ * one per processor beyond the first. Each worker has a deque of tasks: it
+ * pushes and pops its own at the bottom and steals from the top of the
+ * others'. Threads outside the pool share deque 0. A thread that joins a
+ * task which is not done yet runs other tasks meanwhile, so nested spawns
+ * cannot deadlock the pool.
+ *
+ * A task lives in the store. Its class has no fields that fetch can reach.
+ */
+struct task {
+    long (*f)(long);
+    long x;
+    long result;
+    int done;
+};
+
+struct deque {
+    pthread_mutex_t lock;
+    struct task **tasks;
+    int top;
+    int bottom;
+    int size;
+};
+
+static struct deque *deques;
+static int nrDeques;
+static __thread int dequeIndex;
+static pthread_once_t poolOnce = PTHREAD_ONCE_INIT;
+static pthread_mutex_t poolLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t poolWork = PTHREAD_COND_INITIALIZER;
+static int nrQueued;
+
+static void pushTask(struct deque *deque, struct task *task)
+{
+    pthread_mutex_lock(&deque->lock);
+    if (deque->bottom == deque->size) {
+        memmove(deque->tasks, deque->tasks + deque->top,
+            (deque->bottom - deque->top) * sizeof(*deque->tasks));
+        deque->bottom -= deque->top;
+        deque->top = 0;
+        if (2 * deque->bottom >= deque->size) {
+            deque->size = deque->size == 0 ? 64 : 2 * deque->size;
+            deque->tasks = realloc(deque->tasks,
+                deque->size * sizeof(*deque->tasks));
+            if (deque->tasks == NULL)
+                die("Failed to allocate memory.");
+        }
+    }
+    deque->tasks[deque->bottom++] = task;
+    pthread_mutex_unlock(&deque->lock);
+}
+
+static struct task *takeTask(struct deque *deque, int steal)
+{
+    struct task *task = NULL;
+
+    pthread_mutex_lock(&deque->lock);
+    if (deque->top < deque->bottom) {
+        if (steal)
+            task = deque->tasks[deque->top++];
+        else
+            task = deque->tasks[--deque->bottom];
+    }
+    pthread_mutex_unlock(&deque->lock);
+    if (task != NULL)
+        __atomic_fetch_sub(&nrQueued, 1, __ATOMIC_RELAXED);
+    return task;
+}
+
+static struct task *findTask(void)
+{
+    struct task *task;
+    int i;
+
+    task = takeTask(&deques[dequeIndex], 0);
+    for (i = 1; task == NULL && i < nrDeques; i++)
+        task = takeTask(&deques[(dequeIndex + i) % nrDeques], 1);
+    return task;
+}
+
+static void runTask(struct task *task)
+{
+    task->result = task->f(task->x);
+    __atomic_store_n(&task->done, 1, __ATOMIC_RELEASE);
+}
+
+static void *worker(void *arg)
+{
+    struct task *task;
+
+    dequeIndex = (int)(long)arg;
+    for (;;) {
+        task = findTask();
+        if (task != NULL) {
+            runTask(task);
+            continue;
+        }
+        pthread_mutex_lock(&poolLock);
+        while (__atomic_load_n(&nrQueued, __ATOMIC_RELAXED) == 0)
+            pthread_cond_wait(&poolWork, &poolLock);
+        pthread_mutex_unlock(&poolLock);
+    }
+    return NULL;
+}
+
+static void startPool(void)
+{
+    pthread_t thread;
+    long i, nrWorkers;
+
+    nrWorkers = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+    if (nrWorkers < 0)
+        nrWorkers = 0;
+    nrDeques = nrWorkers + 1;
+    deques = calloc(nrDeques, sizeof(*deques));
+    if (deques == NULL)
+        die("Failed to allocate memory.");
+    for (i = 0; i < nrDeques; i++)
+        pthread_mutex_init(&deques[i].lock, NULL);
+    for (i = 1; i <= nrWorkers; i++) {
+        if (pthread_create(&thread, NULL, worker, (void *)i))
+            die("Failed to create worker thread.");
+        pthread_detach(thread);
+    }
+}
+
+static struct task *taskAddr(long t)
+{
+    mustBe(CLASS_Task, t);
+    return storeAddr(t);
+}
+
+/*
+ * Calls f with x on some thread of the pool. f is the address of a
+ * function that takes and returns one value.
+ */
+long prim_spawn(long f, long x)
+{
+    struct task *task;
+    unsigned long i;
+
+    pthread_once(&poolOnce, startPool);
+
+    i = storeAlloc(sizeof(long), sizeof(struct task));
+    task = runtime_store.data + i;
+    task->f = (long (*)(long))f;
+    task->x = x;
+    task->done = 0;
+
+    pushTask(&deques[dequeIndex], task);
+    __atomic_fetch_add(&nrQueued, 1, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&poolLock);
+    pthread_cond_signal(&poolWork);
+    pthread_mutex_unlock(&poolLock);
+
+    return (long)(i << 16 | CLASS_Task);
+}
+
+long prim_join(long t)
+{
+    struct task *task, *other;
+
+    task = taskAddr(t);
+    while (!__atomic_load_n(&task->done, __ATOMIC_ACQUIRE)) {
+        other = findTask();
+        if (other != NULL)
+            runTask(other);
+        else
+            sched_yield();
+    }
+    return task->result;
+}
+
+/*
+ * Applies f to each element of xs in parallel and returns the results in
+ * order.
+ */
+long prim_parMap(long xs, long f)
+{
+    struct runtime_list tasks, ys;
+    long t;
+
+    runtime_listInit(&tasks);
+    for (; runtime_class(xs) == CLASS_Cons; xs = consTail(xs))
+        runtime_listAppend(&tasks,
+            prim_spawn(f, ((long *)storeAddr(xs))[0]));
+
+    runtime_listInit(&ys);
+    for (t = runtime_listFinish(&tasks, nil); t != nil; t = consTail(t))
+        runtime_listAppend(&ys, prim_join(((long *)storeAddr(t))[0]));
+    return runtime_listFinish(&ys, nil);
+}
+
+/*
+ * Streaming I/O on file descriptors. Reads return the next chunk of at most
+ * IO_CHUNK bytes that one read call gives, so a program can lex input
+ * larger than the store a chunk at a time. Writes append to a buffer per
+ * descriptor that is flushed when full, by fdFlush and at exit. The buffers
+ * are shared by all threads under one lock.
+ */
+#define IO_CHUNK (64 * 1024)
+#define IO_MAX_FD 64
+
+struct output {
+    char data[IO_CHUNK];
+    unsigned long used;
+};
+
+static struct output *outputs[IO_MAX_FD];
+static pthread_mutex_t ioLock = PTHREAD_MUTEX_INITIALIZER;
+
+static int fdValue(long fd)
+{
+    long i;
+
+    mustBe(CLASS_Fixnum, fd);
+    i = fixnumValue(fd);
+    if (i < 0 || i >= IO_MAX_FD)
+        die("Bad file descriptor.");
+    return (int)i;
+}
+
+/*
+ * These run under ioLock and return -1 on a write error rather than dying,
+ * so that the caller can unlock first: die() runs flushAll on its way out.
+ */
+static int writeAll(int fd, const char *s, unsigned long n)
+{
+    ssize_t written;
+
+    while (n > 0) {
+        written = write(fd, s, n);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written < 0)
+            return -1;
+        s += written;
+        n -= written;
+    }
+    return 0;
+}
+
+/*
+ * The buffer is emptied even when the write fails, so that nothing retries
+ * it at exit.
+ */
+static int flushOutput(int fd)
+{
+    struct output *o = outputs[fd];
+    unsigned long n;
+
+    if (o == NULL || o->used == 0)
+        return 0;
+    n = o->used;
+    o->used = 0;
+    return writeAll(fd, o->data, n);
+}
+
+static int append(int fd, const char *s, unsigned long n)
+{
+    struct output *o;
+
+    if (outputs[fd] == NULL) {
+        outputs[fd] = calloc(1, sizeof(struct output));
+        if (outputs[fd] == NULL)
+            return -1;
+    }
+    o = outputs[fd];
+    if (o->used + n > sizeof(o->data) && flushOutput(fd) < 0)
+        return -1;
+    if (n > sizeof(o->data))
+        return writeAll(fd, s, n);
+    memcpy(o->data + o->used, s, n);
+    o->used += n;
+    return 0;
+}
+
+/*
+ * Runs at exit, which may be a die() from a thread that holds ioLock, so it
+ * gives up rather than wait for the lock, and ignores write errors.
+ */
+static void flushAll(void)
+{
+    int fd;
+
+    if (pthread_mutex_trylock(&ioLock) != 0)
+        return;
+    for (fd = 0; fd < IO_MAX_FD; fd++)
+        flushOutput(fd);
+    pthread_mutex_unlock(&ioLock);
+}
+
+long prim_fdRead(long fd)
+{
+    static __thread char *buf;
+    ssize_t n;
+
+    if (buf == NULL && (buf = malloc(IO_CHUNK)) == NULL)
+        die("Failed to allocate memory.");
+    do
+        n = read(fdValue(fd), buf, IO_CHUNK);
+    while (n < 0 && errno == EINTR);
+    if (n < 0)
+        die("Failed to read input.");
+    if (n == 0)
+        return nil;
+
+    return makeStringN(buf, n);
+}
+
+/*
+ * Strings are written as they are, ids by name and fixnums in decimal.
+ * Returns fd, so that a program can thread it through its writes.
+ */
+long prim_fdWrite(long fd, long x)
+{
+    char number[32];
+    const char *s;
+    unsigned long n;
+    int i, failed;
+
+    i = fdValue(fd);
+    if (runtime_class(x) == CLASS_Id)
+        x = ((long *)storeAddr(x))[0];
+    if (runtime_class(x) == CLASS_String) {
+        s = storeAddr(x) + sizeof(long);
+        n = fixnumValue(*(long *)storeAddr(x));
+    } else if (runtime_class(x) == CLASS_Fixnum) {
+        n = sprintf(number, "%ld", fixnumValue(x));
+        s = number;
+    } else {
+        fprintf(stderr, "Class: %d\n", (int)runtime_class(x));
+        die("Cannot write a value of this class.");
+    }
+
+    pthread_mutex_lock(&ioLock);
+    failed = append(i, s, n) < 0;
+    pthread_mutex_unlock(&ioLock);
+    if (failed)
+        die("Failed to write output.");
+    return fd;
+}
+
+long prim_fdFlush(long fd)
+{
+    int i, failed;
+
+    i = fdValue(fd);
+    pthread_mutex_lock(&ioLock);
+    failed = flushOutput(i) < 0;
+    pthread_mutex_unlock(&ioLock);
+    if (failed)
+        die("Failed to write output.");
+    return fd;
+}
+
+/*
+ * Characters of strings, for lexers over the chunks that fdRead returns.
+ */
+long prim_stringLength(long s)
+{
+    mustBe(CLASS_String, s);
+    return *(long *)storeAddr(s);
+}
+
+long prim_stringRef(long s, long i)
+{
+    long k;
+
+    mustBe(CLASS_String, s);
+    mustBe(CLASS_Fixnum, i);
+    k = fixnumValue(i);
+    if (k < 0 || k >= fixnumValue(*(long *)storeAddr(s)))
+        die("String index out of range.");
+
+    return makeNumber(((unsigned char *)storeAddr(s))[sizeof(long) + k]);
+}
+
+/*
+ * Memoization. Each memoized function has a direct-mapped table of
+ * MEMO_SIZE entries keyed on the identity of its arguments, made on its
+ * first call. A new result replaces whatever entry its arguments hash to.
+ * Values never change, so an entry stays valid until the store is reset,
+ * which empties every table. A spinlock guards each table; the function
+ * itself runs without it.
+ */
+#define MEMO_SIZE 1024
+
+struct memoEntry {
+    long args[RUNTIME_MEMO_MAX_ARGS];
+    long result;
+    int used;
+};
+
+struct memo {
+    const char *name;
+    struct memoEntry *entries;
+    unsigned long hits;
+    unsigned long misses;
+    int lock;
+    struct memo *next;
+};
+
+static struct memo *memos;
+static pthread_mutex_t memosLock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct memo *findMemo(long *table, const char *name)
+{
+    struct memo *m;
+
+    m = (struct memo *)__atomic_load_n(table, __ATOMIC_ACQUIRE);
+    if (m != NULL)
+        return m;
+
+    pthread_mutex_lock(&memosLock);
+    m = (struct memo *)*table;
+    if (m == NULL) {
+        m = calloc(1, sizeof(*m));
+        if (m == NULL || (m->entries = calloc(MEMO_SIZE,
+                sizeof(struct memoEntry))) == NULL)
+            die("Failed to allocate memory.");
+        m->name = name;
+        m->next = memos;
+        memos = m;
+        __atomic_store_n(table, (long)m, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&memosLock);
+    return m;
+}
+
+static void lockMemo(struct memo *m)
+{
+    while (__atomic_test_and_set(&m->lock, __ATOMIC_ACQUIRE))
+        while (__atomic_load_n(&m->lock, __ATOMIC_RELAXED))
+            ;
+}
+
+static void unlockMemo(struct memo *m)
+{
+    __atomic_clear(&m->lock, __ATOMIC_RELEASE);
+}
+
+static struct memoEntry *memoEntry(struct memo *m, int n, const long *args)
+{
+    unsigned long h = 0;
+    int i;
+
+    for (i = 0; i < n; i++)
+        h = (h ^ (unsigned long)args[i]) * 0x9e3779b97f4a7c15UL;
+    return &m->entries[(h >> 32) % MEMO_SIZE];
+}
+
+static long call(long f, int n, const long *args)
+{
+    switch (n) {
+    case 0:
+        return ((long (*)(void))f)();
+    case 1:
+        return ((long (*)(long))f)(args[0]);
+    case 2:
+        return ((long (*)(long, long))f)(args[0], args[1]);
+    case 3:
+        return ((long (*)(long, long, long))f)(args[0], args[1], args[2]);
+    case 4:
+        return ((long (*)(long, long, long, long))f)(args[0], args[1],
+            args[2], args[3]);
+    }
+    die("Too many arguments to memoize.");
+}
+
+long runtime_memoCall(long *table, const char *name, long f, int n,
+        const long *args)
+{
+    struct memo *m;
+    struct memoEntry *e;
+    long result;
+    int i;
+
+    if (n > RUNTIME_MEMO_MAX_ARGS)
+        die("Too many arguments to memoize.");
+    m = findMemo(table, name);
+    e = memoEntry(m, n, args);
+
+    lockMemo(m);
+    for (i = 0; e->used && i < n && e->args[i] == args[i]; i++)
+        ;
+    if (e->used && i == n) {
+        result = e->result;
+        m->hits++;
+        unlockMemo(m);
+        return result;
+    }
+    m->misses++;
+    unlockMemo(m);
+
+    result = call(f, n, args);
+
+    lockMemo(m);
+    memcpy(e->args, args, n * sizeof(long));
+    e->result = result;
+    e->used = 1;
+    unlockMemo(m);
+    return result;
+}
+
+void runtime_memoReport(void)
+{
+    struct memo *m;
+
+    pthread_mutex_lock(&memosLock);
+    for (m = memos; m != NULL; m = m->next)
+        fprintf(stderr, "%-24s %10lu hits %10lu misses\n", m->name, m->hits,
+            m->misses);
+    pthread_mutex_unlock(&memosLock);
+}
+
+static void reportMemos(void)
+{
+    if (getenv("CHISA_MEMO_STATS") != NULL)
+        runtime_memoReport();
+}
+
+static void clearMemos(void)
+{
+    struct memo *m;
+
+    pthread_mutex_lock(&memosLock);
+    for (m = memos; m != NULL; m = m->next)
+        memset(m->entries, 0, MEMO_SIZE * sizeof(struct memoEntry));
+    pthread_mutex_unlock(&memosLock);
+}
+
 static const char *prims[] = {
     "fetch", "cons", "die", "genTmp", "genLabel",
+    "mapEmpty", "mapGet", "mapPut", "mapRemove", "mapSize",
+    "vectorMake", "vectorFromList", "vectorLength", "vectorRef",
+    "spawn", "join", "parMap",
+    "fdRead", "fdWrite", "fdFlush", "stringLength", "stringRef",
 };
 
 int runtime_isPrim(const char *name)
@@ -331,9 +1551,38 @@ int runtime_isPrim(const char *name)
 void runtime_init(void)
 {
     storeInit(128 * 1024 * 1024);
+    if (pthread_key_create(&tlabKey, unlistTlab))
+        die("Failed to create thread-specific data key.");
+    if (atexit(flushAll) || atexit(reportMemos))
+        die("Failed to register exit handler.");
+    runtime_reset();
+}
+
+/*
+ * Empties the store, the memo tables and the name counters, so that a
+ * process can compile one unit after another as if each had a fresh runtime.
+ * Values made before the reset must not be used after it, and no other
+ * thread may be allocating or running tasks during it.
+ */
+void runtime_reset(void)
+{
+    struct mapNode *node;
+    struct runtime_tlab *tlab;
+
+    pthread_mutex_lock(&tlabsLock);
+    for (tlab = tlabs; tlab != NULL; tlab = tlab->link)
+        tlab->next = tlab->end = 0;
+    pthread_mutex_unlock(&tlabsLock);
+    runtime_tlab.next = runtime_tlab.end = 0;
+    runtime_store.firstFree = 0;
+    tlabWaste = 0;
+    tmpCounter = 0;
+    labelCounter = 0;
+    clearMemos();
     runtime_0 = runtime_makeNumber(0);
     runtime_1 = runtime_makeNumber(1);
     runtime_2 = runtime_makeNumber(2);
     runtime_3 = runtime_makeNumber(3);
     nil = runtime_makeTuple0(CLASS_Nil);
+    emptyMap = newMapNode(0, 0, 0, 0, &node);
 }
@@ -1,4 +1,34 @@
+/*
+ * The store that holds all values. Generated assembly allocates from it and
+ * reads fields from it directly, so its layout is part of the interface.
+ */
+struct runtime_store {
+    unsigned long size;
+    unsigned long firstFree;
+    void *data;
+};
+
+extern struct runtime_store runtime_store;
+
+/*
+ * The allocation buffer of the calling thread: offsets into the store,
+ * with next a multiple of eight. runtime_tlabRefill allocates size bytes
+ * when they do not fit, refilling the buffer.
+ */
+struct runtime_tlab {
+    unsigned long next;
+    unsigned long end;
+    struct runtime_tlab *link;
+    int listed;
+};
+
+extern __thread struct runtime_tlab runtime_tlab;
+
+unsigned long runtime_tlabRefill(unsigned long size);
+unsigned long runtime_storeUsed(void);
+
 void runtime_init(void);
+void runtime_reset(void);
 
 unsigned short runtime_class(long x);
 
@@ -13,21 +43,109 @@ long runtime_makeTuple1(unsigned short class, long a);
 long runtime_makeTuple2(unsigned short class, long a, long b);
 long runtime_makeTuple3(unsigned short class, long a, long b, long c);
 long runtime_makeTuple4(unsigned short class, long a, long b, long c, long d);
+long runtime_makeTuple(unsigned short class, int n, const long *fields);
+
+/*
+ * Generated code never returns from these, and only reaches them on error
+ * paths. RUNTIME_COLD_LABEL marks the labels of such paths in generated C.
+ */
+#ifdef __GNUC__
+#define RUNTIME_NORETURN_COLD __attribute__((noreturn, cold))
+#else
+#define RUNTIME_NORETURN_COLD
+#endif
+#if defined(__GNUC__) && !defined(__clang__)
+#define RUNTIME_COLD_LABEL __attribute__((cold))
+#else
+#define RUNTIME_COLD_LABEL
+#endif
 
-void runtime_matchFailure(int line);
+RUNTIME_NORETURN_COLD void runtime_matchFailure(int line);
 
 extern long runtime_0;
 extern long runtime_1;
 extern long runtime_2;
 extern long runtime_3;
 
-long prim_die(long e);
+RUNTIME_NORETURN_COLD long prim_die(long e);
 long prim_fetch(long m, long k);
 extern long nil;
 long prim_cons(long a, long d);
+
+/*
+ * Destructively replaces the tail of a Cons cell, which must be the last
+ * of its run. Only meant for joining fresh lists before any other code can
+ * observe them.
+ */
+void runtime_setTail(long c, long d);
+
+/*
+ * Builds a list in order. The elements are collected outside the store and
+ * runtime_listFinish stores them in runs, one word per element rather than
+ * a two-word cell each, followed by the given tail.
+ */
+struct runtime_list {
+    long *elements;
+    unsigned long count;
+    unsigned long capacity;
+};
+
+void runtime_listInit(struct runtime_list *xs);
+void runtime_listAppend(struct runtime_list *xs, long x);
+long runtime_listFinish(struct runtime_list *xs, long tail);
+long runtime_listReverse(long xs);
 long prim_genTmp(void);
 long prim_genLabel(void);
 
+/*
+ * Persistent maps keyed by fixnums, strings and ids. Updates return a new
+ * map and leave the old one intact.
+ */
+long prim_mapEmpty(void);
+long prim_mapGet(long m, long k, long otherwise);
+long prim_mapPut(long m, long k, long v);
+long prim_mapRemove(long m, long k);
+long prim_mapSize(long m);
+
+/*
+ * Immutable vectors: a length followed by the elements in one allocation.
+ */
+long prim_vectorMake(long n, long x);
+long prim_vectorFromList(long xs);
+long prim_vectorLength(long v);
+long prim_vectorRef(long v, long i);
+
+/*
+ * Fork/join on a work-stealing pool. f is a toplevel function of one
+ * argument; the generated code passes its address.
+ */
+long prim_spawn(long f, long x);
+long prim_join(long t);
+long prim_parMap(long xs, long f);
+
+/*
+ * Buffered I/O on file descriptors given as fixnums. fdRead returns the
+ * next chunk of input as a string, or Nil at end of file.
+ */
+long prim_fdRead(long fd);
+long prim_fdWrite(long fd, long x);
+long prim_fdFlush(long fd);
+long prim_stringLength(long s);
+long prim_stringRef(long s, long i);
+
+/*
+ * Calls the function f with n arguments through the memo table that *table
+ * points to once made, and that reports under name. The printer and the
+ * assembler route functions named memo followed by a capital letter here.
+ * runtime_memoReport writes the hits and misses of each table to standard
+ * error, as happens at exit when CHISA_MEMO_STATS is set.
+ */
+#define RUNTIME_MEMO_MAX_ARGS 4
+
+long runtime_memoCall(long *table, const char *name, long f, int n,
+        const long *args);
+void runtime_memoReport(void);
+
 int runtime_isPrim(const char *name);
 
 extern unsigned char runtime_classArities[];
@@ -38,6 +156,9 @@ enum {
     CLASS_Nil,
     CLASS_Cons,
     CLASS_Id,
+    CLASS_Map,
+    CLASS_Vector,
+    CLASS_Task,
     CLASS_HiDefineVar,
     CLASS_HiDefineFunc,
     CLASS_HiDefineCons,
@@ -59,6 +180,7 @@ enum {
     CLASS_FiCall,
     CLASS_FiGoto,
     CLASS_FiReturn,
+    CLASS_FiReturnValues,
     CLASS_FiMatch,
     CLASS_FiCase,
     CLASS_FiElse,
@@ -82,6 +204,31 @@ static inline long Id(long name)
     return runtime_makeTuple1(CLASS_Id, name);
 }
 
+static inline long HiDefineVar(long id, long x)
+{
+    return runtime_makeTuple2(CLASS_HiDefineVar, id, x);
+}
+
+static inline long HiDefineFunc(long id, long args, long block)
+{
+    return runtime_makeTuple3(CLASS_HiDefineFunc, id, args, block);
+}
+
+static inline long HiDefineCons(long id, long args)
+{
+    return runtime_makeTuple2(CLASS_HiDefineCons, id, args);
+}
+
+static inline long HiDefineByMatch(long c, long args, long block)
+{
+    return runtime_makeTuple3(CLASS_HiDefineByMatch, c, args, block);
+}
+
+static inline long HiFunc(long args, long block)
+{
+    return runtime_makeTuple2(CLASS_HiFunc, args, block);
+}
+
 static inline long HiBegin(long forms)
 {
     return runtime_makeTuple1(CLASS_HiBegin, forms);
@@ -92,6 +239,11 @@ static inline long HiBlock(long expr, long defines)
     return runtime_makeTuple2(CLASS_HiBlock, expr, defines);
 }
 
+static inline long HiCall(long f, long args)
+{
+    return runtime_makeTuple2(CLASS_HiCall, f, args);
+}
+
 static inline long HiMatch(long test, long clauses)
 {
     return runtime_makeTuple2(CLASS_HiMatch, test, clauses);
@@ -102,6 +254,11 @@ static inline long HiCase(long c, long args, long block)
     return runtime_makeTuple3(CLASS_HiCase, c, args, block);
 }
 
+static inline long HiElse(long block)
+{
+    return runtime_makeTuple1(CLASS_HiElse, block);
+}
+
 static inline long FiDefineVar(long id, long x)
 {
     return runtime_makeTuple2(CLASS_FiDefineVar, id, x);
@@ -142,6 +299,11 @@ static inline long FiReturn(long x)
     return runtime_makeTuple1(CLASS_FiReturn, x);
 }
 
+static inline long FiReturnValues(long xs)
+{
+    return runtime_makeTuple1(CLASS_FiReturnValues, xs);
+}
+
 static inline long FiMatch(long test, long clauses)
 {
     return runtime_makeTuple2(CLASS_FiMatch, test, clauses);
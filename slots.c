@@ -0,0 +1,395 @@
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "names.h"
+#include "runtime.h"
+#include "fi.h"
+#include "slots.h"
+#include "util.h"
+
+#define WORD_BITS (8 * sizeof(unsigned long))
+
+static void *allocate(size_t size)
+{
+    void *p;
+
+    p = calloc(1, size);
+    if (p == NULL)
+        die("Failed to allocate memory.");
+    return p;
+}
+
+/*
+ * Fixed size bit sets, one row per variable.
+ */
+static int setWords(int n)
+{
+    return (n + WORD_BITS - 1) / WORD_BITS;
+}
+
+static int setHas(const unsigned long *set, int i)
+{
+    return (set[i / WORD_BITS] >> (i % WORD_BITS)) & 1;
+}
+
+static void setAdd(unsigned long *set, int i)
+{
+    set[i / WORD_BITS] |= 1UL << (i % WORD_BITS);
+}
+
+static void setRemove(unsigned long *set, int i)
+{
+    set[i / WORD_BITS] &= ~(1UL << (i % WORD_BITS));
+}
+
+struct function {
+    struct names vars;
+    struct names labels;
+    int nrBlocks;
+    long *blocks;
+    int words;
+    unsigned long *liveIn;
+    unsigned long *interfere;
+    int *moves;
+};
+
+static long blockArgs(long block)
+{
+    long id, args, stmts, transfer;
+
+    if (!match(block, CLASS_FiBlock, &id, &args, &stmts, &transfer))
+        die("Expected a block.");
+    return args;
+}
+
+static long labelArgs(struct function *fn, long label)
+{
+    int i;
+
+    i = names_find(&fn->labels, label);
+    if (i < 0)
+        die("Failed to find arguments for block.");
+    return blockArgs(fn->blocks[i]);
+}
+
+static void interfere(struct function *fn, int a, int b)
+{
+    if (a < 0 || b < 0 || a == b)
+        return;
+    setAdd(fn->interfere + a * fn->words, b);
+    setAdd(fn->interfere + b * fn->words, a);
+}
+
+static void interfereWithSet(struct function *fn, int a,
+        const unsigned long *set)
+{
+    int i;
+
+    for (i = 0; i < fn->vars.nr; i++)
+        if (setHas(set, i))
+            interfere(fn, a, i);
+}
+
+static void use(struct function *fn, unsigned long *live, long id)
+{
+    int i;
+
+    if (runtime_class(id) != CLASS_Id)
+        return;
+    i = names_find(&fn->vars, id);
+    if (i >= 0)
+        setAdd(live, i);
+}
+
+static void useAll(struct function *fn, unsigned long *live, long ids)
+{
+    long id;
+
+    forEach(ids, id)
+        use(fn, live, id);
+}
+
+static void useExpr(struct function *fn, unsigned long *live, long expr)
+{
+    long id, args;
+
+    if (match(expr, CLASS_FiPrimApp, &id, &args)
+            || match(expr, CLASS_FiConsApp, &id, &args))
+        useAll(fn, live, args);
+    else
+        use(fn, live, expr);
+}
+
+/*
+ * Adds the live-out set of a block to live, i.e. the union of the live-in
+ * sets of its successors.
+ */
+static void liveOut(struct function *fn, long transfer, unsigned long *live)
+{
+    long ret, id, args, clauses, clause, cons, label;
+    int i, w;
+
+    if (match(transfer, CLASS_FiCall, &ret, &id, &args)) {
+        if (runtime_class(ret) != CLASS_Id)
+            return;
+        label = ret;
+    } else if (match(transfer, CLASS_FiGoto, &id, &args)) {
+        label = id;
+    } else if (match(transfer, CLASS_FiMatch, &id, &clauses)) {
+        forEach(clauses, clause) {
+            if (!match(clause, CLASS_FiCase, &cons, &label))
+                match(clause, CLASS_FiElse, &label);
+            i = names_find(&fn->labels, label);
+            for (w = 0; i >= 0 && w < fn->words; w++)
+                live[w] |= fn->liveIn[i * fn->words + w];
+        }
+        return;
+    } else {
+        return;
+    }
+
+    i = names_find(&fn->labels, label);
+    for (w = 0; i >= 0 && w < fn->words; w++)
+        live[w] |= fn->liveIn[i * fn->words + w];
+}
+
+static void useTransfer(struct function *fn, long transfer,
+        unsigned long *live)
+{
+    long ret, id, args, clauses;
+
+    if (match(transfer, CLASS_FiCall, &ret, &id, &args))
+        useAll(fn, live, args);
+    else if (match(transfer, CLASS_FiGoto, &id, &args))
+        useAll(fn, live, args);
+    else if (match(transfer, CLASS_FiReturn, &id))
+        use(fn, live, id);
+    else if (match(transfer, CLASS_FiReturnValues, &args))
+        useAll(fn, live, args);
+    else if (match(transfer, CLASS_FiMatch, &id, &clauses))
+        use(fn, live, id);
+}
+
+/*
+ * Computes the variables live on entry to block b (before its arguments are
+ * bound) into live. If record is set, interference edges are added along
+ * the way.
+ */
+static void scanBlock(struct function *fn, int b, unsigned long *live,
+        int record)
+{
+    long id, args, stmts, transfer, stmt, x, expr, arg;
+    long *reversed;
+    int i, n, v;
+
+    match(fn->blocks[b], CLASS_FiBlock, &id, &args, &stmts, &transfer);
+
+    memset(live, 0, fn->words * sizeof(unsigned long));
+    liveOut(fn, transfer, live);
+    useTransfer(fn, transfer, live);
+
+    n = length(stmts);
+    reversed = allocate((n + 1) * sizeof(long));
+    i = n;
+    forEach(stmts, stmt)
+        reversed[--i] = stmt;
+    for (i = 0; i < n; i++) {
+        match(reversed[i], CLASS_FiStmt, &x, &expr);
+        v = names_find(&fn->vars, x);
+        if (record)
+            interfereWithSet(fn, v, live);
+        if (v >= 0)
+            setRemove(live, v);
+        useExpr(fn, live, expr);
+    }
+    free(reversed);
+
+    forEach(args, arg) {
+        v = names_find(&fn->vars, arg);
+        if (record) {
+            long other;
+
+            interfereWithSet(fn, v, live);
+            forEach(args, other)
+                interfere(fn, v, names_find(&fn->vars, other));
+        }
+    }
+    forEach(args, arg)
+        if ((v = names_find(&fn->vars, arg)) >= 0)
+            setRemove(live, v);
+}
+
+/*
+ * Blocks receive their arguments by sequential assignment in the jumping
+ * block, so a formal must not share a slot with an actual that is read after
+ * the formal has been written. The same holds for the scrutinee of a match
+ * whose fields are fetched into the arguments of the case blocks.
+ */
+static void edgeConstraints(struct function *fn, long transfer)
+{
+    long id, args, clauses, clause, cons, label, formal, actual, rest;
+    int f, a;
+
+    if (match(transfer, CLASS_FiGoto, &id, &args)) {
+        forEach(labelArgs(fn, id), formal) {
+            f = names_find(&fn->vars, formal);
+            if (!match(args, CLASS_Cons, &actual, &rest))
+                die("Wrong number of arguments in goto.");
+            a = names_find(&fn->vars, actual);
+            if (f >= 0 && a >= 0 && !setHas(fn->interfere + f * fn->words, a))
+                fn->moves[f] = a;
+            args = rest;
+            forEach(args, actual)
+                interfere(fn, f, names_find(&fn->vars, actual));
+        }
+    } else if (match(transfer, CLASS_FiMatch, &id, &clauses)) {
+        a = names_find(&fn->vars, id);
+        forEach(clauses, clause)
+            if (match(clause, CLASS_FiCase, &cons, &label))
+                forEach(labelArgs(fn, label), formal)
+                    interfere(fn, a, names_find(&fn->vars, formal));
+    }
+}
+
+static void collect(struct function *fn, long blocks)
+{
+    long id, args, stmts, transfer, block, arg, stmt, x, expr;
+    int i = 0;
+
+    fn->nrBlocks = length(blocks);
+
+    names_init(&fn->vars);
+    names_init(&fn->labels);
+    fn->blocks = allocate((fn->nrBlocks + 1) * sizeof(long));
+
+    forEach(blocks, block) {
+        match(block, CLASS_FiBlock, &id, &args, &stmts, &transfer);
+        fn->blocks[i++] = block;
+        names_add(&fn->labels, id);
+        forEach(args, arg)
+            names_add(&fn->vars, arg);
+        forEach(stmts, stmt)
+            if (match(stmt, CLASS_FiStmt, &x, &expr))
+                names_add(&fn->vars, x);
+    }
+
+    fn->words = setWords(fn->vars.nr);
+    fn->liveIn = allocate((fn->nrBlocks * fn->words + 1)
+            * sizeof(unsigned long));
+    fn->interfere = allocate((fn->vars.nr * fn->words + 1)
+            * sizeof(unsigned long));
+    fn->moves = allocate((fn->vars.nr + 1) * sizeof(int));
+    for (i = 0; i < fn->vars.nr; i++)
+        fn->moves[i] = -1;
+}
+
+static void analyze(struct function *fn)
+{
+    unsigned long *live;
+    int b, w, changed;
+
+    live = allocate((fn->words + 1) * sizeof(unsigned long));
+
+    /*
+     * Iterate to a fixed point, visiting blocks backwards since most edges
+     * point forwards in the source order.
+     */
+    do {
+        changed = 0;
+        for (b = fn->nrBlocks - 1; b >= 0; b--) {
+            scanBlock(fn, b, live, 0);
+            for (w = 0; w < fn->words; w++) {
+                if (live[w] != fn->liveIn[b * fn->words + w]) {
+                    fn->liveIn[b * fn->words + w] = live[w];
+                    changed = 1;
+                }
+            }
+        }
+    } while (changed);
+
+    for (b = 0; b < fn->nrBlocks; b++)
+        scanBlock(fn, b, live, 1);
+
+    for (b = 0; b < fn->nrBlocks; b++) {
+        long id, args, stmts, transfer;
+
+        match(fn->blocks[b], CLASS_FiBlock, &id, &args, &stmts, &transfer);
+        edgeConstraints(fn, transfer);
+    }
+
+    free(live);
+}
+
+static int slotFree(struct slots *slots, struct function *fn, int v, int s)
+{
+    int u;
+
+    for (u = 0; u < v; u++)
+        if (slots->slotOf[u] == s && setHas(fn->interfere + v * fn->words, u))
+            return 0;
+    return 1;
+}
+
+/*
+ * Greedy coloring in order of definition. A block argument prefers the slot
+ * of the value it is most often copied from so that the copy disappears.
+ */
+static void color(struct slots *slots, struct function *fn)
+{
+    int v, s, m;
+
+    slots->slotNames = allocate((fn->vars.nr + 1) * sizeof(long));
+
+    for (v = 0; v < fn->vars.nr; v++) {
+        m = fn->moves[v];
+        if (m >= 0 && m < v && slotFree(slots, fn, v, slots->slotOf[m])) {
+            slots->slotOf[v] = slots->slotOf[m];
+            continue;
+        }
+        for (s = 0; !slotFree(slots, fn, v, s); s++)
+            ;
+        slots->slotOf[v] = s;
+        if (s == slots->nrSlots)
+            slots->slotNames[slots->nrSlots++] = fn->vars.ids[v];
+    }
+}
+
+void slots_init(struct slots *slots, long blocks)
+{
+    struct function fn;
+
+    collect(&fn, blocks);
+    analyze(&fn);
+
+    slots->vars = fn.vars;
+    slots->slotOf = allocate((fn.vars.nr + 1) * sizeof(int));
+    slots->nrSlots = 0;
+    color(slots, &fn);
+
+    names_release(&fn.labels);
+    free(fn.blocks);
+    free(fn.liveIn);
+    free(fn.interfere);
+    free(fn.moves);
+}
+
+int slots_lookup(struct slots *slots, long id)
+{
+    int v;
+
+    v = names_find(&slots->vars, id);
+    return v < 0 ? -1 : slots->slotOf[v];
+}
+
+long slots_name(struct slots *slots, int slot)
+{
+    return slots->slotNames[slot];
+}
+
+void slots_release(struct slots *slots)
+{
+    names_release(&slots->vars);
+    free(slots->slotOf);
+    free(slots->slotNames);
+}
@@ -0,0 +1,16 @@
+/*
+ * Stack slot allocation for the locals of a FI function. Block arguments and
+ * set targets whose live ranges do not interfere share a slot; each slot is
+ * named after one of the variables assigned to it.
+ */
+struct slots {
+    struct names vars;
+    int *slotOf;
+    int nrSlots;
+    long *slotNames;
+};
+
+void slots_init(struct slots *slots, long blocks);
+int slots_lookup(struct slots *slots, long id);
+long slots_name(struct slots *slots, int slot);
+void slots_release(struct slots *slots);
@@ -0,0 +1,142 @@
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "names.h"
+#include "runtime.h"
+#include "fi.h"
+#include "strip.h"
+#include "util.h"
+
+/*
+ * Whole-program reachability.
+ *
+ * Starting from the functions that C code calls, a definition is live if a
+ * live function names it: as a callee, as a constructor it applies or
+ * matches, or as a variable, which may be a global or a function passed as
+ * a value. Everything else is dropped. The printer and the assembler number
+ * classes in order of definition, so dropping unused constructors also
+ * keeps the class numbers, and the jump tables of matches, dense.
+ *
+ * A program without any of the roots is a library for some other C caller
+ * and is left alone.
+ */
+static const char *roots[] = {
+    "compile", "main",
+};
+
+struct reach {
+    struct names defs;
+    long *bodies;
+    char *live;
+    int *stack;
+    int depth;
+};
+
+static void reachId(struct reach *r, long id)
+{
+    int i;
+
+    if (runtime_class(id) != CLASS_Id)
+        return;
+    i = names_find(&r->defs, id);
+    if (i < 0 || r->live[i])
+        return;
+    r->live[i] = 1;
+    r->stack[r->depth++] = i;
+}
+
+static void reachIds(struct reach *r, long ids)
+{
+    long id;
+
+    forEach(ids, id)
+        reachId(r, id);
+}
+
+static void reachBlock(struct reach *r, long block)
+{
+    long id, args, stmts, transfer, stmt, x, expr, f, ret, label, clauses;
+    long clause, cons;
+
+    match(block, CLASS_FiBlock, &id, &args, &stmts, &transfer);
+    forEach(stmts, stmt) {
+        match(stmt, CLASS_FiStmt, &x, &expr);
+        if (match(expr, CLASS_FiPrimApp, &f, &args)) {
+            reachIds(r, args);
+        } else if (match(expr, CLASS_FiConsApp, &f, &args)) {
+            reachId(r, f);
+            reachIds(r, args);
+        } else {
+            reachId(r, expr);
+        }
+    }
+
+    if (match(transfer, CLASS_FiCall, &ret, &f, &args)) {
+        reachId(r, f);
+        reachIds(r, args);
+    } else if (match(transfer, CLASS_FiGoto, &label, &args)
+            || match(transfer, CLASS_FiReturnValues, &args)) {
+        reachIds(r, args);
+    } else if (match(transfer, CLASS_FiReturn, &x)) {
+        reachId(r, x);
+    } else if (match(transfer, CLASS_FiMatch, &x, &clauses)) {
+        reachId(r, x);
+        forEach(clauses, clause)
+            if (match(clause, CLASS_FiCase, &cons, &label))
+                reachId(r, cons);
+    }
+}
+
+long stripUnreachable(long fi)
+{
+    struct reach r;
+    long def, id, args, value, blocks, block, result = nil;
+    int i, n, found = 0;
+
+    n = length(fi);
+    r.bodies = calloc(n + 1, sizeof(long));
+    r.live = calloc(n + 1, 1);
+    r.stack = malloc((n + 1) * sizeof(int));
+    if (r.bodies == NULL || r.live == NULL || r.stack == NULL)
+        die("Failed to allocate memory.");
+    r.depth = 0;
+
+    names_init(&r.defs);
+    forEach(fi, def) {
+        if (match(def, CLASS_FiDefineFunc, &id, &args, &blocks))
+            r.bodies[names_add(&r.defs, id)] = blocks;
+        else if (match(def, CLASS_FiDefineCons, &id, &args)
+                || match(def, CLASS_FiDefineVar, &id, &value))
+            r.bodies[names_add(&r.defs, id)] = nil;
+    }
+
+    for (i = 0; i < ARRAY_SIZE(roots); i++) {
+        id = Id(runtime_makeString(roots[i]));
+        if (names_find(&r.defs, id) >= 0) {
+            reachId(&r, id);
+            found = 1;
+        }
+    }
+
+    while (r.depth > 0) {
+        i = r.stack[--r.depth];
+        forEach(r.bodies[i], block)
+            reachBlock(&r, block);
+    }
+
+    forEach(fi, def) {
+        if (found && (match(def, CLASS_FiDefineFunc, &id, &args, &blocks)
+                || match(def, CLASS_FiDefineCons, &id, &args)
+                || match(def, CLASS_FiDefineVar, &id, &value))
+                && !r.live[names_find(&r.defs, id)])
+            continue;
+        result = prim_cons(def, result);
+    }
+
+    names_release(&r.defs);
+    free(r.stack);
+    free(r.live);
+    free(r.bodies);
+    return reverse(result);
+}
@@ -0,0 +1 @@
+long stripUnreachable(long fi);
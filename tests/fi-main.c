@@ -0,0 +1,18 @@
+#include "runtime.h"
+
+/*
+ * Driver for the FI programs in tests/. They define compile, which fic
+ * keeps and leaves returning a single value, and write their results to
+ * standard output.
+ */
+
+void compiler_init(void);
+long compile(long xs);
+
+int main(void)
+{
+    runtime_init();
+    compiler_init();
+    compile(nil);
+    return 0;
+}
@@ -0,0 +1,51 @@
+#!/bin/sh
+# Runs the HI programs in tests/ with hirun: as they are, after fusion, after
+# closure conversion and after both, as in bootstrap1. Each run must write
+# tests/NAME.out, and hirun -v must report what the '#!' lines of the program
+# say.
+#
+# The FI programs in tests/ are compiled by fic at each level and with both
+# backends, linked with tests/fi-main.c, and must likewise write
+# tests/NAME.out.
+
+cd "$(dirname "$0")/.." || exit 1
+failed=0
+n=0
+tmp=$(mktemp -d) || exit 1
+trap 'rm -rf "$tmp"' EXIT
+for t in tests/*.hi; do
+    n=$((n + 1))
+    want=${t%.hi}.out
+    for flags in "" "-f" "-c" "-f -c"; do
+        if ! ./hirun $flags $t 2>&1 | cmp -s - $want; then
+            echo "FAIL: hirun $flags $t"
+            failed=1
+        fi
+    done
+    stats=$(./hirun -v -f -c $t 2>&1 >/dev/null)
+    missing=$(grep '^#!' $t | grep -vxF -e "$stats")
+    if [ -n "$missing" ]; then
+        echo "FAIL: hirun -v -f -c $t does not report: $missing"
+        failed=1
+    fi
+done
+for t in tests/*.fi; do
+    n=$((n + 1))
+    want=${t%.fi}.out
+    for flags in "-O0" "-O1" "-O2" "-O0 -S" "-O2 -S"; do
+        case $flags in
+        *-S) out=$tmp/t.s;;
+        *) out=$tmp/t.c;;
+        esac
+        if ! ./fic $flags $t >$out \
+                || ! cc -std=c99 -w -I. -c -o $tmp/t.o $out \
+                || ! cc -pthread -I. -o $tmp/t $tmp/t.o tests/fi-main.c \
+                    runtime.o util.o \
+                || ! $tmp/t 2>&1 | cmp -s - $want; then
+            echo "FAIL: fic $flags $t"
+            failed=1
+        fi
+    done
+done
+[ $failed = 0 ] && echo "All $n tests passed."
+exit $failed
@@ -0,0 +1,476 @@
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "names.h"
+#include "runtime.h"
+#include "fi.h"
+#include "unbox.h"
+#include "util.h"
+
+/*
+ * Scalar replacement of short-lived tuples.
+ *
+ * A tuple that is built in a block and matched at the end of the same block
+ * is replaced by a goto that passes its fields directly to the case block.
+ *
+ * A function whose returns all build a tuple of the same class right before
+ * returning it, and whose callers all match the result immediately, instead
+ * returns the fields as multiple values. Its callers continue directly in
+ * the case block, which receives the fields as block arguments.
+ */
+
+/*
+ * Functions called from C code outside the FI program must keep returning a
+ * single value.
+ */
+static const char *entryPoints[] = {
+    "compile", "main",
+};
+
+struct function {
+    long name;
+    long args;
+    long blocks;
+    struct names labels;
+    long *block;
+    struct names vars;
+    int *uses;
+    int usesSize;
+    int candidate;
+    long class;
+};
+
+struct program {
+    struct names funcs;
+    struct function *fns;
+    struct names conses;
+    int *arities;
+};
+
+static void *allocate(size_t size)
+{
+    void *p;
+
+    p = calloc(1, size);
+    if (p == NULL)
+        die("Failed to allocate memory.");
+    return p;
+}
+
+static int isEntryPoint(long name)
+{
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(entryPoints); i++)
+        if (!strcmp(entryPoints[i], idString(name)))
+            return 1;
+    return 0;
+}
+
+static void countUse(struct function *fn, long x)
+{
+    int i, nr;
+
+    if (runtime_class(x) != CLASS_Id)
+        return;
+    nr = fn->vars.nr;
+    i = names_add(&fn->vars, x);
+    if (i == fn->usesSize) {
+        fn->usesSize = 2 * fn->usesSize + 16;
+        fn->uses = realloc(fn->uses, fn->usesSize * sizeof(int));
+        if (fn->uses == NULL)
+            die("Failed to allocate memory.");
+    }
+    if (fn->vars.nr > nr)
+        fn->uses[i] = 0;
+    fn->uses[i]++;
+}
+
+static void countUses(struct function *fn, long xs)
+{
+    long x;
+
+    forEach(xs, x)
+        countUse(fn, x);
+}
+
+static int uses(struct function *fn, long x)
+{
+    int i;
+
+    i = names_find(&fn->vars, x);
+    return i < 0 ? 0 : fn->uses[i];
+}
+
+static void indexFunction(struct function *fn)
+{
+    long block, id, args, stmts, transfer, stmt, x, expr, ret, f, clauses;
+    int i = 0;
+
+    names_init(&fn->labels);
+    names_init(&fn->vars);
+    fn->uses = NULL;
+    fn->usesSize = 0;
+    fn->block = allocate((length(fn->blocks) + 1) * sizeof(long));
+
+    forEach(fn->blocks, block) {
+        match(block, CLASS_FiBlock, &id, &args, &stmts, &transfer);
+        names_add(&fn->labels, id);
+        fn->block[i++] = block;
+
+        forEach(stmts, stmt) {
+            match(stmt, CLASS_FiStmt, &x, &expr);
+            if (match(expr, CLASS_FiPrimApp, &id, &args)
+                    || match(expr, CLASS_FiConsApp, &id, &args))
+                countUses(fn, args);
+            else
+                countUse(fn, expr);
+        }
+        if (match(transfer, CLASS_FiCall, &ret, &f, &args))
+            countUses(fn, args);
+        else if (match(transfer, CLASS_FiGoto, &id, &args))
+            countUses(fn, args);
+        else if (match(transfer, CLASS_FiReturn, &x))
+            countUse(fn, x);
+        else if (match(transfer, CLASS_FiReturnValues, &args))
+            countUses(fn, args);
+        else if (match(transfer, CLASS_FiMatch, &x, &clauses))
+            countUse(fn, x);
+    }
+}
+
+static void releaseFunction(struct function *fn)
+{
+    names_release(&fn->labels);
+    names_release(&fn->vars);
+    free(fn->uses);
+    free(fn->block);
+}
+
+static long findBlock(struct function *fn, long label)
+{
+    int i;
+
+    i = names_find(&fn->labels, label);
+    if (i < 0)
+        die("Failed to find block.");
+    return fn->block[i];
+}
+
+static int arity(struct program *prog, long class)
+{
+    int i;
+
+    i = names_find(&prog->conses, class);
+    return i < 0 ? -1 : prog->arities[i];
+}
+
+static int isAmong(long x, long xs)
+{
+    long y;
+
+    forEach(xs, y)
+        if (idEq(x, y))
+            return 1;
+    return 0;
+}
+
+/*
+ * Finds the statement of a block that builds x as a tuple. The fields can
+ * only stand for the tuple if neither x nor any of them is assigned after
+ * it, by that statement itself included.
+ */
+static int definingCons(long stmts, long x, long *class, long *args)
+{
+    long stmt, y, expr, c, cargs;
+    int found = 0;
+
+    forEach(stmts, stmt) {
+        match(stmt, CLASS_FiStmt, &y, &expr);
+        if (idEq(x, y) && match(expr, CLASS_FiConsApp, &c, &cargs))
+            *class = c, *args = cargs, found = !isAmong(x, cargs);
+        else if (found && (idEq(x, y) || isAmong(y, *args)))
+            found = 0;
+    }
+    return found;
+}
+
+/*
+ * Returns the label of the block that receives the fields of a tuple of the
+ * given class when matched by the transfer, or nil.
+ */
+static long caseTarget(struct program *prog, struct function *fn,
+        long clauses, long class)
+{
+    long clause, cons, label, id, args, stmts, transfer;
+
+    forEach(clauses, clause) {
+        if (match(clause, CLASS_FiCase, &cons, &label) && idEq(cons, class)) {
+            match(findBlock(fn, label), CLASS_FiBlock,
+                &id, &args, &stmts, &transfer);
+            if (length(args) != arity(prog, class))
+                return nil;
+            return label;
+        }
+    }
+    return nil;
+}
+
+/*
+ * A call to a function returning a tuple of the given class can continue
+ * directly in a case block if the continuation does nothing but match the
+ * result.
+ */
+static long unpackTarget(struct program *prog, struct function *fn,
+        long label, long class)
+{
+    long id, args, stmts, transfer, y, rest, x, clauses;
+
+    match(findBlock(fn, label), CLASS_FiBlock, &id, &args, &stmts, &transfer);
+    if (!match(args, CLASS_Cons, &y, &rest) || rest != nil || stmts != nil)
+        return nil;
+    if (!match(transfer, CLASS_FiMatch, &x, &clauses) || !idEq(x, y))
+        return nil;
+    if (uses(fn, y) != 1)
+        return nil;
+    return caseTarget(prog, fn, clauses, class);
+}
+
+static void classifyReturns(struct program *prog, struct function *fn)
+{
+    long block, id, args, stmts, transfer, x, class, fields;
+
+    /* The memo tables hold one value per call. */
+    fn->candidate = !isEntryPoint(fn->name) && !fi_isMemoized(fn->name);
+    fn->class = nil;
+
+    forEach(fn->blocks, block) {
+        match(block, CLASS_FiBlock, &id, &args, &stmts, &transfer);
+        if (match(transfer, CLASS_FiReturnValues, &args)) {
+            fn->candidate = 0;
+        } else if (match(transfer, CLASS_FiReturn, &x)) {
+            if (!definingCons(stmts, x, &class, &fields)
+                    || arity(prog, class) < 1
+                    || (fn->class != nil && !idEq(fn->class, class)))
+                fn->candidate = 0;
+            else
+                fn->class = class;
+        }
+    }
+}
+
+static struct function *findFunction(struct program *prog, long name)
+{
+    int i;
+
+    i = names_find(&prog->funcs, name);
+    return i < 0 ? NULL : &prog->fns[i];
+}
+
+/*
+ * A function that only tail calls returns whatever its callees return.
+ */
+static void inferTailClasses(struct program *prog)
+{
+    struct function *fn, *g;
+    long block, id, args, stmts, transfer, ret, f;
+    int i, changed;
+
+    do {
+        changed = 0;
+        for (i = 0; i < prog->funcs.nr; i++) {
+            fn = &prog->fns[i];
+            if (!fn->candidate || fn->class != nil)
+                continue;
+            forEach(fn->blocks, block) {
+                match(block, CLASS_FiBlock, &id, &args, &stmts, &transfer);
+                if (match(transfer, CLASS_FiCall, &ret, &f, &args)
+                        && runtime_class(ret) == CLASS_Nil
+                        && (g = findFunction(prog, f)) != NULL
+                        && g->candidate && g->class != nil) {
+                    fn->class = g->class;
+                    changed = 1;
+                    break;
+                }
+            }
+        }
+    } while (changed);
+
+    for (i = 0; i < prog->funcs.nr; i++)
+        if (prog->fns[i].class == nil)
+            prog->fns[i].candidate = 0;
+}
+
+static int sameClass(struct function *f, struct function *g)
+{
+    return f->candidate && g->candidate && idEq(f->class, g->class);
+}
+
+/*
+ * Drops candidates that are tail called by or tail call a function of
+ * another kind, or that have a call site that needs the tuple. Repeats
+ * until nothing changes.
+ */
+static void filterCandidates(struct program *prog)
+{
+    struct function *h, *g;
+    long block, id, args, stmts, transfer, ret, f;
+    int i, changed;
+
+    do {
+        changed = 0;
+        for (i = 0; i < prog->funcs.nr; i++) {
+            h = &prog->fns[i];
+            forEach(h->blocks, block) {
+                match(block, CLASS_FiBlock, &id, &args, &stmts, &transfer);
+                if (!match(transfer, CLASS_FiCall, &ret, &f, &args))
+                    continue;
+                g = findFunction(prog, f);
+                if (runtime_class(ret) == CLASS_Nil) {
+                    if (h->candidate && (g == NULL || !sameClass(h, g)))
+                        h->candidate = 0, changed = 1;
+                    if (g != NULL && g->candidate && !sameClass(h, g))
+                        g->candidate = 0, changed = 1;
+                } else if (g != NULL && g->candidate) {
+                    if (unpackTarget(prog, h, ret, g->class) == nil)
+                        g->candidate = 0, changed = 1;
+                }
+            }
+        }
+    } while (changed);
+}
+
+/*
+ * Functions that are passed around as values cannot change their calling
+ * convention.
+ */
+static void excludeReferenced(struct program *prog)
+{
+    struct function *fn, *g;
+    int i, j;
+
+    for (i = 0; i < prog->funcs.nr; i++) {
+        fn = &prog->fns[i];
+        for (j = 0; j < fn->vars.nr; j++)
+            if ((g = findFunction(prog, fn->vars.ids[j])) != NULL)
+                g->candidate = 0;
+    }
+}
+
+static long removeStmt(long stmts, long x)
+{
+    long stmt, y, expr, kept = nil;
+
+    forEach(stmts, stmt) {
+        match(stmt, CLASS_FiStmt, &y, &expr);
+        if (!idEq(x, y))
+            kept = prim_cons(stmt, kept);
+    }
+    return reverse(kept);
+}
+
+static long rewriteBlock(struct program *prog, struct function *fn,
+        long block)
+{
+    struct function *g;
+    long id, args, stmts, transfer, x, class, fields, first, rest, ret, f;
+    long callArgs, clauses, clause, label;
+
+    match(block, CLASS_FiBlock, &id, &args, &stmts, &transfer);
+
+    if (match(transfer, CLASS_FiReturn, &x) && fn->candidate) {
+        definingCons(stmts, x, &class, &fields);
+        if (match(fields, CLASS_Cons, &first, &rest) && rest == nil)
+            transfer = FiReturn(first);
+        else
+            transfer = FiReturnValues(fields);
+        if (uses(fn, x) == 1)
+            stmts = removeStmt(stmts, x);
+    } else if (match(transfer, CLASS_FiCall, &ret, &f, &callArgs)) {
+        g = findFunction(prog, f);
+        if (runtime_class(ret) == CLASS_Id && g != NULL && g->candidate) {
+            label = unpackTarget(prog, fn, ret, g->class);
+            transfer = FiCall(label, f, callArgs);
+        }
+    } else if (match(transfer, CLASS_FiMatch, &x, &clauses)) {
+        if (definingCons(stmts, x, &class, &fields)
+                && length(fields) == arity(prog, class)) {
+            label = caseTarget(prog, fn, clauses, class);
+            if (label != nil) {
+                transfer = FiGoto(label, fields);
+            } else {
+                forEach(clauses, clause)
+                    if (match(clause, CLASS_FiElse, &label))
+                        transfer = FiGoto(label, nil);
+            }
+            if (runtime_class(transfer) == CLASS_FiGoto && uses(fn, x) == 1)
+                stmts = removeStmt(stmts, x);
+        }
+    }
+
+    return FiBlock(id, args, stmts, transfer);
+}
+
+static long rewriteFunction(struct program *prog, struct function *fn)
+{
+    long block, blocks = nil;
+
+    forEach(fn->blocks, block)
+        blocks = prim_cons(rewriteBlock(prog, fn, block), blocks);
+    blocks = fi_reachableBlocks(reverse(blocks));
+
+    return FiDefineFunc(fn->name, fn->args, blocks);
+}
+
+long unboxTuples(long fi)
+{
+    struct program prog;
+    struct function *fn;
+    long def, id, args, blocks, result = nil;
+    int i;
+
+    names_init(&prog.funcs);
+    names_init(&prog.conses);
+    forEach(fi, def) {
+        if (match(def, CLASS_FiDefineFunc, &id, &args, &blocks))
+            names_add(&prog.funcs, id);
+        else if (match(def, CLASS_FiDefineCons, &id, &args))
+            names_add(&prog.conses, id);
+    }
+
+    prog.fns = allocate((prog.funcs.nr + 1) * sizeof(struct function));
+    prog.arities = allocate((prog.conses.nr + 1) * sizeof(int));
+    forEach(fi, def) {
+        if (match(def, CLASS_FiDefineFunc, &id, &args, &blocks)) {
+            fn = &prog.fns[names_find(&prog.funcs, id)];
+            fn->name = id;
+            fn->args = args;
+            fn->blocks = blocks;
+            indexFunction(fn);
+        } else if (match(def, CLASS_FiDefineCons, &id, &args)) {
+            prog.arities[names_find(&prog.conses, id)] = length(args);
+        }
+    }
+
+    for (i = 0; i < prog.funcs.nr; i++)
+        classifyReturns(&prog, &prog.fns[i]);
+    excludeReferenced(&prog);
+    inferTailClasses(&prog);
+    filterCandidates(&prog);
+
+    forEach(fi, def) {
+        if (match(def, CLASS_FiDefineFunc, &id, &args, &blocks))
+            def = rewriteFunction(&prog, findFunction(&prog, id));
+        result = prim_cons(def, result);
+    }
+
+    for (i = 0; i < prog.funcs.nr; i++)
+        releaseFunction(&prog.fns[i]);
+    free(prog.fns);
+    free(prog.arities);
+    names_release(&prog.funcs);
+    names_release(&prog.conses);
+
+    return reverse(result);
+}
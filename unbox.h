@@ -0,0 +1 @@
+long unboxTuples(long fi);
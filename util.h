@@ -1,4 +1,7 @@
 #define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
 
+#ifdef __GNUC__
+__attribute__((noreturn, cold))
+#endif
 void die(const char *e);
 void require64BitLongs(void);